@@ -385,3 +385,165 @@ void AssetManager_DestroyMesh(ObjMesh* mesh)
 	delete mesh;
 	// _aligned_free(mesh->tris);
 }
+
+// ---- TEXTURES ----
+
+size_t AssetManager_TextureSize(int width, int height, int numMips, TextureFormat format)
+{
+	size_t size = 0;
+	for (int i = 0; i < numMips; i++)
+	{
+		if (format == TextureFormat_BC1) size += (size_t)((width + 3) >> 2) * ((height + 3) >> 2) * 2;
+		else                             size += (size_t)width * height;
+		width = Max(width >> 1, 1); height = Max(height >> 1, 1);
+	}
+	return size;
+}
+
+static void UnpackRGB565(uint c, int rgb[3])
+{
+	uint r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+	rgb[0] = r << 3 | r >> 2;  rgb[1] = g << 2 | g >> 4;  rgb[2] = b << 3 | b >> 2;
+}
+
+// palette of the block, if c0 <= c1 block is in 3 color mode and last color is black
+static void BC1Palette(uint c0, uint c1, int palette[4][3])
+{
+	UnpackRGB565(c0, palette[0]);
+	UnpackRGB565(c1, palette[1]);
+	for (int c = 0; c < 3; c++)
+	{
+		if (c0 > c1) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		else {
+			palette[2][c] = (palette[0][c] + palette[1][c]) >> 1;
+			palette[3][c] = 0;
+		}
+	}
+}
+
+// bounding box end points, similar to: https://www.researchgate.net/publication/259000525_Real-Time_DXT_Compression
+static void EncodeBC1Block(const uint texels[16], uint* block)
+{
+	int minColor[3] = { 255, 255, 255 }, maxColor[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+		{
+			int v = texels[i] >> (c * 8) & 255;
+			minColor[c] = Min(minColor[c], v), maxColor[c] = Max(maxColor[c], v);
+		}
+
+	// use the channel with biggest range as reference and flip other channels 
+	// if they are decreasing while reference increasing, selects the right diagonal of the box
+	int ref = 0;
+	for (int c = 1; c < 3; c++) if (maxColor[c] - minColor[c] > maxColor[ref] - minColor[ref]) ref = c;
+	
+	int covariance[3] = { 0, 0, 0 };
+	int refCenter = (minColor[ref] + maxColor[ref]) >> 1;
+	for (int i = 0; i < 16; i++)
+	{
+		int refValue = (texels[i] >> (ref * 8) & 255) - refCenter;
+		for (int c = 0; c < 3; c++)
+			covariance[c] += refValue * ((int)(texels[i] >> (c * 8) & 255) - ((minColor[c] + maxColor[c]) >> 1));
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		// inset bounding box for reducing error of the end points
+		int inset = (maxColor[c] - minColor[c]) >> 4;
+		minColor[c] += inset, maxColor[c] -= inset;
+		if (covariance[c] < 0) { int temp = minColor[c]; minColor[c] = maxColor[c]; maxColor[c] = temp; }
+	}
+
+	uint c0 = (maxColor[0] >> 3) << 11 | (maxColor[1] >> 2) << 5 | (maxColor[2] >> 3);
+	uint c1 = (minColor[0] >> 3) << 11 | (minColor[1] >> 2) << 5 | (minColor[2] >> 3);
+	if (c0 < c1) { uint temp = c0; c0 = c1; c1 = temp; } // c0 > c1 means 4 color mode
+	
+	block[0] = c0 | (c1 << 16);
+	block[1] = 0u;
+	if (c0 == c1) return; // all of the indices are zero
+	
+	int palette[4][3];
+	BC1Palette(c0, c1, palette);
+
+	for (int i = 0; i < 16; i++)
+	{
+		int bestIndex = 0, bestDistance = 0x7FFFFFFF;
+		for (int p = 0; p < 4; p++)
+		{
+			int distance = 0;
+			for (int c = 0; c < 3; c++) {
+				int diff = (int)(texels[i] >> (c * 8) & 255) - palette[p][c];
+				distance += diff * diff;
+			}
+			if (distance < bestDistance) bestDistance = distance, bestIndex = p;
+		}
+		block[1] |= (uint)bestIndex << (i * 2);
+	}
+}
+
+void AssetManager_CompressBC1(const uint* texels, int width, int height, uint* blocks)
+{
+	uint blockTexels[16];
+	for (int y = 0; y < height; y += 4)
+	{
+		for (int x = 0; x < width; x += 4, blocks += 2)
+		{
+			// edge blocks of non multiple of 4 textures are filled with clamped texels
+			for (int i = 0; i < 16; i++)
+				blockTexels[i] = texels[Min(y + (i >> 2), height - 1) * width + Min(x + (i & 3), width - 1)];
+			EncodeBC1Block(blockTexels, blocks);
+		}
+	}
+}
+
+uint AssetManager_DecodeBC1Texel(const uint* blocks, int width, int x, int y)
+{
+	const uint* block = blocks + ((y >> 2) * ((width + 3) >> 2) + (x >> 2)) * 2;
+	uint index = block[1] >> (((y & 3) * 4 + (x & 3)) * 2) & 3;
+	int palette[4][3];
+	BC1Palette(block[0] & 0xFFFFu, block[0] >> 16, palette);
+	return 0xFF000000u | palette[index][0] | (palette[index][1] << 8) | (palette[index][2] << 16);
+}
+
+void AssetManager_SaveTextureToDisk(const char* path, const Texture* texture, const uint* data, size_t numUints)
+{
+	std::ofstream stream = std::ofstream(path, std::ios::out | std::ios::binary);
+	uint temp = CTextureVersion;
+	stream.write((char*)&temp, sizeof(uint));
+	stream.write((char*)&texture->width, sizeof(int));
+	stream.write((char*)&texture->height, sizeof(int));
+	stream.write((char*)&texture->numMips, sizeof(int));
+	stream.write((char*)&texture->format, sizeof(int));
+
+	for (int i = 0; i < texture->numMips; i++) {
+		int relativeOffset = texture->mipOffsets[i] - texture->offset;
+		stream.write((char*)&relativeOffset, sizeof(int));
+	}
+	stream.write((char*)&numUints, sizeof(size_t));
+	stream.write((char*)data, numUints * sizeof(uint));
+	stream.close();
+}
+
+bool AssetManager_LoadTextureFromDisk(const char* path, Texture* texture, uint* data, size_t maxUints, size_t* numUints)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	uint textureVersion;
+	stream.read((char*)&textureVersion, sizeof(uint));
+	if (textureVersion != CTextureVersion) return false;
+
+	stream.read((char*)&texture->width, sizeof(int));
+	stream.read((char*)&texture->height, sizeof(int));
+	stream.read((char*)&texture->numMips, sizeof(int));
+	stream.read((char*)&texture->format, sizeof(int));
+	if (texture->numMips > MaxMipLevels) return false;
+
+	stream.read((char*)texture->mipOffsets, sizeof(int) * texture->numMips);
+	stream.read((char*)numUints, sizeof(size_t));
+	if (!stream || *numUints > maxUints) return false;
+
+	stream.read((char*)data, *numUints * sizeof(uint));
+	return !!stream;
+}
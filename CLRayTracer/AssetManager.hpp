@@ -25,6 +25,18 @@ struct ObjMesh
 ObjMesh* AssetManager_ImportMesh(const char* path, Tri* triArena);
 void AssetManager_DestroyMesh(ObjMesh* mesh);
 
+// number of uint's needed for the texture with all of its mip levels
+size_t AssetManager_TextureSize(int width, int height, int numMips, TextureFormat format);
+// compresses rgba8 texels to bc1 blocks, alpha is ignored
+void AssetManager_CompressBC1(const uint* texels, int width, int height, uint* blocks);
+// returns rgba8 texel
+uint AssetManager_DecodeBC1Texel(const uint* blocks, int width, int x, int y);
+
+// .clt texture cache, mip offsets are relative to first level
+void AssetManager_SaveTextureToDisk(const char* path, const Texture* texture, const uint* data, size_t numUints);
+// returns false if file is out of date or there is not enough space in data
+bool AssetManager_LoadTextureFromDisk(const char* path, Texture* texture, uint* data, size_t maxUints, size_t* numUints);
+
 void AssetManager_Initialize();
 void AssetManager_Destroy();
 
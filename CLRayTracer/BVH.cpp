@@ -252,4 +252,19 @@ uint BuildBVH(Tri* tris, MeshInfo* meshes, int numMeshes, BVHNode* nodes, uint*
 	}
 	
 	return totalNodesUsed - nodesUsedStart;
-}
\ No newline at end of file
+}
+
+// gpu traversal walks up with parent links when its short stack overflows.
+// children of a node are adjacent, roots are their own parents
+void BuildBVHParents(const BVHNode* nodes, uint firstNode, uint numNodes, const uint* rootIndices, int numRoots, uint* parents)
+{
+	for (uint i = firstNode; i < firstNode + numNodes; ++i)
+	{
+		if (nodes[i].triCount > 0) continue;
+		parents[nodes[i].leftFirst] = i;
+		parents[nodes[i].leftFirst + 1] = i;
+	}
+
+	for (int i = 0; i < numRoots; ++i)
+		parents[rootIndices[i]] = rootIndices[i];
+}
@@ -1,5 +1,6 @@
 #include "CPURayTrace.hpp"
 #include "ResourceManager.hpp"
+#include "AssetManager.hpp"
 #include "Renderer.hpp"
 #include "Math/Matrix.hpp"
 #include <stdio.h>
@@ -19,7 +20,7 @@ extern uint* g_BVHIndices;
 extern Tri* g_Triangles  ;
 extern BVHNode* g_BVHNodes ;
 extern Material* g_Materials;
-extern RGB8* g_TexturePixels;
+extern uint* g_TexturePixels;
 extern Texture* g_Textures;
 // from Renderer.cpp
 extern MeshInstance* g_MeshInstances;
@@ -145,12 +146,12 @@ _NODISCARD FINLINE float3 ConvertToFloat3(const half* h) {
     );
 }
 
-_NODISCARD FINLINE uint MultiplyU32Colors(uint a, RGB8 b)
+_NODISCARD FINLINE uint MultiplyU32Colors(uint a, uint b)
 {
 	uint result = 0u;
-	result |= ((a & 0xffu) * b.r) >> 8u;
-	result |= ((((a >> 8u) & 0xffu) * b.g) >> 8u) << 8u;
-	result |= ((((a >> 16u) & 0xffu) * b.b) >> 8u) << 16u;
+	result |= ((a & 0xffu) * (b & 0xffu)) >> 8u;
+	result |= ((((a >> 8u) & 0xffu) * ((b >> 8u) & 0xffu)) >> 8u) << 8u;
+	result |= ((((a >> 16u) & 0xffu) * ((b >> 16u) & 0xffu)) >> 8u) << 16u;
 	return result;
 }
 
@@ -165,21 +166,23 @@ _NODISCARD FINLINE float3 UnpackRGB8u(uint u)
 	);
 }
 
-#define UNPACK_RGB8(rgb8) (float3(rgb8.r, rgb8.g, rgb8.b) * UcharToFloat01)
-
-inline int SampleTexture(Texture texture, float2 uv)
+// returns rgba8 texel
+inline uint SampleTexture(const Texture& texture, float2 uv)
 {
 	uv -= float2(Floor(uv.x), Floor(uv.y));
-	int uScaled = (int)(texture.width * uv.x); // (0, 1) to (0, TextureWidth )
-	int vScaled = (int)(texture.height * uv.y); // (0, 1) to (0, TextureHeight)
-	return vScaled * texture.width + texture.offset + uScaled;
+	int uScaled = Min((int)(texture.width * uv.x), texture.width - 1);   // (0, 1) to (0, TextureWidth )
+	int vScaled = Min((int)(texture.height * uv.y), texture.height - 1); // (0, 1) to (0, TextureHeight)
+	if (texture.format == TextureFormat_BC1)
+		return AssetManager_DecodeBC1Texel(g_TexturePixels + texture.offset, texture.width, uScaled, vScaled);
+	return g_TexturePixels[vScaled * texture.width + texture.offset + uScaled];
 }
 
-inline int SampleSkyboxPixel(float3 rayDirection, Texture texture)
+inline uint SampleSkyboxPixel(float3 rayDirection, const Texture& texture)
 {
-	int theta = (int)((ATan2(rayDirection.x, -rayDirection.z) / PI) * 0.5f * (float)(texture.width));
-	int phi = (int)((ACos(rayDirection.y) / PI) * (float)(texture.height));
-	return (phi * texture.width) + theta + 2;
+	float2 uv;
+	uv.x = (ATan2(rayDirection.x, -rayDirection.z) / PI) * 0.5f;
+	uv.y = ACos(rayDirection.y) / PI;
+	return SampleTexture(texture, uv);
 }
 
 // todo ignore mask
@@ -199,11 +202,13 @@ HitRecord CPU_RayCast(RaySSE ray)
 		triout.t = besthit.distance;
 		triout.triIndex = 0;
 		MeshInstance& instance = g_MeshInstances[i];
+		if (ResourceManager::IsGPUMesh(instance.meshIndex)) continue; // geometry is only on the gpu
 		RaySSE meshRay;
 		// change ray position&oriantation instead of mesh position for capturing in different positions
 		
-		meshRay.origin    = Vector4Transform(ray.origin, instance.inverseTransform);
-		meshRay.direction = Vector4Transform(ray.direction, instance.inverseTransform);
+		Matrix4 inverseTransform = instance.GetInverseTransform();
+		meshRay.origin    = Vector4Transform(ray.origin, inverseTransform);
+		meshRay.direction = Vector4Transform(ray.direction, inverseTransform);
 		// instance.meshIndex = bvhIndex
 		if (IntersectBVH(meshRay, g_BVHNodes, g_BVHIndices[instance.meshIndex], g_Triangles, &triout))
 		{
@@ -215,11 +220,9 @@ HitRecord CPU_RayCast(RaySSE ray)
 	}
 	
 	if (besthit.distance == RayacastMissDistance) {
-		union u { uint color; RGB8 rgb; } us;
 		float3 v3;
 		SSEStoreVector3(&v3.x, ray.direction);
-		us.rgb = g_TexturePixels[SampleSkyboxPixel(v3, g_Textures[2])];
-		record.color = us.color; // convert skybox color to uint32sa
+		record.color = SampleSkyboxPixel(v3, g_Textures[2]) & 0x00FFFFFFu; // skybox color without alpha
 		return record;
 	}
 
@@ -227,7 +230,7 @@ HitRecord CPU_RayCast(RaySSE ray)
 	Tri& triangle = g_Triangles[hitOut.triIndex];
 	Material material = g_Materials[hitInstance.materialStart + triangle.materialIndex];
 	float3 baryCentrics = float3(1.0f - hitOut.u - hitOut.v, hitOut.u, hitOut.v);
-	Matrix3 inverseMat3 = Matrix4::ConvertToMatrix3(hitInstance.inverseTransform);
+	Matrix3 inverseMat3 = Matrix4::ConvertToMatrix3(hitInstance.GetInverseTransform());
 			
 	float3 n0 = Matrix3::Multiply(inverseMat3, ConvertToFloat3(&triangle.normal0x));
 	float3 n1 = Matrix3::Multiply(inverseMat3, ConvertToFloat3(&triangle.normal1x));
@@ -239,7 +242,7 @@ HitRecord CPU_RayCast(RaySSE ray)
 		        + ConvertToFloat2(&triangle.uv1x) * baryCentrics.y
 		        + ConvertToFloat2(&triangle.uv2x) * baryCentrics.z;
 	
-	RGB8 pixel = g_TexturePixels[SampleTexture(g_Textures[material.albedoTextureIndex], record.uv)];
+	uint pixel = SampleTexture(g_Textures[material.albedoTextureIndex], record.uv);
 	
 	record.color = MultiplyU32Colors(material.color, pixel);
 
@@ -1,9 +1,9 @@
-#include <GLFW/glfw3.h>
+#include "Editor.hpp"
 
 #ifdef IMGUI_DISABLE
 void Editor::Destroy() { }
 void Editor::Create(GLFWwindow* window){}
-void Editor::AddOnEditor(void(*action)() action) {}
+void Editor::AddOnEditor(void(*action)()) {}
 void Editor::Begin() { }
 void Editor::Render(unsigned screenRenderImageGl) { }
 void Editor::DeepDark() { }
@@ -12,6 +12,7 @@ void Editor::DarkTheme() { }
 
 #else
 
+#include <GLFW/glfw3.h>
 #include <imgui.h>
 #include <stdio.h>
 #include <backends/imgui_impl_opengl3.h>
@@ -1,4 +1,15 @@
 #pragma once
+
+// headless builds doesn't have window, so there is no editor
+#ifdef HEADLESS
+#	ifndef NEDITOR
+#		define NEDITOR
+#	endif
+#	ifndef IMGUI_DISABLE
+#		define IMGUI_DISABLE
+#	endif
+#endif
+
 #include <imgui.h>
 
 struct GLFWwindow;
@@ -33,6 +44,8 @@ namespace Editor
 		TitleAndAction(const char* _title, Action _action) : title(_title), action(_action) {}
 	};
 
+	// widgets need imgui, headless builds compile imgui.h without its declarations
+#ifndef NEDITOR
 	namespace GUI
 	{
 		void Header(const char* title);
@@ -83,4 +96,5 @@ namespace Editor
 		void Initialize();
 		void DrawWindow();
 	}
+#endif // NEDITOR
 }
@@ -1,4 +1,4 @@
-#ifndef NEDITOR
+#if !defined(NEDITOR) && !defined(HEADLESS)
 
 #include "Editor.hpp"
 #include <fstream>
@@ -4,7 +4,7 @@
 #include "Math/Transform.hpp"
 #include "Window.hpp"
 #include "AssetManager.hpp"
-#include "CPURayTrace.hpp"
+#include "Physics.hpp"
 #include <stdio.h>
 
 // things that I want to edit in editor
@@ -28,14 +28,29 @@ void Engine_AddOnAppQuitEvent(void(*action)())
 }
 
 static const char* ProfilerNames[] = {
-	"Renderer", "EngineTick"
+	"Renderer", "EngineTick", "GPU Frame", "Upload", "RayGen", "GLAcquire", "Trace", "Upsample", "PostProcess", "GLRelease", "Shade", "Reconstruct"
 };
+static_assert(sizeof(ProfilerNames) / sizeof(ProfilerNames[0]) == Num_ProfilerStats);
 
-static float ProfilerSpeeds[20] = {0.0f};
+// last N samples of each stat for rolling average
+constexpr int ProfilerHistory = 64;
+static float ProfilerSpeeds[Num_ProfilerStats] = {0.0f};
+static float ProfilerSamples[Num_ProfilerStats][ProfilerHistory] = {};
+static float ProfilerSums[Num_ProfilerStats] = {0.0f};
+static int   ProfilerNumSamples[Num_ProfilerStats] = {0};
 
 void Engine_UpdateProfilerStats(ProfilerStats stats, float ms)
 {
 	ProfilerSpeeds[stats] = ms;
+	float& oldest = ProfilerSamples[stats][ProfilerNumSamples[stats]++ % ProfilerHistory];
+	ProfilerSums[stats] += ms - oldest;
+	oldest = ms;
+}
+
+float Engine_GetProfilerAverage(ProfilerStats stats)
+{
+	int numSamples = Min(ProfilerNumSamples[stats], ProfilerHistory);
+	return numSamples ? ProfilerSums[stats] / (float)numSamples : 0.0f;
 }
 #ifndef IMGUI_DISABLE
 static void DisplayProfilerStats()
@@ -43,8 +58,52 @@ static void DisplayProfilerStats()
 	ImGui::Begin("Lighting");
 	ImGui::DragFloat("SunAngle", &SunAngle, 0.025f, -3.14f, 0.0f);
 	ImGui::Separator();
+	
+	bool dynamicResolution = Renderer::IsDynamicResolutionEnabled();
+	float targetFrameTime = Renderer::GetTargetFrameTime();
+	if (ImGui::Checkbox("Dynamic Resolution", &dynamicResolution)) Renderer::SetDynamicResolution(dynamicResolution);
+	if (ImGui::DragFloat("Target ms", &targetFrameTime, 0.1f, 4.0f, 100.0f)) Renderer::SetTargetFrameTime(targetFrameTime);
+	ImGui::LabelText("Render Scale", "%.2f", Renderer::GetRenderScale());
+	bool checkerboard = Renderer::IsCheckerboardEnabled();
+	float checkerboardQuality = Renderer::GetCheckerboardQuality();
+	if (ImGui::Checkbox("Checkerboard", &checkerboard)) Renderer::SetCheckerboard(checkerboard);
+	if (ImGui::SliderFloat("Checkerboard Quality", &checkerboardQuality, 0.0f, 1.0f)) Renderer::SetCheckerboardQuality(checkerboardQuality);
+	ImGui::LabelText("Checkerboard Active", "%s", Renderer::IsCheckerboardActive() ? "yes" : "no");
+	bool adaptiveSampling = Renderer::IsAdaptiveSamplingEnabled();
+	float adaptiveThreshold = Renderer::GetAdaptiveSamplingThreshold();
+	if (ImGui::Checkbox("Adaptive Sampling", &adaptiveSampling)) Renderer::SetAdaptiveSampling(adaptiveSampling);
+	if (ImGui::SliderFloat("Noise Threshold", &adaptiveThreshold, 0.001f, 0.1f)) Renderer::SetAdaptiveSamplingThreshold(adaptiveThreshold);
+	
+	Renderer::RenderFeatures features = Renderer::GetFeatures();
+	bool featuresChanged = ImGui::SliderInt("Bounces", &features.maxBounces, 1, 4);
+	featuresChanged |= ImGui::Checkbox("Shadows", &features.shadows);
+	featuresChanged |= ImGui::Checkbox("Specular", &features.specular);
+	featuresChanged |= ImGui::Checkbox("Nearest Filter", &features.nearestFilter);
+	featuresChanged |= ImGui::Checkbox("ID Buffer", &features.idBuffer);
+	if (featuresChanged) Renderer::SetFeatures(features);
+
+	bool deferredShading = Renderer::IsDeferredShadingEnabled();
+	if (ImGui::Checkbox("Deferred Shading", &deferredShading)) Renderer::SetDeferredShading(deferredShading);
+	if (deferredShading)
+	{
+		bool materialSorting = Renderer::IsMaterialSortingEnabled();
+		if (ImGui::Checkbox("Material Sort", &materialSorting)) Renderer::SetMaterialSorting(materialSorting);
+		bool raySorting = Renderer::IsRaySortingEnabled();
+		if (ImGui::Checkbox("Ray Sort", &raySorting)) Renderer::SetRaySorting(raySorting);
+		bool reprojection = Renderer::IsTemporalReprojectionEnabled();
+		if (ImGui::Checkbox("Reprojection", &reprojection)) Renderer::SetTemporalReprojection(reprojection);
+	}
+	
+	if (Renderer::GetNumDevices() > 1)
+	{
+		bool multiDevice = Renderer::IsMultiDeviceEnabled();
+		if (ImGui::Checkbox("Multi Device", &multiDevice)) Renderer::SetMultiDevice(multiDevice);
+		for (int i = 0; i < Renderer::GetNumDevices(); ++i)
+			ImGui::Text("Device %d share: %.2f", i, Renderer::GetDeviceShare(i));
+	}
+	ImGui::Separator();
 	for (int i = 0; i < Num_ProfilerStats; ++i) {
-		ImGui::LabelText(ProfilerNames[i], "%f ms", ProfilerSpeeds[i]);
+		ImGui::LabelText(ProfilerNames[i], "%f ms  avg: %f ms", ProfilerSpeeds[i], Engine_GetProfilerAverage((ProfilerStats)i));
 	}
 	ImGui::End();
 }
@@ -55,7 +114,9 @@ static Transform bmwTransform = {};
 
 void Engine_Start()
 {
+#ifndef IMGUI_DISABLE
 	Editor::AddOnEditor(DisplayProfilerStats);
+#endif
 	ResourceManager::PrepareMeshes();
 	// we should push this first! skybox texture no need to store handle
 	ResourceManager::ImportTexture("Assets/cape_hill_4k.jpg");
@@ -68,6 +129,9 @@ void Engine_Start()
 
 	ResourceManager::PushMeshesToGPU();
 	ResourceManager::PushTexturesToGPU();
+#ifndef NDEBUG
+	ResourceManager::ValidateGPUBVHBuilder(boxMesh); // smallest mesh
+#endif
 	
 	Renderer::BeginInstanceRegister();
 
@@ -81,6 +145,7 @@ void Engine_Start()
 
 float Engine_Tick()
 {
+	Physics::Update(); // callbacks of the ray casts that are completed
 	float dt = (float)Window::DeltaTime();
 	static float rotation = 0.0f;
 
@@ -109,18 +174,20 @@ float Engine_Tick()
 	}
 	Renderer::SetMeshMatrix(bmwMesh, bmwTransform.GetMatrix());
 
+	// picking reads the id buffer of the frame, result comes with the next frames
 	if (Window::GetMouseButton(MouseButton_Left))
 	{
-		const Camera& camera = Renderer::GetCamera();
 		Vector2f mousePos = Window::GetMouseWindowPos();
-		RaySSE ray = camera.ScreenPointToRaySSE(mousePos);
-		HitRecord record = CPU_RayCast(ray);
-		
-		if (record.distance != RayacastMissDistance)
+		Renderer::RequestPick((int)mousePos.x, (int)mousePos.y);
+	}
+	
+	int pickWidth, pickHeight;
+	if (const Renderer::PickResult* pick = Renderer::GetPickResults(&pickWidth, &pickHeight))
+	{
+		if (pick->instance != Renderer::NoPickInstance)
 		{
-			// Vector3f hitPos = rayn.origin + (rayn.direction * record.distance);
 			// Material& material = ResourceManager::EditMaterial(7);
-			// material.color = record.color;
+			// material.color = 0xFF0000FFu;
 			// ResourceManager::PushMaterialsToGPU();
 		}
 	}
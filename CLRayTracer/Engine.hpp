@@ -4,12 +4,24 @@ enum ProfilerStats
 {
 	ProfilerStats_Render,
 	ProfilerStats_EngineTick,
+	// gpu side timings, measured with opencl event profiling
+	ProfilerStats_GPUFrame,
+	ProfilerStats_Upload,
+	ProfilerStats_RayGen,
+	ProfilerStats_GLAcquire,
+	ProfilerStats_Trace,
+	ProfilerStats_Upsample,
+	ProfilerStats_PostProcess,
+	ProfilerStats_GLRelease,
+	ProfilerStats_Shade,
+	ProfilerStats_Reconstruct,
 	Num_ProfilerStats
 };
 
 void Engine_AddEndOfFrameEvent(void(*action)());
 void Engine_AddOnAppQuitEvent(void(*action)());
 void Engine_UpdateProfilerStats(ProfilerStats stats, float ms);
+float Engine_GetProfilerAverage(ProfilerStats stats);
 void Engine_EndFrame();
 void Engine_Start();
 float Engine_Tick();
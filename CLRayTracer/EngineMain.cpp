@@ -2,6 +2,73 @@
 #include "Engine.hpp"
 #include "Window.hpp"
 
+#ifdef HEADLESS
+#include <stdio.h>
+#include <stdlib.h>
+
+// binary ppm, alpha is dropped. rendered image is bottom up, ppm is top down
+static void WritePPM(const char* path, const unsigned* pixels, int width, int height)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file) { fprintf(stderr, "unable to open %s\n", path); return; }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    unsigned char* row = (unsigned char*)malloc(width * 3);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++) {
+            unsigned pixel = pixels[(height - 1 - y) * width + x];
+            row[x * 3 + 0] = pixel & 255; row[x * 3 + 1] = pixel >> 8 & 255; row[x * 3 + 2] = pixel >> 16 & 255;
+        }
+        fwrite(row, 1, width * 3, file);
+    }
+    free(row);
+    fclose(file);
+}
+
+static void WriteFrame(const char* outputPrefix, int frameIndex)
+{
+    const unsigned* pixels = Renderer::ReadbackFrame();
+    if (!pixels || !outputPrefix) return;
+    char path[512];
+    snprintf(path, sizeof(path), "%s%04d.ppm", outputPrefix, frameIndex);
+    WritePPM(path, pixels, Window::GetWidth(), Window::GetHeight());
+}
+
+// usage: CLRayTracer [numFrames] [width] [height] [outputPrefix]
+// renders without window or gl, each frame is written as outputPrefix0000.ppm. 
+// if outputPrefix is "-" frames are not written, usefull for benchmarks
+// built with the Headless|x64 configuration, it links only OpenCL. it is msvc only like the other configurations:
+// math and allocation code uses msvc extensions (svml intrinsics, _aligned_malloc, anonymous structs with constructors),
+// so it doesn't build on linux (pocl etc.) yet
+int main(int argc, char** argv)
+{
+    int numFrames = argc > 1 ? atoi(argv[1]) : 1;
+    if (argc > 3) Window::SetSize(atoi(argv[2]), atoi(argv[3]));
+    const char* outputPrefix = argc > 4 ? argv[4] : "frame";
+    if (outputPrefix[0] == '-' && outputPrefix[1] == 0) outputPrefix = nullptr;
+
+    if (!Window::Create()) return 0;
+    if (!Renderer::Initialize()) return 0;
+    Renderer::SetDynamicResolution(false); // same resolution for each frame
+    Engine_Start();
+
+    for (int i = 0; i < numFrames; i++)
+    {
+        float sunAngle = Engine_Tick();
+        Renderer::Render(sunAngle);
+        // previous frame is written to disk while gpu renders this one
+        if (i > 0) WriteFrame(outputPrefix, i - 1);
+        Window::EndFrame(0u); // advances the fixed time step
+        Engine_EndFrame();
+    }
+    if (numFrames > 0) WriteFrame(outputPrefix, numFrames - 1);
+
+    Engine_Exit();
+    Window::Destroy();
+    Renderer::Terminate();
+    return 1;
+}
+#else
 int main()
 {
     if (!Window::Create()) return 0;
@@ -21,4 +88,4 @@ int main()
     Renderer::Terminate();
     return 1;
 }
-
+#endif // HEADLESS
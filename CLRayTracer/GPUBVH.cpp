@@ -0,0 +1,221 @@
+#include "GPUBVH.hpp"
+#include "ResourceManager.hpp"
+#include "Logger.hpp"
+#include <cassert>
+
+extern cl_mem g_MeshTriangleMem, g_BvhMem, g_BvhParentsMem;
+
+namespace
+{
+	cl_int clerr;
+	cl_context context;
+	cl_command_queue commandQueue;
+	cl_program program = nullptr;
+
+	cl_kernel centroidBoundsKernel, mortonKernel, histogramKernel, scanKernel, scatterKernel, reorderKernel, emitKernel, nodeBoundsKernel;
+
+	// sort and reductions use work group functions, each kernel is launched with the group size of the queue's device.
+	// rendering devices can have different limits, sizes are queried again when the program is rebuilt
+	constexpr size_t PreferredGroupSize = 256;
+	constexpr int MaxDevices = 4; // MaxRenderDevices of the renderer
+	cl_device_id groupSizeDevices[MaxDevices];
+	size_t groupSizes[MaxDevices];
+	int numGroupSizeDevices = 0;
+	size_t minGroupSize = PreferredGroupSize; // histograms are sized with the smallest one so they fit on any device
+
+	// scratch buffers, grow when bigger mesh is built
+	cl_mem keyMem[2], valueMem[2], histogramMem, centroidBoundsMem, sortedTriangleMem;
+	cl_mem internalSlotMem, internalParentMem, leafParentMem, visitMem;
+	uint scratchCapacity = 0;
+}
+
+static cl_kernel CreateBuilderKernel(const char* name)
+{
+	cl_kernel kernel = clCreateKernel(program, name, &clerr); assert(clerr == 0);
+	// program is built for all render devices, each one can run a different group size
+	for (int i = 0; i < numGroupSizeDevices; i++)
+	{
+		size_t maxGroupSize = 0;
+		clerr = clGetKernelWorkGroupInfo(kernel, groupSizeDevices[i], CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroupSize, nullptr); assert(clerr == 0);
+		while (groupSizes[i] > maxGroupSize && groupSizes[i] > 1) groupSizes[i] >>= 1;
+		if (groupSizes[i] < minGroupSize) minGroupSize = groupSizes[i];
+	}
+	return kernel;
+}
+
+static size_t GroupSize(cl_command_queue queue)
+{
+	cl_device_id device;
+	clerr = clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, nullptr); assert(clerr == 0);
+	for (int i = 0; i < numGroupSizeDevices; i++)
+		if (groupSizeDevices[i] == device) return groupSizes[i];
+	return minGroupSize;
+}
+
+void GPUBVH::Initialize(cl_context clContext, cl_command_queue queue, cl_program builderProgram)
+{
+	context = clContext, commandQueue = queue, program = builderProgram;
+	
+	cl_uint numContextDevices = 0;
+	clerr = clGetContextInfo(context, CL_CONTEXT_NUM_DEVICES, sizeof(cl_uint), &numContextDevices, nullptr); assert(clerr == 0);
+	assert(numContextDevices <= MaxDevices);
+	numGroupSizeDevices = (int)numContextDevices;
+	clerr = clGetContextInfo(context, CL_CONTEXT_DEVICES, sizeof(cl_device_id) * numContextDevices, groupSizeDevices, nullptr); assert(clerr == 0);
+	// rebuilt program may use more registers or less, so sizes start from the preferred size again
+	for (int i = 0; i < numGroupSizeDevices; i++) groupSizes[i] = PreferredGroupSize;
+	minGroupSize = PreferredGroupSize;
+
+	if (!program) { AXWARNING("gpu bvh builder is not available, kernels/bvh_builder.cl is not compiled"); return; }
+
+	centroidBoundsKernel = CreateBuilderKernel("ComputeCentroidBounds");
+	mortonKernel         = CreateBuilderKernel("ComputeMortonCodes");
+	histogramKernel      = CreateBuilderKernel("RadixHistogram");
+	scanKernel           = CreateBuilderKernel("RadixScan");
+	scatterKernel        = CreateBuilderKernel("RadixScatter");
+	reorderKernel        = CreateBuilderKernel("ReorderTriangles");
+	emitKernel           = CreateBuilderKernel("EmitHierarchy");
+	nodeBoundsKernel     = CreateBuilderKernel("ComputeNodeBounds");
+}
+
+static void ReleaseScratch()
+{
+	if (!scratchCapacity) return;
+	FOR_EACH(clReleaseMemObject, keyMem[0], keyMem[1], valueMem[0], valueMem[1], histogramMem, centroidBoundsMem, sortedTriangleMem);
+	FOR_EACH(clReleaseMemObject, internalSlotMem, internalParentMem, leafParentMem, visitMem);
+	scratchCapacity = 0;
+}
+
+static void EnsureScratch(uint numTriangles)
+{
+	if (numTriangles <= scratchCapacity) return;
+	ReleaseScratch();
+	for (int i = 0; i < 2; i++) {
+		keyMem[i]   = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(uint), nullptr, &clerr); assert(clerr == 0);
+		valueMem[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(uint), nullptr, &clerr); assert(clerr == 0);
+	}
+	histogramMem      = clCreateBuffer(context, CL_MEM_READ_WRITE, GPUBVH::SortHistogramSize(numTriangles), nullptr, &clerr); assert(clerr == 0);
+	centroidBoundsMem = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * 8, nullptr, &clerr); assert(clerr == 0);
+	sortedTriangleMem = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(Tri), nullptr, &clerr); assert(clerr == 0);
+	internalSlotMem   = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(uint), nullptr, &clerr); assert(clerr == 0);
+	internalParentMem = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(uint), nullptr, &clerr); assert(clerr == 0);
+	leafParentMem     = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(uint), nullptr, &clerr); assert(clerr == 0);
+	visitMem          = clCreateBuffer(context, CL_MEM_READ_WRITE, numTriangles * sizeof(int), nullptr, &clerr); assert(clerr == 0);
+	scratchCapacity = numTriangles;
+}
+
+static void Dispatch(cl_kernel kernel, size_t numItems, cl_command_queue queue = commandQueue)
+{
+	size_t groupSize = GroupSize(queue);
+	size_t globalSize = (numItems + groupSize - 1) / groupSize * groupSize;
+	clerr = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, &groupSize, 0, nullptr, nullptr); assert(clerr == 0);
+}
+
+// passes of 4 bits, even number of passes so sorted keys end up in the first buffers
+static void EnqueueRadixSort(cl_command_queue queue, cl_mem keys[2], cl_mem values[2], cl_mem histogram, uint numKeys, uint numBits)
+{
+	// histogram layout depends on the number of groups, buffer is sized for the smallest group size so it is big enough
+	size_t groupSize = GroupSize(queue);
+	uint histogramSize = uint((numKeys + groupSize - 1) / groupSize * 16);
+	for (uint shift = 0, src = 0; shift < numBits; shift += 4, src ^= 1)
+	{
+		clerr = clSetKernelArg(histogramKernel, 0, sizeof(cl_mem), &keys[src]); assert(clerr == 0);
+		clerr = clSetKernelArg(histogramKernel, 1, sizeof(uint), &numKeys); assert(clerr == 0);
+		clerr = clSetKernelArg(histogramKernel, 2, sizeof(uint), &shift); assert(clerr == 0);
+		clerr = clSetKernelArg(histogramKernel, 3, sizeof(cl_mem), &histogram); assert(clerr == 0);
+		Dispatch(histogramKernel, numKeys, queue);
+
+		clerr = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), &histogram); assert(clerr == 0);
+		clerr = clSetKernelArg(scanKernel, 1, sizeof(uint), &histogramSize); assert(clerr == 0);
+		Dispatch(scanKernel, 1, queue); // single work group
+
+		clerr = clSetKernelArg(scatterKernel, 0, sizeof(cl_mem), &keys[src]); assert(clerr == 0);
+		clerr = clSetKernelArg(scatterKernel, 1, sizeof(cl_mem), &values[src]); assert(clerr == 0);
+		clerr = clSetKernelArg(scatterKernel, 2, sizeof(uint), &numKeys); assert(clerr == 0);
+		clerr = clSetKernelArg(scatterKernel, 3, sizeof(uint), &shift); assert(clerr == 0);
+		clerr = clSetKernelArg(scatterKernel, 4, sizeof(cl_mem), &histogram); assert(clerr == 0);
+		clerr = clSetKernelArg(scatterKernel, 5, sizeof(cl_mem), &keys[src ^ 1]); assert(clerr == 0);
+		clerr = clSetKernelArg(scatterKernel, 6, sizeof(cl_mem), &values[src ^ 1]); assert(clerr == 0);
+		Dispatch(scatterKernel, numKeys, queue);
+	}
+}
+
+size_t GPUBVH::SortHistogramSize(uint numKeys)
+{
+	return (numKeys + minGroupSize - 1) / minGroupSize * 16 * sizeof(uint);
+}
+
+bool GPUBVH::SortKeyValues(cl_command_queue queue, cl_mem keys[2], cl_mem values[2], cl_mem histogram, uint numKeys, uint numBits)
+{
+	assert(numBits % 8 == 0 && numBits <= 32);
+	if (!program || numKeys == 0) return false;
+	EnqueueRadixSort(queue, keys, values, histogram, numKeys, numBits);
+	return true;
+}
+
+uint GPUBVH::Build(uint triangleStart, uint numTriangles, uint nodeStart)
+{
+	if (!program || numTriangles == 0) return 0;
+	EnsureScratch(numTriangles);
+
+	clerr = clSetKernelArg(centroidBoundsKernel, 0, sizeof(cl_mem), &g_MeshTriangleMem); assert(clerr == 0);
+	clerr = clSetKernelArg(centroidBoundsKernel, 1, sizeof(uint), &triangleStart); assert(clerr == 0);
+	clerr = clSetKernelArg(centroidBoundsKernel, 2, sizeof(uint), &numTriangles); assert(clerr == 0);
+	clerr = clSetKernelArg(centroidBoundsKernel, 3, sizeof(cl_mem), &centroidBoundsMem); assert(clerr == 0);
+	Dispatch(centroidBoundsKernel, 1); // single work group
+
+	clerr = clSetKernelArg(mortonKernel, 0, sizeof(cl_mem), &g_MeshTriangleMem); assert(clerr == 0);
+	clerr = clSetKernelArg(mortonKernel, 1, sizeof(uint), &triangleStart); assert(clerr == 0);
+	clerr = clSetKernelArg(mortonKernel, 2, sizeof(uint), &numTriangles); assert(clerr == 0);
+	clerr = clSetKernelArg(mortonKernel, 3, sizeof(cl_mem), &centroidBoundsMem); assert(clerr == 0);
+	clerr = clSetKernelArg(mortonKernel, 4, sizeof(cl_mem), &keyMem[0]); assert(clerr == 0);
+	clerr = clSetKernelArg(mortonKernel, 5, sizeof(cl_mem), &valueMem[0]); assert(clerr == 0);
+	Dispatch(mortonKernel, numTriangles);
+
+	EnqueueRadixSort(commandQueue, keyMem, valueMem, histogramMem, numTriangles, 32);
+
+	// leaves index the triangles directly so triangles has to be in morton order
+	clerr = clSetKernelArg(reorderKernel, 0, sizeof(cl_mem), &g_MeshTriangleMem); assert(clerr == 0);
+	clerr = clSetKernelArg(reorderKernel, 1, sizeof(uint), &triangleStart); assert(clerr == 0);
+	clerr = clSetKernelArg(reorderKernel, 2, sizeof(uint), &numTriangles); assert(clerr == 0);
+	clerr = clSetKernelArg(reorderKernel, 3, sizeof(cl_mem), &valueMem[0]); assert(clerr == 0);
+	clerr = clSetKernelArg(reorderKernel, 4, sizeof(cl_mem), &sortedTriangleMem); assert(clerr == 0);
+	Dispatch(reorderKernel, numTriangles);
+	clerr = clEnqueueCopyBuffer(commandQueue, sortedTriangleMem, g_MeshTriangleMem, 0, triangleStart * sizeof(Tri), numTriangles * sizeof(Tri), 0, nullptr, nullptr); assert(clerr == 0);
+
+	clerr = clSetKernelArg(emitKernel, 0, sizeof(cl_mem), &keyMem[0]); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 1, sizeof(uint), &numTriangles); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 2, sizeof(cl_mem), &g_MeshTriangleMem); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 3, sizeof(uint), &triangleStart); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 4, sizeof(cl_mem), &g_BvhMem); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 5, sizeof(uint), &nodeStart); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 6, sizeof(cl_mem), &internalSlotMem); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 7, sizeof(cl_mem), &internalParentMem); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 8, sizeof(cl_mem), &leafParentMem); assert(clerr == 0);
+	clerr = clSetKernelArg(emitKernel, 9, sizeof(cl_mem), &g_BvhParentsMem); assert(clerr == 0);
+	Dispatch(emitKernel, numTriangles > 1 ? numTriangles - 1 : 1);
+
+	const int zero = 0;
+	clerr = clEnqueueFillBuffer(commandQueue, visitMem, &zero, sizeof(int), 0, numTriangles * sizeof(int), 0, nullptr, nullptr); assert(clerr == 0);
+
+	clerr = clSetKernelArg(nodeBoundsKernel, 0, sizeof(uint), &numTriangles); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 1, sizeof(uint), &nodeStart); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 2, sizeof(cl_mem), &g_BvhMem); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 3, sizeof(cl_mem), &internalSlotMem); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 4, sizeof(cl_mem), &internalParentMem); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 5, sizeof(cl_mem), &leafParentMem); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 6, sizeof(cl_mem), &visitMem); assert(clerr == 0);
+	clerr = clSetKernelArg(nodeBoundsKernel, 7, sizeof(cl_mem), &g_BvhParentsMem); assert(clerr == 0);
+	Dispatch(nodeBoundsKernel, numTriangles);
+
+	return 2 * numTriangles - 1;
+}
+
+void GPUBVH::Terminate()
+{
+	if (!program) return;
+	ReleaseScratch();
+	FOR_EACH(clReleaseKernel, centroidBoundsKernel, mortonKernel, histogramKernel, scanKernel, scatterKernel, reorderKernel, emitKernel);
+	clReleaseKernel(nodeBoundsKernel);
+	clReleaseProgram(program);
+	program = nullptr;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "cl.hpp"
+#include "Common.hpp"
+
+// builds linear bvh's on the gpu, for meshes that are generated or deformed by kernels.
+// triangles never leave the gpu, kernels are in kernels/bvh_builder.cl
+namespace GPUBVH
+{
+	// takes ownership of the program, builder is disabled if program is null
+	void Initialize(cl_context context, cl_command_queue commandQueue, cl_program program);
+	void Terminate();
+
+	// builds bvh of the triangles [triangleStart, triangleStart + numTriangles) of g_MeshTriangleMem,
+	// triangles are reordered in that range. root is written to nodeStart, returns number of nodes used (2 * numTriangles - 1)
+	// or zero if the builder is not available. parent links are written to g_BvhParentsMem
+	uint Build(uint triangleStart, uint numTriangles, uint nodeStart);
+
+	// radix sort of the builder, also used for sorting the rays. sorts numKeys of keys[0] and values[0] by the low numBits of the keys,
+	// numBits must be a multiple of 8 so the result ends up in keys[0] and values[0], other buffers are scratch.
+	// histogram needs SortHistogramSize bytes, size can change when the builder is initialized again (hot reload).
+	// returns false if the builder is not available
+	bool SortKeyValues(cl_command_queue queue, cl_mem keys[2], cl_mem values[2], cl_mem histogram, uint numKeys, uint numBits);
+	size_t SortHistogramSize(uint numKeys);
+}
@@ -42,15 +42,14 @@ char* Helper::ReadCombineKernels()
 	const uintmax_t msz = std::filesystem::file_size("kernels/MathAndSTL.cl");
 	const uintmax_t sz  = std::filesystem::file_size("kernels/kernel_main.cl");
 
-	char* code = (char*)AssetManagerTempAllocate(msz + sz + 1);
+	// caller deletes the code
+	char* code = new char[msz + sz + 1];
 	fm.read(code, msz);
-	f.read(code + msz, sz);
+	const size_t mathSize = (size_t)fm.gcount(); // less than file size if there is BOM
+	f.read(code + mathSize, sz);
 
-	code[sz + msz] = '\0';
-
-	printf(code); printf("\n");
+	code[mathSize + f.gcount()] = '\0';
 
 	f.close(); fm.close();
-	AssetManagerResetTempMemory();
 	return code;
 }
\ No newline at end of file
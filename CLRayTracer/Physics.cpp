@@ -0,0 +1,177 @@
+#include "Physics.hpp"
+#include "Logger.hpp"
+#include "Math/Math.hpp"
+#include <cassert>
+#include <string.h>
+
+// comes from Renderer.cpp
+extern void EnqueueRayCastKernel(cl_mem queries, cl_mem hits, cl_mem queryOrder, uint numQueries);
+
+namespace
+{
+	struct RayBatch
+	{
+		cl_mem rayMem, hitMem, orderMem;
+		cl_event event; // read of the hits, null if the batch is free
+		RayQuery* rays; // copy of the rays in binned order, write is not blocking
+		uint* order;    // original index of each binned ray
+		RayQueryHit* hits;
+		int numRays;
+		int generation; // handles of the older batches in this slot are completed
+		Physics::RayCastCallback callback;
+		void* userData;
+	};
+
+	cl_int clerr;
+	cl_command_queue commandQueue;
+	RayBatch batches[Physics::MaxPendingBatches];
+	uint* rayKeys[2]; // radix sort scratch
+	uint* rayIndices;
+}
+
+// handle is slot index in the first byte and generation of the slot in the rest
+static RayBatch* GetBatch(RayQueryHandle handle)
+{
+	if (handle == InvalidRayQuery) return nullptr;
+	RayBatch& batch = batches[handle & 0xFF];
+	return batch.event && batch.generation == (handle >> 8) ? &batch : nullptr;
+}
+
+void Physics::Initialize(cl_context context, cl_command_queue queue)
+{
+	commandQueue = queue;
+	for (int i = 0; i < MaxPendingBatches; i++)
+	{
+		batches[i] = {};
+		batches[i].rayMem = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(RayQuery) * MaxRaysPerBatch, nullptr, &clerr); assert(clerr == 0);
+		batches[i].hitMem = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(RayQueryHit) * MaxRaysPerBatch, nullptr, &clerr); assert(clerr == 0);
+		batches[i].orderMem = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(uint) * MaxRaysPerBatch, nullptr, &clerr); assert(clerr == 0);
+		batches[i].rays = new RayQuery[MaxRaysPerBatch];
+		batches[i].order = new uint[MaxRaysPerBatch];
+	}
+	rayKeys[0] = new uint[MaxRaysPerBatch];
+	rayKeys[1] = new uint[MaxRaysPerBatch];
+	rayIndices = new uint[MaxRaysPerBatch];
+}
+
+void Physics::Terminate()
+{
+	for (int i = 0; i < MaxPendingBatches; i++)
+	{
+		if (batches[i].event) clWaitForEvents(1, &batches[i].event), clReleaseEvent(batches[i].event);
+		clReleaseMemObject(batches[i].rayMem);
+		clReleaseMemObject(batches[i].hitMem);
+		clReleaseMemObject(batches[i].orderMem);
+		delete[] batches[i].rays;
+		delete[] batches[i].order;
+	}
+	delete[] rayKeys[0];
+	delete[] rayKeys[1];
+	delete[] rayIndices;
+}
+
+// inserts two zeros between each of the 10 bits
+static uint ExpandBits(uint v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// same binning with the ray sort of the renderer: rays are sorted by direction octant, then by the morton code of the origin cell
+// in the bounds of the batch's origins, so neighbour work items of the RayCast kernel traverse the same parts of the bvh
+static void BinRays(const RayQuery* rays, int numRays, RayQuery* binnedRays, uint* order)
+{
+	float boundsMin[3] = { 1e30f, 1e30f, 1e30f }, boundsMax[3] = { -1e30f, -1e30f, -1e30f };
+	for (int i = 0; i < numRays; i++)
+		for (int j = 0; j < 3; j++)
+			boundsMin[j] = Min(boundsMin[j], rays[i].origin[j]), boundsMax[j] = Max(boundsMax[j], rays[i].origin[j]);
+
+	for (int i = 0; i < numRays; i++)
+	{
+		uint cell[3], octant = 0;
+		for (int j = 0; j < 3; j++) {
+			float t = (rays[i].origin[j] - boundsMin[j]) / Max(boundsMax[j] - boundsMin[j], 1e-6f);
+			cell[j] = (uint)Clamp(t * 64.0f, 0.0f, 63.0f);
+			octant |= rays[i].direction[j] < 0.0f ? 1u << j : 0u;
+		}
+		rayKeys[0][i] = (octant << 18) | (ExpandBits(cell[0]) << 2) | (ExpandBits(cell[1]) << 1) | ExpandBits(cell[2]);
+		rayIndices[i] = i;
+	}
+	
+	// lsd radix sort of the 24 bit keys, 3 passes of 8 bits. stable so rays in the same bin keep their order
+	uint* indices[2] = { rayIndices, order };
+	for (uint shift = 0, src = 0; shift < 24; shift += 8, src ^= 1)
+	{
+		uint offsets[256] = {};
+		for (int i = 0; i < numRays; i++) offsets[(rayKeys[src][i] >> shift) & 0xFF]++;
+		for (uint d = 0, sum = 0; d < 256; d++) { uint count = offsets[d]; offsets[d] = sum; sum += count; }
+		for (int i = 0; i < numRays; i++)
+		{
+			uint position = offsets[(rayKeys[src][i] >> shift) & 0xFF]++;
+			rayKeys[src ^ 1][position] = rayKeys[src][i];
+			indices[src ^ 1][position] = indices[src][i];
+		}
+	}
+	// odd number of passes, sorted indices are in order
+	for (int i = 0; i < numRays; i++) binnedRays[i] = rays[order[i]];
+}
+
+RayQueryHandle Physics::RayCastAsync(const RayQuery* rays, int numRays, RayQueryHit* hits, RayCastCallback callback, void* userData)
+{
+	if (numRays <= 0 || numRays > MaxRaysPerBatch) { AXERROR("number of rays in the batch must be between 1 and %d!", MaxRaysPerBatch); return InvalidRayQuery; }
+
+	int slot = 0;
+	while (slot < MaxPendingBatches && batches[slot].event) slot++;
+	if (slot == MaxPendingBatches) { AXWARNING("all of the ray batches are in flight!"); return InvalidRayQuery; }
+
+	RayBatch& batch = batches[slot];
+	BinRays(rays, numRays, batch.rays, batch.order);
+	batch.hits = hits, batch.numRays = numRays;
+	batch.callback = callback, batch.userData = userData;
+	batch.generation = (batch.generation + 1) & 0x7FFFFF;
+
+	clerr = clEnqueueWriteBuffer(commandQueue, batch.rayMem, false, 0, sizeof(RayQuery) * numRays, batch.rays, 0, nullptr, nullptr); assert(clerr == 0);
+	clerr = clEnqueueWriteBuffer(commandQueue, batch.orderMem, false, 0, sizeof(uint) * numRays, batch.order, 0, nullptr, nullptr); assert(clerr == 0);
+	EnqueueRayCastKernel(batch.rayMem, batch.hitMem, batch.orderMem, numRays);
+	clerr = clEnqueueReadBuffer(commandQueue, batch.hitMem, false, 0, sizeof(RayQueryHit) * numRays, hits, 0, nullptr, &batch.event); assert(clerr == 0);
+	clFlush(commandQueue); // start now instead of with the next frame
+	return slot | (batch.generation << 8);
+}
+
+// CL_COMPLETE is zero, negative values are errors
+static cl_int GetBatchStatus(const RayBatch& batch)
+{
+	cl_int status = CL_QUEUED;
+	clGetEventInfo(batch.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+	return status;
+}
+
+bool Physics::IsComplete(RayQueryHandle handle)
+{
+	RayBatch* batch = GetBatch(handle);
+	return !batch || GetBatchStatus(*batch) <= CL_COMPLETE;
+}
+
+void Physics::Wait(RayQueryHandle handle)
+{
+	if (RayBatch* batch = GetBatch(handle)) clWaitForEvents(1, &batch->event);
+}
+
+void Physics::Update()
+{
+	for (int i = 0; i < MaxPendingBatches; i++)
+	{
+		RayBatch& batch = batches[i];
+		if (!batch.event) continue;
+		cl_int status = GetBatchStatus(batch);
+		if (status > CL_COMPLETE) continue;
+		
+		clReleaseEvent(batch.event);
+		batch.event = nullptr;
+		if (status < 0) { AXERROR("ray batch failed with error %d, callback is not called", status); continue; }
+		if (batch.callback) batch.callback(batch.hits, batch.numRays, batch.userData);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "cl.hpp"
+#include "Common.hpp"
+
+// ray casts for gameplay and physics. rays are sent as a batch and traced on the gpu asynchronously,
+// instead of tracing each ray on the main thread with CPU_RayCast
+
+struct RayQuery
+{
+	float origin[3];
+	float tmax;         // hits that are farther are ignored
+	float direction[3]; // world space, distances are in units of the direction's length
+	uint  mask;         // instance is tested if (instance mask & mask) != 0
+};
+
+struct RayQueryHit
+{
+	float distance;  // RayQueryMiss if nothing is hit
+	uint  instance;  // mesh instance index
+	uint  triangle;  // triangle index in the gpu triangle buffer
+	float u, v;      // barycentrics of vertex1 and vertex2
+	float normal[3]; // world space geometric normal
+};
+
+static_assert(sizeof(RayQuery) == 32 && sizeof(RayQueryHit) == 32, "layout is same with the RayCast kernel");
+
+constexpr float RayQueryMiss = 1e30f;
+
+typedef int RayQueryHandle;
+constexpr RayQueryHandle InvalidRayQuery = -1;
+
+namespace Physics
+{
+	constexpr int MaxRaysPerBatch   = 16384;
+	constexpr int MaxPendingBatches = 8;
+
+	// called from the main thread when the batch is completed
+	typedef void(*RayCastCallback)(const RayQueryHit* hits, int numHits, void* userData);
+
+	// called from Renderer
+	void Initialize(cl_context context, cl_command_queue commandQueue);
+	void Terminate();
+
+	// rays are copied, hits has to stay valid until the batch is completed. rays are traced in binned order (direction octant, origin cell)
+	// for coherence but hits are written in the order of the rays.
+	// returns InvalidRayQuery if all of the batches are in flight or there are too many rays
+	RayQueryHandle RayCastAsync(const RayQuery* rays, int numRays, RayQueryHit* hits, RayCastCallback callback = nullptr, void* userData = nullptr);
+	bool IsComplete(RayQueryHandle handle);
+	void Wait(RayQueryHandle handle); // blocks until hits are written
+
+	// calls the callbacks of the completed batches, called at the beginning of each engine tick
+	void Update();
+}
@@ -1,7 +1,9 @@
 #define __SSE__
 #define __SSE2__
+#ifndef HEADLESS
 #include <Windows.h>
 #include <glad/glad.h>
+#endif
 #include <cassert>
 #include "cl.hpp"
 #include "Renderer.hpp"
@@ -12,7 +14,15 @@
 #include "Random.hpp"
 #include "Engine.hpp"
 #include <stdio.h>
+#include <string.h>
 #include "CPURayTrace.hpp"
+#include "GPUBVH.hpp"
+#include "Physics.hpp"
+#include "Bitset.hpp"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
 
 // todo: 
 //      textures, materials, skybox
@@ -24,23 +34,218 @@
 namespace 
 {
 	cl_context context;
-	cl_kernel traceKernel, rayGenKernel, PostProcessKernel;
+	cl_kernel traceKernel, rayGenKernel, PostProcessKernel, upsampleKernel, rayCastKernel;
+	cl_kernel visibilityKernel, shadeKernel; // deferred shading
+	cl_kernel countMaterialsKernel, scanMaterialsKernel, scatterMaterialsKernel, shadeSortedKernel; // material sorted shading
+	cl_kernel traceSortedPathsKernel; // ray sorting
+	cl_kernel reconstructKernel, copyBandKernel; // checkerboard rendering
+	cl_kernel allocateSamplesKernel, traceAdaptiveKernel, resolveAccumulationKernel; // adaptive sampling
 	cl_command_queue command_queue;
 	cl_program program;
 
-	cl_mem clglScreen, rayMem, instanceMem;
+	cl_mem clglScreen, scaledScreen;
 	cl_int clerr;
 
+	// kernels that has auto tuned local work sizes
+	enum TunedKernel
+	{
+		TunedKernel_RayGen,
+		TunedKernel_Trace,
+		TunedKernel_Upsample,
+		TunedKernel_PostProcess,
+		TunedKernel_Visibility,
+		TunedKernel_Shade,
+		Num_TunedKernels
+	};
+
+	const char* TunedKernelNames[] = { "RayGen", "Trace", "Upsample", "PostProcess", "TraceVisibility", "ShadeDeferred" };
+	
+	// zero means driver decides, it is a candidate too so tuning never ends up slower than the default
+	constexpr int NumLocalSizeCandidates = 8;
+	const size_t LocalSizeCandidates[NumLocalSizeCandidates][2] = {
+		{ 0, 0 }, { 8, 8 }, { 16, 8 }, { 8, 16 }, { 32, 4 }, { 16, 16 }, { 32, 8 }, { 64, 1 }
+	};
+
+	struct KernelTuning
+	{
+		float bestTimes[NumLocalSizeCandidates]; // nanosecond per work item, best of the samples
+		uint validCandidates; // bitmask, candidates that device and kernel can run
+		int candidate;        // candidate that is measured now, -1 if tuning is finished
+		int numSamples;       // number of frames that current candidate is measured
+		size_t numItems;      // work items of the measured launch
+		size_t localSize[2];  // tuned local size, zero means driver decides
+		cl_event event;       // measurement of the last frame
+	};
+
+	// split frame rendering, each device traces a horizontal band of the frame. 
+	// first device is the primary device, it owns the screen and does upsampling and post processing
+	struct RenderDevice
+	{
+		cl_device_id id;
+		cl_command_queue queue;
+		cl_mem rayMem, instanceMem, instanceBoundsMem;
+		cl_mem idMem;        // primary hit ids for picking, full frame but device writes only its band
+		cl_mem visibilityMem; // deferred shading: instance, triangle and barycentrics of the primary hits
+		cl_mem materialKeyMem, sortedPixelMem, materialCountMem; // material sort of the band's pixels before shading
+		cl_mem savedPathMem, rayKeyMem[2], rayValueMem[2], rayHistogramMem; // ray sort, paths after the first bounce
+		cl_mem historyMem[2]; // temporal reprojection: id, depth and color of the last frame and the current frame
+		int prevBandStart, prevBandEnd; // rows that are in the history
+		cl_mem accumulationMem, sampleTileMem, sampleTileCountMem; // adaptive sampling: accumulated samples and the tiles that get a sample
+		int accumulationBandStart, accumulationBandEnd; // rows that have accumulated samples
+		cl_mem bandScreen;   // secondary devices trace in to this and their band is copied to the screen
+		cl_event traceEvent; // used for load balancing
+		cl_event shadeEvent; // deferred shading pass, balancing uses trace + shade
+		float share;         // portion of the frame rows that this device traces
+		int bandStart, bandEnd;
+		KernelTuning tunings[Num_TunedKernels];
+		char tuningKey[256]; // device name and driver version, local sizes are cached with this
+	};
+
+	// program compiled with the defines of a feature set, variants are kept so switching back is free
+	struct ProgramVariant
+	{
+		Renderer::RenderFeatures features;
+		cl_program program;
+		cl_kernel traceKernel, rayGenKernel, PostProcessKernel, upsampleKernel, rayCastKernel;
+		cl_kernel visibilityKernel, shadeKernel;
+		cl_kernel countMaterialsKernel, scanMaterialsKernel, scatterMaterialsKernel, shadeSortedKernel;
+		cl_kernel traceSortedPathsKernel, reconstructKernel, copyBandKernel;
+		cl_kernel allocateSamplesKernel, traceAdaptiveKernel, resolveAccumulationKernel;
+	};
+
+	constexpr int MaxProgramVariants = 8;
+	constexpr int MaxBounces = 8;
+	ProgramVariant programVariants[MaxProgramVariants];
+	int numProgramVariants = 0;
+	Renderer::RenderFeatures renderFeatures = { 2, false, true, false, true }; // active features
+	char* kernelSource; // kept for compiling other variants
+
+	// kernel hot reload: kernels are recompiled on a background thread when the kernel files change,
+	// compiled program waits here until the beginning of the next frame
+	std::thread kernelWatcher;
+	std::atomic<bool> stopKernelWatcher = false;
+	std::atomic<bool> hasPendingVariant = false;
+	std::atomic<bool> hasPendingBuilder = false;
+	// guards the pending programs, the program variants, kernel source and writes of the render features
+	std::mutex kernelReloadMutex;
+	ProgramVariant pendingVariant;
+	char* pendingSource = nullptr;
+	cl_program pendingBuilderProgram = nullptr; // kernels/bvh_builder.cl is a seperate program, it is reloaded on its own
+
+	constexpr int MaxRenderDevices = 4;
+	constexpr int MinBandRows = 8;
+	RenderDevice devices[MaxRenderDevices];
+	int deviceBufferSize[2]; // resolution that the device buffers are created with
+	int numDevices = 0;
+	int numActiveDevices = 1; // number of devices that traced last frame
+
+	// picking, requested region of the id buffer is read without blocking after the trace
+	struct PickRequest { int x, y, width, height; };
+	PickRequest pendingPick;
+	bool hasPendingPick = false;
+	cl_event pickEvents[MaxRenderDevices]; // one read for each device that has rows in the region
+	int numPickEvents = 0;
+	int pickWidth = 0, pickHeight = 0;
+	Renderer::PickResult* pickResults = nullptr;
+	bool pickResultsReady = false;
+	bool multiDevice = true;
+	bool deferredShading = false; // visibility pass + shading pass instead of single trace kernel
+	bool materialSorting = true;  // deferred shading only, hits are shaded in material order
+	constexpr int MaterialBins = 257; // MATERIAL_BINS in the kernel, materials + sky
+	constexpr size_t MaterialSortGroupSize = 256, ShadeSortedGroupSize = 64; // preferred, less is used if device can't run it
+	bool raySorting = false; // deferred shading only, reflected rays are sorted before the secondary bounces
+	constexpr uint RayKeyBits = 24;        // RAY_KEY_BITS in the kernel
+	constexpr size_t SavedPathSize = 64;   // sizeof(SavedPath) in the kernel
+	// layout is same with the kernel
+	struct RayBinArgs { __m128 boundsMin, boundsMax; uint firstPixel, padding[3]; };
+	
+	bool temporalReprojection = false; // deferred shading only, shading of the last frame is reused where the same triangle is visible
+	bool hasHistory = false;           // last frame was reprojected and history buffers are valid
+	uint reprojectionFrame = 0;        // history buffers are swapped each frame
+	constexpr size_t HistoryPixelSize = 16; // sizeof(HistoryPixel) in the kernel
+	// layout is same with the kernel, camera of the last frame
+	struct ReprojectionArgs { 
+		Matrix4 prevView, prevProjection; 
+		__m128 prevCameraPos; 
+		int resolution[2], prevBandStart, prevBandEnd; 
+		uint frameIndex, enabled, padding[2]; 
+	} lastFrameCamera;
+
+#ifndef HEADLESS
 	GLuint VAO;
 	GLuint shaderProgram;
 	GLuint screenTexture;
+#else
+	// offscreen frames are read back to the host asynchronously, double buffered 
+	// so while we are writing one frame to disk gpu can render the next one
+	cl_event readbackEvents[2];
+	uint* readbackPixels[2];
+	uint numRenderedFrames = 0, numReadFrames = 0;
+#endif
 	Camera camera;
 	
-	cl_uint NumGPUCores;
+	cl_uint NumGPUCores; // of primary device
+
+	// dynamic resolution, we are tracing at renderScale * window size and upsampling to the screen texture
+	constexpr float MinRenderScale = 0.4f;
+	float renderScale = 1.0f;
+	float targetFrameTime = 16.6f; // ms
+	float smoothedFrameTime = 0.0f;
+	int renderScaleCooldown = 0; // frames to wait before changing the scale again
+	bool dynamicResolution = true;
+
+	// checkerboard rendering, half of the pixels are traced each frame and the other half is reconstructed.
+	// dynamic resolution turns it on when we are still over the budget at the minimum scale
+	bool checkerboard = false;      // forced on whatever the load is, otherwise only automatic
+	bool autoCheckerboard = false;  // turned on by dynamic resolution
+	float checkerboardQuality = 0.75f;
+	uint checkerboardFrame = 0;     // parity of the traced pixels alternates each frame
+
+	// adaptive sampling, forward rendering only. samples are accumulated while the camera and the scene are still,
+	// only the tiles that are noisier than the threshold are traced again
+	bool adaptiveSampling = false;
+	float adaptiveSamplingThreshold = 0.02f; // standard error of the mean luma relative to the luma
+	uint adaptiveSampleIndex = 0;            // frames since the accumulation is reset, zero means reset
+	constexpr size_t AccumulatedPixelSize = 32; // sizeof(AccumulatedPixel) in the kernel
+	constexpr size_t SampleTileSize = 8;        // SAMPLE_TILE_SIZE in the kernel
+	// accumulation is reset when any of these or the kernels change
+	struct AccumulationState {
+		Matrix4 view, projection;
+		float sunAngle;
+		int resolution[2];
+	} accumulationState;
 }
 
 const Camera& Renderer::GetCamera() { return camera; }
 
+void  Renderer::SetTargetFrameTime(float ms)           { targetFrameTime = Max(ms, 1.0f); }
+float Renderer::GetTargetFrameTime()                   { return targetFrameTime; }
+void  Renderer::SetDynamicResolution(bool enabled)     { dynamicResolution = enabled; }
+bool  Renderer::IsDynamicResolutionEnabled()           { return dynamicResolution; }
+float Renderer::GetRenderScale()                       { return renderScale; }
+void  Renderer::SetCheckerboard(bool enabled)          { checkerboard = enabled; }
+bool  Renderer::IsCheckerboardEnabled()                { return checkerboard; }
+bool  Renderer::IsCheckerboardActive()                 { return (checkerboard || autoCheckerboard) && !deferredShading; }
+void  Renderer::SetCheckerboardQuality(float quality)  { checkerboardQuality = Clamp(quality, 0.0f, 1.0f); }
+float Renderer::GetCheckerboardQuality()               { return checkerboardQuality; }
+void  Renderer::SetAdaptiveSampling(bool enabled)      { adaptiveSampling = enabled; }
+bool  Renderer::IsAdaptiveSamplingEnabled()            { return adaptiveSampling; }
+void  Renderer::SetAdaptiveSamplingThreshold(float threshold) { adaptiveSamplingThreshold = Max(threshold, 0.001f); }
+float Renderer::GetAdaptiveSamplingThreshold()         { return adaptiveSamplingThreshold; }
+void  Renderer::SetMultiDevice(bool enabled)           { multiDevice = enabled; }
+const Renderer::RenderFeatures& Renderer::GetFeatures() { return renderFeatures; }
+bool  Renderer::IsMultiDeviceEnabled()                 { return multiDevice; }
+int   Renderer::GetNumDevices()                        { return numDevices; }
+void  Renderer::SetDeferredShading(bool enabled)       { deferredShading = enabled; }
+bool  Renderer::IsDeferredShadingEnabled()             { return deferredShading; }
+void  Renderer::SetMaterialSorting(bool enabled)       { materialSorting = enabled; }
+bool  Renderer::IsMaterialSortingEnabled()             { return materialSorting; }
+void  Renderer::SetRaySorting(bool enabled)            { raySorting = enabled; }
+bool  Renderer::IsRaySortingEnabled()                  { return raySorting; }
+void  Renderer::SetTemporalReprojection(bool enabled)  { temporalReprojection = enabled; }
+bool  Renderer::IsTemporalReprojectionEnabled()        { return temporalReprojection; }
+float Renderer::GetDeviceShare(int device)             { return devices[device].share; }
+
 // extern for cpu ray trace
 uint g_NumMeshInstances = 0u;
 Matrix4 m_MeshTransforms[Renderer::MaxNumInstances];
@@ -49,10 +254,15 @@ MeshInstance m_MeshInstances[Renderer::MaxNumInstances];
 Matrix4* g_MeshTransforms = m_MeshTransforms;
 MeshInstance* g_MeshInstances = m_MeshInstances;
 
+// world space bounds of the instances, trace kernel tests these before transforming the ray in to the instance space
+AX_ALIGNED(16) struct InstanceBounds { __m128 min, max; };
+static InstanceBounds instanceBounds[Renderer::MaxNumInstances];
+
+#ifndef HEADLESS
 typedef void (*GLFWglproc)(void);
 extern "C" GLFWglproc glfwGetProcAddress(const char* procname); 
 
-void Renderer::CreateGLTexture(GLuint& texture, int width, int height, void* data)
+void Renderer::CreateGLTexture(GLuint& texture, int width, int height, void* data, int numChannels)
 {
 	glGenTextures(1, &texture);
 	glBindTexture(GL_TEXTURE_2D, texture);
@@ -60,7 +270,7 @@ void Renderer::CreateGLTexture(GLuint& texture, int width, int height, void* dat
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, numChannels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, data);
 }
 
 static void InitializeOpenGL()
@@ -118,6 +328,530 @@ static void InitializeOpenGL()
 	glGenVertexArrays(1, &VAO);
 	glBindVertexArray(VAO);
 }
+#endif // HEADLESS
+
+// used for scaled render target and headless screen. 
+// scaled render target is same size with the window because render scale is at most 1
+static cl_mem CreateScreenImage(int width, int height)
+{
+	cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+	cl_image_desc desc = {};
+	desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+	desc.image_width = width; desc.image_height = height;
+	cl_mem image = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, nullptr, &clerr); assert(clerr == 0);
+	return image;
+}
+
+// creates the buffer when its feature is turned on and releases it when the feature is turned off.
+// enqueued commands retain the buffers, so they can be released while the last frame is still running
+static void FeatureBuffer(cl_mem& buffer, bool needed, size_t size)
+{
+	if (needed && !buffer) { buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size, nullptr, &clerr); assert(clerr == 0); }
+	else if (!needed && buffer) { clReleaseMemObject(buffer); buffer = nullptr; }
+}
+
+// screen sized buffers of the optional features, forward rendering doesn't use any of them.
+// called at the start of each frame and when the device buffers are resized, only the enabled features have buffers
+static void UpdateFeatureBuffers(bool releaseAll = false)
+{
+	const size_t numPixels = (size_t)deviceBufferSize[0] * deviceBufferSize[1];
+	const size_t numTiles = ((deviceBufferSize[0] + SampleTileSize - 1) / SampleTileSize) * ((deviceBufferSize[1] + SampleTileSize - 1) / SampleTileSize);
+	const bool deferred = deferredShading && !releaseAll;
+	const bool sortMaterials = deferred && materialSorting, sortRays = deferred && raySorting, reproject = deferred && temporalReprojection;
+	const bool accumulate = adaptiveSampling && !releaseAll;
+	
+	for (int i = 0; i < numDevices; i++)
+	{
+		RenderDevice& device = devices[i];
+		FeatureBuffer(device.visibilityMem, deferred, sizeof(uint) * 4 * numPixels);
+		
+		FeatureBuffer(device.materialKeyMem  , sortMaterials, sizeof(ushort) * numPixels);
+		FeatureBuffer(device.sortedPixelMem  , sortMaterials, sizeof(uint) * numPixels);
+		FeatureBuffer(device.materialCountMem, sortMaterials, sizeof(uint) * MaterialBins);
+		
+		FeatureBuffer(device.savedPathMem, sortRays, SavedPathSize * numPixels);
+		for (int j = 0; j < 2; j++) {
+			FeatureBuffer(device.rayKeyMem[j]  , sortRays, sizeof(uint) * numPixels);
+			FeatureBuffer(device.rayValueMem[j], sortRays, sizeof(uint) * numPixels);
+		}
+		FeatureBuffer(device.rayHistogramMem, sortRays, GPUBVH::SortHistogramSize((uint)numPixels));
+		
+		FeatureBuffer(device.historyMem[0], reproject, HistoryPixelSize * numPixels);
+		FeatureBuffer(device.historyMem[1], reproject, HistoryPixelSize * numPixels);
+		
+		FeatureBuffer(device.accumulationMem   , accumulate, AccumulatedPixelSize * numPixels);
+		FeatureBuffer(device.sampleTileMem     , accumulate, sizeof(uint) * numTiles);
+		FeatureBuffer(device.sampleTileCountMem, accumulate, sizeof(uint));
+	}
+	// new buffers doesn't have anything in them
+	if (!reproject) hasHistory = false;
+	if (!accumulate) adaptiveSampleIndex = 0;
+}
+
+// ray buffers and band images of each device, these are depends on resolution
+static void CreateDeviceBuffers(int width, int height)
+{
+	deviceBufferSize[0] = width, deviceBufferSize[1] = height;
+	for (int i = 0; i < numDevices; i++)
+	{
+		devices[i].rayMem = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Vector3f) * width * height, nullptr, &clerr); assert(clerr == 0);
+		devices[i].idMem  = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Renderer::PickResult) * width * height, nullptr, &clerr); assert(clerr == 0);
+		// full size because render target can be the screen or scaled screen, and bands can be anywhere 
+		devices[i].bandScreen = i > 0 ? CreateScreenImage(width, height) : nullptr;
+	}
+	UpdateFeatureBuffers();
+}
+
+static void ReleaseDeviceBuffers()
+{
+	for (int i = 0; i < numDevices; i++)
+	{
+		clReleaseMemObject(devices[i].rayMem);
+		clReleaseMemObject(devices[i].idMem);
+		if (devices[i].bandScreen) clReleaseMemObject(devices[i].bandScreen);
+		devices[i].rayMem = devices[i].idMem = devices[i].bandScreen = nullptr;
+	}
+	UpdateFeatureBuffers(true); // resets the history and the accumulation too
+}
+
+// compiled programs are cached on disk, so we don't compile the kernels at every launch.
+// one file per program and build options, key inside the file is the hash of everything that affects the binary
+// (source text, options and devices), so an edited kernel is compiled again and its file is overwritten
+constexpr uint CProgramCacheVersion = 0;
+constexpr uint64 MaxProgramBinarySize = 256ull << 20; // per device, anything bigger is a corrupt file
+static const char* ProgramBuildOptions = "-cl-std=CL2.0 -Werror -O3"; // -cl-single-precision-constant -cl-mad-enable
+static const char* BuilderBuildOptions = "-cl-std=CL2.0 -Werror -O3";
+
+struct ProgramCacheHeader
+{
+	uint version;
+	uint numDevices;
+	uint64 key;
+	uint64 binarySizes[MaxRenderDevices];
+};
+
+static uint64 HashFNV1a(const void* data, size_t size, uint64 hash = 0xcbf29ce484222325ull)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+static uint64 ProgramCacheKey(const char* source, const char* options)
+{
+	uint64 key = HashFNV1a(source, strlen(source));
+	key = HashFNV1a(options, strlen(options), key);
+	
+	const cl_device_info deviceParams[] = { CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION };
+	for (int i = 0; i < numDevices; i++)
+	{
+		for (cl_device_info param : deviceParams)
+		{
+			char info[256]; size_t size = 0;
+			if (clGetDeviceInfo(devices[i].id, param, sizeof(info), info, &size) == CL_SUCCESS)
+				key = HashFNV1a(info, size, key);
+		}
+	}
+	return key;
+}
+
+static void ProgramCachePath(char* path, size_t pathSize, const char* name, const char* options)
+{
+	snprintf(path, pathSize, "kernels/%s_%016llx.clbin", name, (unsigned long long)HashFNV1a(options, strlen(options)));
+}
+
+static void LogBuildErrors(cl_program errorProgram)
+{
+	for (int i = 0; i < numDevices; i++)
+	{
+		size_t param_value_size;
+		clGetProgramBuildInfo(errorProgram, devices[i].id, CL_PROGRAM_BUILD_LOG, 0, NULL, &param_value_size);
+		char* buildLog = new char[param_value_size + 2]; buildLog[0] = '\n';
+		clGetProgramBuildInfo(errorProgram, devices[i].id, CL_PROGRAM_BUILD_LOG, param_value_size, buildLog + 1, NULL);
+		AXERROR(buildLog);
+		delete[] buildLog;
+	}
+}
+
+// returns nullptr if there is no cached program with the same key or driver rejects the binaries
+static cl_program LoadCachedProgram(const char* name, uint64 key, const char* options)
+{
+	char path[128];
+	ProgramCachePath(path, sizeof(path), name, options);
+	FILE* file = fopen(path, "rb");
+	if (!file) return nullptr;
+	fseek(file, 0, SEEK_END);
+	long fileSize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	ProgramCacheHeader header;
+	unsigned char* binaries[MaxRenderDevices] = {};
+	size_t binarySizes[MaxRenderDevices] = {};
+	bool valid = fread(&header, sizeof(ProgramCacheHeader), 1, file) == 1 && header.version == CProgramCacheVersion && 
+	             header.key == key && header.numDevices == (uint)numDevices;
+	
+	// sizes come from the file, truncated or corrupt file shouldn't make us allocate huge buffers
+	bool corrupt = false;
+	if (valid)
+	{
+		uint64 totalSize = 0;
+		for (int i = 0; i < numDevices; i++) {
+			corrupt |= header.binarySizes[i] == 0 || header.binarySizes[i] > MaxProgramBinarySize;
+			totalSize += header.binarySizes[i];
+		}
+		corrupt |= fileSize < 0 || totalSize != (uint64)fileSize - sizeof(ProgramCacheHeader);
+		valid = !corrupt;
+	}
+
+	for (int i = 0; i < numDevices && valid; i++)
+	{
+		binarySizes[i] = (size_t)header.binarySizes[i];
+		binaries[i] = new unsigned char[binarySizes[i]];
+		valid = fread(binaries[i], 1, binarySizes[i], file) == binarySizes[i];
+		corrupt |= !valid;
+	}
+	fclose(file);
+	if (corrupt) {
+		AXWARNING("program cache %s is corrupt, deleting it", path);
+		remove(path);
+	}
+
+	cl_program cachedProgram = nullptr;
+	if (valid)
+	{
+		cl_device_id deviceIds[MaxRenderDevices];
+		for (int i = 0; i < numDevices; i++) deviceIds[i] = devices[i].id;
+		
+		cl_int err;
+		cachedProgram = clCreateProgramWithBinary(context, numDevices, deviceIds, binarySizes, (const unsigned char**)binaries, nullptr, &err);
+		// binaries still has to be built, this only links the kernels
+		if (err == CL_SUCCESS && clBuildProgram(cachedProgram, 0, nullptr, options, nullptr, nullptr) != CL_SUCCESS) {
+			clReleaseProgram(cachedProgram);
+			err = CL_INVALID_BINARY;
+		}
+		if (err != CL_SUCCESS) {
+			AXLOG("cached program binary is rejected, building from source");
+			cachedProgram = nullptr;
+		}
+	}
+
+	for (int i = 0; i < numDevices; i++) delete[] binaries[i];
+	return cachedProgram;
+}
+
+static void SaveProgramCache(cl_program builtProgram, const char* name, uint64 key, const char* options)
+{
+	ProgramCacheHeader header = { CProgramCacheVersion, (uint)numDevices, key };
+	size_t binarySizes[MaxRenderDevices] = {};
+	if (clGetProgramInfo(builtProgram, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * numDevices, binarySizes, nullptr) != CL_SUCCESS) return;
+	
+	unsigned char* binaries[MaxRenderDevices] = {};
+	bool valid = true;
+	for (int i = 0; i < numDevices; i++)
+	{
+		valid &= binarySizes[i] > 0; // some drivers doesn't give binaries
+		header.binarySizes[i] = binarySizes[i];
+		binaries[i] = new unsigned char[binarySizes[i] + 1];
+	}
+
+	if (valid && clGetProgramInfo(builtProgram, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * numDevices, binaries, nullptr) == CL_SUCCESS)
+	{
+		char path[128];
+		ProgramCachePath(path, sizeof(path), name, options);
+		if (FILE* file = fopen(path, "wb"))
+		{
+			fwrite(&header, sizeof(ProgramCacheHeader), 1, file);
+			for (int i = 0; i < numDevices; i++) fwrite(binaries[i], 1, binarySizes[i], file);
+			fclose(file);
+		}
+		else AXLOG("unable to write program cache: %s", path);
+	}
+
+	for (int i = 0; i < numDevices; i++) delete[] binaries[i];
+}
+
+// loads the program from the cache or compiles it for all devices, returns nullptr and logs the errors if it doesn't compile
+static cl_program BuildProgram(const char* name, const char* source, const char* options)
+{
+	uint64 key = ProgramCacheKey(source, options);
+	if (cl_program cachedProgram = LoadCachedProgram(name, key, options)) return cachedProgram;
+
+	cl_int err;
+	cl_program newProgram = clCreateProgramWithSource(context, 1, &source, nullptr, &err); assert(err == 0);
+	
+	if (clBuildProgram(newProgram, 0, nullptr, options, nullptr, nullptr) != CL_SUCCESS)
+	{
+		LogBuildErrors(newProgram);
+		clReleaseProgram(newProgram);
+		return nullptr;
+	}
+	SaveProgramCache(newProgram, name, key, options);
+	return newProgram;
+}
+
+static bool FeaturesEqual(const Renderer::RenderFeatures& a, const Renderer::RenderFeatures& b)
+{
+	return a.maxBounces == b.maxBounces && a.shadows == b.shadows && a.specular == b.specular && a.nearestFilter == b.nearestFilter && a.idBuffer == b.idBuffer;
+}
+
+// compiles the source with the features as defines, thread safe. returns false and logs the errors if it doesn't compile
+static bool CreateProgramVariant(const char* source, const Renderer::RenderFeatures& features, ProgramVariant& variant)
+{
+	char options[256];
+	snprintf(options, sizeof(options), "%s -D MAX_BOUNCES=%d -D SHADOWS=%d -D SPECULAR=%d -D ID_BUFFER=%d%s", ProgramBuildOptions, 
+	         features.maxBounces, (int)features.shadows, (int)features.specular, (int)features.idBuffer, features.nearestFilter ? " -D TEXTURE_FILTER_NEAREST" : "");
+	
+	cl_program variantProgram = BuildProgram("Program", source, options);
+	if (!variantProgram) return false;
+
+	cl_int err;
+	variant.features = features;
+	variant.program  = variantProgram;
+	variant.traceKernel  = clCreateKernel(variantProgram, "Trace", &err); assert(err == 0);
+	variant.rayGenKernel = clCreateKernel(variantProgram, "RayGen", &err); assert(err == 0);
+	variant.PostProcessKernel   = clCreateKernel(variantProgram, "PostProcess", &err); assert(err == 0);
+	variant.upsampleKernel = clCreateKernel(variantProgram, "Upsample", &err); assert(err == 0);
+	variant.rayCastKernel  = clCreateKernel(variantProgram, "RayCast", &err); assert(err == 0);
+	variant.visibilityKernel = clCreateKernel(variantProgram, "TraceVisibility", &err); assert(err == 0);
+	variant.shadeKernel      = clCreateKernel(variantProgram, "ShadeDeferred", &err); assert(err == 0);
+	variant.countMaterialsKernel   = clCreateKernel(variantProgram, "CountMaterials", &err); assert(err == 0);
+	variant.scanMaterialsKernel    = clCreateKernel(variantProgram, "ScanMaterialCounts", &err); assert(err == 0);
+	variant.scatterMaterialsKernel = clCreateKernel(variantProgram, "ScatterByMaterial", &err); assert(err == 0);
+	variant.shadeSortedKernel      = clCreateKernel(variantProgram, "ShadeSorted", &err); assert(err == 0);
+	variant.traceSortedPathsKernel = clCreateKernel(variantProgram, "TraceSortedPaths", &err); assert(err == 0);
+	variant.reconstructKernel      = clCreateKernel(variantProgram, "ReconstructCheckerboard", &err); assert(err == 0);
+	variant.copyBandKernel         = clCreateKernel(variantProgram, "CopyCheckerboardBand", &err); assert(err == 0);
+	variant.allocateSamplesKernel     = clCreateKernel(variantProgram, "AllocateSamples", &err); assert(err == 0);
+	variant.traceAdaptiveKernel       = clCreateKernel(variantProgram, "TraceAdaptive", &err); assert(err == 0);
+	variant.resolveAccumulationKernel = clCreateKernel(variantProgram, "ResolveAccumulation", &err); assert(err == 0);
+	return true;
+}
+
+// enqueued commands retain their kernels, so variants can be released while the last frame is still running
+static void ReleaseProgramVariant(ProgramVariant& variant)
+{
+	clReleaseKernel(variant.rayGenKernel);
+	clReleaseKernel(variant.traceKernel);
+	clReleaseKernel(variant.PostProcessKernel);
+	clReleaseKernel(variant.upsampleKernel);
+	clReleaseKernel(variant.rayCastKernel);
+	clReleaseKernel(variant.visibilityKernel);
+	clReleaseKernel(variant.shadeKernel);
+	clReleaseKernel(variant.countMaterialsKernel);
+	clReleaseKernel(variant.scanMaterialsKernel);
+	clReleaseKernel(variant.scatterMaterialsKernel);
+	clReleaseKernel(variant.shadeSortedKernel);
+	clReleaseKernel(variant.traceSortedPathsKernel);
+	clReleaseKernel(variant.reconstructKernel);
+	clReleaseKernel(variant.copyBandKernel);
+	clReleaseKernel(variant.allocateSamplesKernel);
+	clReleaseKernel(variant.traceAdaptiveKernel);
+	clReleaseKernel(variant.resolveAccumulationKernel);
+	clReleaseProgram(variant.program);
+}
+
+// returns the compiled variant of the features, compiles it if this is the first time. nullptr if it doesn't compile
+// kernelReloadMutex has to be locked while the kernel watcher runs, swap replaces the variants and the source
+static ProgramVariant* GetProgramVariant(const Renderer::RenderFeatures& features)
+{
+	for (int i = 0; i < numProgramVariants; i++)
+		if (FeaturesEqual(programVariants[i].features, features)) return programVariants + i;
+
+	if (numProgramVariants == MaxProgramVariants) { AXERROR("max number of program variants reached!"); return nullptr; }
+
+	if (!CreateProgramVariant(kernelSource, features, programVariants[numProgramVariants])) return nullptr;
+	return programVariants + numProgramVariants++;
+}
+
+static void UseProgramVariant(const ProgramVariant& variant)
+{
+	program = variant.program;
+	traceKernel = variant.traceKernel;
+	rayGenKernel = variant.rayGenKernel;
+	PostProcessKernel = variant.PostProcessKernel;
+	upsampleKernel = variant.upsampleKernel;
+	rayCastKernel = variant.rayCastKernel;
+	visibilityKernel = variant.visibilityKernel;
+	shadeKernel = variant.shadeKernel;
+	countMaterialsKernel = variant.countMaterialsKernel;
+	scanMaterialsKernel = variant.scanMaterialsKernel;
+	scatterMaterialsKernel = variant.scatterMaterialsKernel;
+	shadeSortedKernel = variant.shadeSortedKernel;
+	traceSortedPathsKernel = variant.traceSortedPathsKernel;
+	reconstructKernel = variant.reconstructKernel;
+	copyBandKernel = variant.copyBandKernel;
+	allocateSamplesKernel = variant.allocateSamplesKernel;
+	traceAdaptiveKernel = variant.traceAdaptiveKernel;
+	resolveAccumulationKernel = variant.resolveAccumulationKernel;
+	renderFeatures = variant.features;
+	adaptiveSampleIndex = 0; // accumulated samples are traced with the old kernels
+}
+
+// commands of the last frame keeps the old kernels alive, so we can switch between frames
+void Renderer::SetFeatures(const RenderFeatures& features)
+{
+	RenderFeatures newFeatures = features;
+	newFeatures.maxBounces = Clamp(features.maxBounces, 1, MaxBounces);
+	if (FeaturesEqual(newFeatures, renderFeatures)) return;
+
+	// compiling a new variant holds the lock, watcher thread only waits for it when it hands over a reloaded program
+	std::lock_guard<std::mutex> lock(kernelReloadMutex);
+	if (ProgramVariant* variant = GetProgramVariant(newFeatures)) UseProgramVariant(*variant);
+	else AXERROR("kernels are not compiled with the requested features, using the old features");
+}
+
+// render kernels, MathAndSTL.cl and kernel_main.cl are compiled together
+static std::filesystem::file_time_type KernelFilesWriteTime(std::error_code& error)
+{
+	auto mathTime = std::filesystem::last_write_time("kernels/MathAndSTL.cl", error);
+	if (error) return mathTime;
+	auto mainTime = std::filesystem::last_write_time("kernels/kernel_main.cl", error);
+	return Max(mathTime, mainTime);
+}
+
+static void ReloadRenderKernels()
+{
+	char* source = Helper::ReadCombineKernels();
+	if (!source) return;
+
+	Renderer::RenderFeatures features;
+	{
+		std::lock_guard<std::mutex> lock(kernelReloadMutex);
+		features = renderFeatures;
+	}
+
+	AXLOG("kernel files changed, recompiling");
+	ProgramVariant variant;
+	if (!CreateProgramVariant(source, features, variant)) {
+		AXERROR("kernels are not compiled, using the old kernels");
+		delete[] source;
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(kernelReloadMutex);
+	if (hasPendingVariant) { // not swapped yet, newer one replaces it
+		ReleaseProgramVariant(pendingVariant);
+		delete[] pendingSource;
+	}
+	pendingVariant = variant;
+	pendingSource = source;
+	hasPendingVariant = true;
+}
+
+static void ReloadBuilderKernels()
+{
+	char* source = Helper::ReadAllText("kernels/bvh_builder.cl");
+	if (!source) return;
+
+	AXLOG("bvh builder kernels changed, recompiling");
+	cl_program builderProgram = BuildProgram("BVHBuilder", source, BuilderBuildOptions);
+	delete[] source;
+	if (!builderProgram) { AXERROR("bvh builder is not compiled, using the old kernels"); return; }
+
+	std::lock_guard<std::mutex> lock(kernelReloadMutex);
+	if (pendingBuilderProgram) clReleaseProgram(pendingBuilderProgram);
+	pendingBuilderProgram = builderProgram;
+	hasPendingBuilder = true;
+}
+
+// runs on the kernel watcher thread, polls the kernel files and compiles them when they change.
+// rendering continues with the old programs meanwhile, compile errors are logged and the old program is kept
+static void WatchKernelFiles()
+{
+	std::error_code error, builderError;
+	auto lastWriteTime = KernelFilesWriteTime(error);
+	auto lastBuilderWriteTime = std::filesystem::last_write_time("kernels/bvh_builder.cl", builderError);
+
+	while (!stopKernelWatcher)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		// files may not exist for a moment while an editor saves them
+		auto writeTime = KernelFilesWriteTime(error);
+		if (!error && writeTime != lastWriteTime) {
+			lastWriteTime = writeTime;
+			ReloadRenderKernels();
+		}
+
+		auto builderWriteTime = std::filesystem::last_write_time("kernels/bvh_builder.cl", builderError);
+		if (!builderError && builderWriteTime != lastBuilderWriteTime) {
+			lastBuilderWriteTime = builderWriteTime;
+			ReloadBuilderKernels();
+		}
+	}
+}
+
+// called between frames, variants of the old source are dropped and compiled again when they are used.
+// if features are changed while compiling, recompiled features are used
+static void SwapReloadedKernels()
+{
+	if (!hasPendingVariant && !hasPendingBuilder) return;
+	std::lock_guard<std::mutex> lock(kernelReloadMutex);
+	
+	if (hasPendingBuilder) 
+	{
+		// scratch buffers are released with the old kernels, sorts and builds in flight has to end first
+		for (int i = 0; i < numDevices; i++) clFinish(devices[i].queue);
+		GPUBVH::Terminate();
+		GPUBVH::Initialize(context, command_queue, pendingBuilderProgram);
+		// group sizes of the new kernels may need bigger sort histograms, next UpdateFeatureBuffers creates them again
+		for (int i = 0; i < numDevices; i++) FeatureBuffer(devices[i].rayHistogramMem, false, 0);
+		pendingBuilderProgram = nullptr;
+		hasPendingBuilder = false;
+		AXLOG("recompiled bvh builder is swapped in");
+	}
+	if (!hasPendingVariant) return;
+
+	for (int i = 0; i < numProgramVariants; i++) ReleaseProgramVariant(programVariants[i]);
+	delete[] kernelSource;
+	kernelSource = pendingSource;
+	programVariants[0] = pendingVariant;
+	numProgramVariants = 1;
+	UseProgramVariant(programVariants[0]);
+	
+	pendingSource = nullptr;
+	hasPendingVariant = false;
+	AXLOG("recompiled kernels are swapped in");
+}
+
+#ifndef HEADLESS
+// devices of a gl sharing context must be able to share the gl context, otherwise context creation fails with all of the devices.
+// drops the devices that can't and moves the device that presents the gl context to the front, it becomes the primary device.
+// secondary devices without gl sharing would need their own context and copying their bands through the host, they are not used
+static void KeepGLSharingDevices(cl_platform_id platform, const cl_context_properties* properties, cl_device_id* deviceIds, int& count)
+{
+	auto getGLContextInfo = (clGetGLContextInfoKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clGetGLContextInfoKHR");
+	if (!getGLContextInfo) { AXWARNING("clGetGLContextInfoKHR is not available, can't check gl sharing of the devices"); return; }
+
+	size_t sharingSize = 0;
+	if (getGLContextInfo(properties, CL_DEVICES_FOR_GL_CONTEXT_KHR, 0, nullptr, &sharingSize) != CL_SUCCESS || sharingSize == 0) return;
+	int numSharing = int(sharingSize / sizeof(cl_device_id));
+	cl_device_id* sharingDevices = new cl_device_id[numSharing];
+	clerr = getGLContextInfo(properties, CL_DEVICES_FOR_GL_CONTEXT_KHR, sharingSize, sharingDevices, nullptr); assert(clerr == 0);
+
+	cl_device_id presentingDevice = nullptr;
+	getGLContextInfo(properties, CL_CURRENT_DEVICE_FOR_GL_CONTEXT_KHR, sizeof(cl_device_id), &presentingDevice, nullptr);
+
+	int numKept = 0;
+	for (int i = 0; i < count; i++)
+	{
+		bool canShare = false;
+		for (int j = 0; j < numSharing; j++) canShare |= sharingDevices[j] == deviceIds[i];
+		
+		if (!canShare) {
+			char deviceName[128] = {};
+			clGetDeviceInfo(deviceIds[i], CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+			AXWARNING("%s can't share the gl context, it is not used for rendering", deviceName);
+			continue;
+		}
+		cl_device_id device = deviceIds[i];
+		deviceIds[numKept++] = device;
+		if (device == presentingDevice) deviceIds[numKept - 1] = deviceIds[0], deviceIds[0] = device;
+	}
+	delete[] sharingDevices;
+	// keep the primary device if none of them reported, context creation decides
+	if (numKept > 0) count = numKept;
+}
+#endif
 
 static void InitializeOpenCL()
 {
@@ -128,68 +862,338 @@ static void InitializeOpenCL()
 		fprintf(stderr, "Unable to get platform_id");  assert(0);
 	}
 
-	cl_uint num_of_devices = 0;
-	cl_device_id device_id;
-	// try to get a supported GPU device
-	if (clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU, 1, &device_id, &num_of_devices) != CL_SUCCESS) {
-		fprintf(stderr, "Unable to get device_id"); assert(0);
-	}
+	// gpu's first and than cpu devices, first device is the primary device
+	cl_device_id deviceIds[MaxRenderDevices];
+	cl_uint numGPUs = 0, numCPUs = 0;
+	if (clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU, MaxRenderDevices, deviceIds, &numGPUs) != CL_SUCCESS) numGPUs = 0;
+	numGPUs = Min(numGPUs, (cl_uint)MaxRenderDevices);
+	
+	if (numGPUs < MaxRenderDevices && 
+		clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_CPU, MaxRenderDevices - numGPUs, deviceIds + numGPUs, &numCPUs) != CL_SUCCESS) numCPUs = 0;
+	numCPUs = Min(numCPUs, (cl_uint)MaxRenderDevices - numGPUs);
+	numDevices = int(numGPUs + numCPUs);
+	
+	// otherwise use any device. (accelerators etc.)
+	if (numDevices == 0 && clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 1, deviceIds, nullptr) == CL_SUCCESS) numDevices = 1;
+	if (numDevices == 0) { fprintf(stderr, "Unable to get device_id"); assert(0); }
 
-	clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(uint), &NumGPUCores, nullptr);
+	clGetDeviceInfo(deviceIds[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(uint), &NumGPUCores, nullptr);
 	AXLOG("Num GPU Cores: %d", NumGPUCores);
 	// context properties list - must be terminated with 0
 	cl_context_properties properties[] =
 	{
+#ifndef HEADLESS
 		CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
 		CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+#endif
 		CL_CONTEXT_PLATFORM, (cl_context_properties)platform_id,
 		0
 	};
 
-	// create a context with the GPU devices
-	context = clCreateContext(properties, 1, &device_id, NULL, NULL, &clerr);
-	// create command queue using the context and device
-	command_queue = clCreateCommandQueueWithProperties(context, device_id, nullptr, &clerr);
+#ifndef HEADLESS
+	KeepGLSharingDevices(platform_id, properties, deviceIds, numDevices);
+#endif
+
+	// create a context with all of the devices, memory objects are shared and runtime keeps a copy on each device
+	context = clCreateContext(properties, numDevices, deviceIds, NULL, NULL, &clerr);
+	// driver may still reject the combination, multi device rendering is lost
+	if (clerr != CL_SUCCESS && numDevices > 1) {
+		AXWARNING("unable to create context with %d devices (error %d), rendering with only the primary device", numDevices, clerr);
+		numDevices = 1;
+		context = clCreateContext(properties, 1, deviceIds, NULL, NULL, &clerr);
+	}
+	assert(clerr == 0);
+
+	// create command queues, profiling is enabled for per command gpu timings and load balancing
+	cl_queue_properties queueProperties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+	for (int i = 0; i < numDevices; i++)
+	{
+		char deviceName[128] = {};
+		clGetDeviceInfo(deviceIds[i], CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+		AXLOG("Render device %d: %s", i, deviceName);
+		
+		devices[i] = {};
+		devices[i].id = deviceIds[i];
+		devices[i].share = 1.0f / numDevices;
+		devices[i].queue = clCreateCommandQueueWithProperties(context, deviceIds[i], queueProperties, &clerr); assert(clerr == 0);
+	}
+	command_queue = devices[0].queue;
 
 	ResourceManager::Initialize(context, command_queue);
 
-	// no need to delete this kernel code memory allocated from arena allocator
-	char* kernelCode = Helper::ReadCombineKernels();
+	kernelSource = Helper::ReadCombineKernels();
+	if (!kernelSource) { fprintf(stderr, "\nUnable to read kernels!"); assert(0); }
+
+	// kernel watcher isn't started yet, variants can be touched without the lock
+	ProgramVariant* variant = GetProgramVariant(renderFeatures);
+	if (!variant) { fprintf(stderr, "\nError building program!"); assert(0); }
+	UseProgramVariant(*variant);
 
-	program = clCreateProgramWithSource(context, 1, (const char**)&kernelCode, 0, &clerr); assert(clerr == 0);
+	// bvh builder is a seperate program, it doesn't depend on the render features
+	char* builderSource = Helper::ReadAllText("kernels/bvh_builder.cl");
+	cl_program builderProgram = builderSource ? BuildProgram("BVHBuilder", builderSource, BuilderBuildOptions) : nullptr;
+	delete[] builderSource;
+	GPUBVH::Initialize(context, command_queue, builderProgram);
+	Physics::Initialize(context, command_queue);
+}
 
-	// compile the program
-	if (clBuildProgram(program, 0, NULL, "-cl-std=CL2.0 -Werror -O3", NULL, NULL) != CL_SUCCESS) // -cl-single-precision-constant -cl-mad-enable
+// local work size tuning. each candidate is measured for a few frames while rendering the actual scene,
+// trace cost depends on the scene so an isolated benchmark wouldn't tell much.
+// winners are cached per device and driver version, later runs use them without measuring
+
+constexpr int TuningSamples = 4; // frames per candidate
+static const char* LocalSizeCachePath = "kernels/LocalSizes.txt";
+static bool localSizeCacheDirty = false; // file is written once when all tunings are finished, or at terminate
+
+// file format is one line per kernel: device name;driver version;KernelName x y
+static void LoadLocalSizeCache()
+{
+	FILE* file = fopen(LocalSizeCachePath, "r");
+	if (!file) return;
+
+	char line[512];
+	while (fgets(line, sizeof(line), file))
 	{
-		size_t param_value_size;
-		clerr = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &param_value_size);
-		char* buildLog = new char[param_value_size + 2]; buildLog[0] = '\n';
-		clerr = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, param_value_size, buildLog + 1, NULL);
-		AXERROR(buildLog);
-		delete[] buildLog;
-		fprintf(stderr, "\nError building program!");
-		assert(0);
+		char* separator = strrchr(line, ';');
+		if (!separator) continue;
+		*separator = '\0';
+		
+		char kernelName[64]; size_t x, y;
+		if (sscanf(separator + 1, "%63s %zu %zu", kernelName, &x, &y) != 3) continue;
+
+		for (int i = 0; i < numDevices; i++)
+		{
+			if (strcmp(line, devices[i].tuningKey) != 0) continue;
+			
+			for (int k = 0; k < Num_TunedKernels; k++)
+			{
+				if (strcmp(kernelName, TunedKernelNames[k]) != 0) continue;
+				KernelTuning& tuning = devices[i].tunings[k];
+				// only accept sizes that this kernel can still run with, otherwise tune again
+				for (int c = 0; c < NumLocalSizeCandidates; c++)
+				{
+					if (!(tuning.validCandidates >> c & 1) || LocalSizeCandidates[c][0] != x || LocalSizeCandidates[c][1] != y) continue;
+					tuning.localSize[0] = x, tuning.localSize[1] = y;
+					tuning.candidate = -1;
+				}
+			}
+		}
+	}
+	fclose(file);
+}
+
+static void SaveLocalSizeCache()
+{
+	char* oldContent = nullptr;
+	if (FILE* file = fopen(LocalSizeCachePath, "rb"))
+	{
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		oldContent = new char[size + 1];
+		oldContent[fread(oldContent, 1, size, file)] = '\0';
+		fclose(file);
+	}
+
+	FILE* file = fopen(LocalSizeCachePath, "w");
+	if (!file) { AXLOG("unable to write local size cache: %s", LocalSizeCachePath); delete[] oldContent; return; }
+
+	// keep the lines of other devices, lines of our devices are rewritten below
+	for (char* line = oldContent; line && *line; )
+	{
+		char* lineEnd = strchr(line, '\n');
+		if (lineEnd) *lineEnd = '\0';
+		
+		const char* separator = strrchr(line, ';');
+		bool ours = false;
+		for (int i = 0; i < numDevices && separator; i++)
+		{
+			size_t keyLength = separator - line;
+			ours |= strlen(devices[i].tuningKey) == keyLength && strncmp(line, devices[i].tuningKey, keyLength) == 0;
+		}
+		if (separator && !ours) fprintf(file, "%s\n", line);
+		line = lineEnd ? lineEnd + 1 : nullptr;
+	}
+	delete[] oldContent;
+
+	for (int i = 0; i < numDevices; i++)
+	{
+		bool duplicate = false; // identical devices has the same key
+		for (int j = 0; j < i; j++) duplicate |= strcmp(devices[i].tuningKey, devices[j].tuningKey) == 0;
+		if (duplicate) continue;
+
+		for (int k = 0; k < Num_TunedKernels; k++)
+		{
+			const KernelTuning& tuning = devices[i].tunings[k];
+			if (tuning.candidate != -1) continue; // not finished yet
+			fprintf(file, "%s;%s %zu %zu\n", devices[i].tuningKey, TunedKernelNames[k], tuning.localSize[0], tuning.localSize[1]);
+		}
+	}
+	fclose(file);
+}
+
+static void InitializeKernelTuning()
+{
+	cl_kernel kernels[Num_TunedKernels] = { rayGenKernel, traceKernel, upsampleKernel, PostProcessKernel, visibilityKernel, shadeKernel };
+	
+	for (int i = 0; i < numDevices; i++)
+	{
+		RenderDevice& device = devices[i];
+		char deviceName[128] = {}, driverVersion[64] = {};
+		clGetDeviceInfo(device.id, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+		clGetDeviceInfo(device.id, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, nullptr);
+		snprintf(device.tuningKey, sizeof(device.tuningKey), "%s;%s", deviceName, driverVersion);
+		// separators of the cache file can't be in the names
+		for (char* c = device.tuningKey; *c; c++) 
+			if (*c == '\n' || *c == '\r' || (*c == ';' && c - device.tuningKey != (ptrdiff_t)strlen(deviceName))) *c = ' ';
+
+		// bands and scaled resolutions are not multiple of the local size, 
+		// this query doesn't exist before OpenCL 3.0 but 2.0 devices always support non uniform work groups
+		cl_bool nonUniform = CL_TRUE;
+		clGetDeviceInfo(device.id, CL_DEVICE_NON_UNIFORM_WORK_GROUP_SUPPORT, sizeof(cl_bool), &nonUniform, nullptr);
+		size_t maxItemSizes[3] = { 1, 1, 1 };
+		clGetDeviceInfo(device.id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItemSizes), maxItemSizes, nullptr);
+
+		for (int k = 0; k < Num_TunedKernels; k++)
+		{
+			KernelTuning& tuning = device.tunings[k];
+			tuning = {};
+			size_t maxGroupSize = 0;
+			clGetKernelWorkGroupInfo(kernels[k], device.id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroupSize, nullptr);
+			maxGroupSize = Min(maxGroupSize, (size_t)256);
+
+			tuning.validCandidates = 1u; // driver's choice
+			for (int c = 1; c < NumLocalSizeCandidates && nonUniform; c++)
+			{
+				const size_t* size = LocalSizeCandidates[c];
+				if (size[0] * size[1] <= maxGroupSize && size[0] <= maxItemSizes[0] && size[1] <= maxItemSizes[1])
+					tuning.validCandidates |= 1u << c;
+			}
+			for (int c = 0; c < NumLocalSizeCandidates; c++) tuning.bestTimes[c] = 1e30f;
+			tuning.candidate = 0;
+		}
+	}
+	
+	LoadLocalSizeCache();
+}
+
+// moves to the next candidate, when all of them are measured picks the fastest one
+static void NextTuningCandidate(RenderDevice& device, int kernel)
+{
+	KernelTuning& tuning = device.tunings[kernel];
+	tuning.numSamples = 0;
+	uint remaining = tuning.validCandidates & ~((2u << tuning.candidate) - 1u);
+	if (remaining) { tuning.candidate = (int)TrailingZeroCount(remaining); return; }
+
+	int best = 0;
+	for (int c = 1; c < NumLocalSizeCandidates; c++)
+		if ((tuning.validCandidates >> c & 1) && tuning.bestTimes[c] < tuning.bestTimes[best]) best = c;
+
+	tuning.candidate = -1;
+	tuning.localSize[0] = LocalSizeCandidates[best][0];
+	tuning.localSize[1] = LocalSizeCandidates[best][1];
+	AXLOG("%s local size: %zux%zu on %s", TunedKernelNames[kernel], tuning.localSize[0], tuning.localSize[1], device.tuningKey);
+	localSizeCacheDirty = true;
+}
+
+static bool AllTuningsFinished()
+{
+	for (int i = 0; i < numDevices; i++)
+		for (int k = 0; k < Num_TunedKernels; k++)
+			if (devices[i].tunings[k].candidate != -1) return false;
+	return true;
+}
+
+// reads measurements of the last frame, commands of the last frame are completed here (see CollectProfileEvents)
+static void UpdateKernelTuning()
+{
+	for (int i = 0; i < numDevices; i++)
+	{
+		for (int k = 0; k < Num_TunedKernels; k++)
+		{
+			KernelTuning& tuning = devices[i].tunings[k];
+			if (!tuning.event) continue;
+			
+			cl_ulong start, end;
+			if (tuning.candidate >= 0 && tuning.numItems > 0 &&
+				clGetEventProfilingInfo(tuning.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr) == CL_SUCCESS &&
+				clGetEventProfilingInfo(tuning.event, CL_PROFILING_COMMAND_END  , sizeof(cl_ulong), &end  , nullptr) == CL_SUCCESS && end > start)
+			{
+				// per work item, so dynamic resolution and band size changes doesn't affect the comparison
+				float time = float(end - start) / float(tuning.numItems);
+				tuning.bestTimes[tuning.candidate] = Min(tuning.bestTimes[tuning.candidate], time);
+				if (++tuning.numSamples >= TuningSamples) NextTuningCandidate(devices[i], k);
+			}
+			clReleaseEvent(tuning.event);
+			tuning.event = nullptr;
+		}
+	}
+	// kernels finish tuning in different frames, rewriting the file for each one would stall the render loop
+	if (localSizeCacheDirty && AllTuningsFinished()) {
+		SaveLocalSizeCache();
+		localSizeCacheDirty = false;
 	}
 }
 
+// launches the kernel with the tuned local size, or with the candidate that we are measuring
+static cl_int EnqueueTunedKernel(RenderDevice& device, TunedKernel kernelType, cl_kernel kernel, const size_t* offset, const size_t* globalSize,
+                                 cl_uint numWaitEvents, const cl_event* waitEvents, cl_event* event)
+{
+	KernelTuning& tuning = device.tunings[kernelType];
+	bool measure = tuning.candidate >= 0 && !tuning.event;
+	const size_t* localSize = tuning.candidate >= 0 ? LocalSizeCandidates[tuning.candidate] : tuning.localSize;
+	
+	cl_event* outEvent = event ? event : measure ? &tuning.event : nullptr;
+	cl_int err = clEnqueueNDRangeKernel(device.queue, kernel, 2, offset, globalSize, localSize[0] ? localSize : nullptr, numWaitEvents, waitEvents, outEvent);
+	
+	// kernel may not fit with this local size (register or local memory usage), drop the candidate and let the driver decide
+	if (err != CL_SUCCESS && localSize[0] != 0)
+	{
+		if (tuning.candidate > 0) {
+			tuning.validCandidates &= ~(1u << tuning.candidate);
+			NextTuningCandidate(device, kernelType);
+		}
+		else tuning.localSize[0] = tuning.localSize[1] = 0;
+		return clEnqueueNDRangeKernel(device.queue, kernel, 2, offset, globalSize, nullptr, numWaitEvents, waitEvents, event);
+	}
+
+	if (measure && err == CL_SUCCESS)
+	{
+		if (event) { tuning.event = *event; clRetainEvent(tuning.event); }
+		tuning.numItems = globalSize[0] * globalSize[1];
+	}
+	return err;
+}
+
 int Renderer::Initialize()
 {
 	camera = Camera(Window::GetWindowScale());
-	
+#ifndef HEADLESS
 	InitializeOpenGL();
+#endif
 	InitializeOpenCL();
 	CPU_RayTraceInitialize();
 
 	// initialize buffers
-	instanceMem = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(MeshInstance) * MaxNumInstances, nullptr, &clerr); assert(clerr == 0);
-	
-	rayMem = clCreateBuffer(context, 0, sizeof(Vector3f) * Window::GetWidth() * Window::GetHeight(), nullptr, &clerr); assert(clerr == 0);
+	for (int i = 0; i < numDevices; i++) {
+		devices[i].instanceMem = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(MeshInstance) * MaxNumInstances, nullptr, &clerr); assert(clerr == 0);
+		devices[i].instanceBoundsMem = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(InstanceBounds) * MaxNumInstances, nullptr, &clerr); assert(clerr == 0);
+	}
+	CreateDeviceBuffers(Window::GetWidth(), Window::GetHeight());
 
-	traceKernel  = clCreateKernel(program, "Trace", &clerr); assert(clerr == 0);
-	rayGenKernel = clCreateKernel(program, "RayGen", &clerr); assert(clerr == 0);
-	PostProcessKernel   = clCreateKernel(program, "PostProcess", &clerr); assert(clerr == 0);
+	InitializeKernelTuning();
 
+#ifndef HEADLESS
 	clglScreen = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, screenTexture, &clerr); assert(clerr == 0);
+#else
+	clglScreen = CreateScreenImage(Window::GetWidth(), Window::GetHeight());
+	readbackPixels[0] = new uint[Window::GetWidth() * Window::GetHeight()];
+	readbackPixels[1] = new uint[Window::GetWidth() * Window::GetHeight()];
+#endif
+	scaledScreen = CreateScreenImage(Window::GetWidth(), Window::GetHeight());
+#ifndef GAME_BUILD
+	kernelWatcher = std::thread(WatchKernelFiles);
+#endif
 	return 1;
 }
 
@@ -198,20 +1202,60 @@ void Renderer::OnKeyPressed(int keyCode, int action) {}
 void Renderer::OnWindowResize(int width, int height)
 {
 	if (width < 16 || height < 16) return;
-	clFinish(command_queue); cl_int clerr;
+	for (int i = 0; i < numDevices; i++) clFinish(devices[i].queue);
+	cl_int clerr;
 	clReleaseMemObject(clglScreen);
-	clReleaseMemObject(rayMem);
+	clReleaseMemObject(scaledScreen);
+	ReleaseDeviceBuffers();
+	clglScreen = scaledScreen = nullptr; 
+#ifndef HEADLESS
 	glDeleteTextures(1, &screenTexture);
-	rayMem = clglScreen = nullptr; screenTexture = 0u;
+	screenTexture = 0u;
 	CreateGLTexture(screenTexture, width, height);
 	clglScreen = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, screenTexture, &clerr);  assert(clerr == 0);
-	rayMem = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Vector3f) * width * height, nullptr, &clerr); assert(clerr == 0);
 	glViewport(0, 0, width, height);
+#else
+	clglScreen = CreateScreenImage(width, height);
+	// frames that are not read yet are dropped
+	for (int i = 0; i < 2; i++) {
+		if (readbackEvents[i]) clReleaseEvent(readbackEvents[i]);
+		readbackEvents[i] = nullptr;
+		delete[] readbackPixels[i];
+		readbackPixels[i] = new uint[width * height];
+	}
+	numReadFrames = numRenderedFrames;
+#endif
+	scaledScreen = CreateScreenImage(width, height);
+	CreateDeviceBuffers(width, height);
 	camera.RecalculateProjection(width, height);
 }
 
 static uint numRegisteredInstances = 0, lastRegisterInstanceIndex = 0;
 
+// transforms bounds of the mesh's root node with arvo's method:
+// center is transformed, extents are projected on to the world axes with absolute of the matrix
+static void UpdateInstanceBounds(uint index)
+{
+	const BVHNode& root = ResourceManager::GetMeshRootNode(g_MeshInstances[index].meshIndex);
+	const Matrix4& m = g_MeshTransforms[index];
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 center = _mm_mul_ps(_mm_add_ps(root.minv, root.maxv), half);
+	__m128 extent = _mm_mul_ps(_mm_sub_ps(root.maxv, root.minv), half);
+
+	__m128 worldCenter = m.r[3];
+	worldCenter = _mm_add_ps(worldCenter, _mm_mul_ps(_mm_shuffle_ps(center, center, _mm_shuffle(0, 0, 0, 0)), m.r[0]));
+	worldCenter = _mm_add_ps(worldCenter, _mm_mul_ps(_mm_shuffle_ps(center, center, _mm_shuffle(1, 1, 1, 1)), m.r[1]));
+	worldCenter = _mm_add_ps(worldCenter, _mm_mul_ps(_mm_shuffle_ps(center, center, _mm_shuffle(2, 2, 2, 2)), m.r[2]));
+	
+	__m128 worldExtent =                    _mm_mul_ps(_mm_shuffle_ps(extent, extent, _mm_shuffle(0, 0, 0, 0)), _mm_and_ps(m.r[0], absMask));
+	worldExtent = _mm_add_ps(worldExtent, _mm_mul_ps(_mm_shuffle_ps(extent, extent, _mm_shuffle(1, 1, 1, 1)), _mm_and_ps(m.r[1], absMask)));
+	worldExtent = _mm_add_ps(worldExtent, _mm_mul_ps(_mm_shuffle_ps(extent, extent, _mm_shuffle(2, 2, 2, 2)), _mm_and_ps(m.r[2], absMask)));
+
+	instanceBounds[index].min = _mm_sub_ps(worldCenter, worldExtent);
+	instanceBounds[index].max = _mm_add_ps(worldCenter, worldExtent);
+}
+
 void Renderer::BeginInstanceRegister() {
 	numRegisteredInstances = 0;
 }
@@ -234,20 +1278,31 @@ MeshInstanceHandle Renderer::RegisterMeshInstance(
 
 	MeshInstance& instance = g_MeshInstances[g_NumMeshInstances];
 	g_MeshTransforms[g_NumMeshInstances++] = matrix;
-	instance.inverseTransform = Matrix4::InverseTransform(matrix);
+	instance.SetTransform(matrix);
 	instance.meshIndex = handle;
 	instance.materialStart = materialHandle;
+	instance.mask = ~0u;
+	UpdateInstanceBounds(g_NumMeshInstances - 1);
 	return numRegisteredInstances++;
 }
 
 void Renderer::EndInstanceRegister() {
 
-	clerr = clEnqueueWriteBuffer(
-        command_queue, instanceMem, true, 
-		lastRegisterInstanceIndex * sizeof(MeshInstance), 
-		numRegisteredInstances * sizeof(MeshInstance), 
-		g_MeshInstances + lastRegisterInstanceIndex, 0, 0, 0
-    );	
+	for (int i = 0; i < numDevices; i++)
+	{
+		clerr = clEnqueueWriteBuffer(
+			devices[i].queue, devices[i].instanceMem, true, 
+			lastRegisterInstanceIndex * sizeof(MeshInstance), 
+			numRegisteredInstances * sizeof(MeshInstance), 
+			g_MeshInstances + lastRegisterInstanceIndex, 0, 0, 0
+		);	
+		clerr = clEnqueueWriteBuffer(
+			devices[i].queue, devices[i].instanceBoundsMem, true, 
+			lastRegisterInstanceIndex * sizeof(InstanceBounds), 
+			numRegisteredInstances * sizeof(InstanceBounds), 
+			instanceBounds + lastRegisterInstanceIndex, 0, 0, 0
+		);	
+	}
 
 	lastRegisterInstanceIndex += numRegisteredInstances;
 	numRegisteredInstances = 0;
@@ -255,10 +1310,16 @@ void Renderer::EndInstanceRegister() {
 
 static ushort removedInstances[50]; // we can remove max 50 objects each frame
 static ushort numRemovedInstances = 0;
-static ushort MinUpdatedInstanceIndex = 0xFFFFu, MaxUpdatedInstanceIndex = 0u;
+static Bitset<Renderer::MaxNumInstances> dirtyInstances; // instances that changed since last upload
 static bool shouldUpdateInstances = 0;
 static bool hasRemovedInstances = 0;
 
+static void MarkInstanceDirty(MeshInstanceHandle instanceHandle)
+{
+	dirtyInstances.Set(instanceHandle);
+	shouldUpdateInstances = true;
+}
+
 void Renderer::RemoveMeshInstance(MeshInstanceHandle handle) {
 	if (numRegisteredInstances == 0) { AXERROR("you cant remove mesh instances while registering instances!"); exit(0); }
 	hasRemovedInstances = true;
@@ -267,9 +1328,14 @@ void Renderer::RemoveMeshInstance(MeshInstanceHandle handle) {
 
 void Renderer::SetMeshInstanceMaterial(MeshInstanceHandle instanceHandle, MaterialHandle materialHandle)
 {
-	g_MeshInstances[instanceHandle].materialStart = materialHandle; shouldUpdateInstances = true;
-	MinUpdatedInstanceIndex = Min(instanceHandle, (uint)MinUpdatedInstanceIndex);
-	MaxUpdatedInstanceIndex = Max(instanceHandle+1, (uint)MaxUpdatedInstanceIndex);
+	g_MeshInstances[instanceHandle].materialStart = materialHandle;
+	MarkInstanceDirty(instanceHandle);
+}
+
+void Renderer::SetMeshInstanceMask(MeshInstanceHandle instanceHandle, uint mask)
+{
+	g_MeshInstances[instanceHandle].mask = mask;
+	MarkInstanceDirty(instanceHandle);
 }
 
 void Renderer::SetMeshPosition(MeshInstanceHandle instanceHandle, float3 position)
@@ -278,11 +1344,9 @@ void Renderer::SetMeshPosition(MeshInstanceHandle instanceHandle, float3 positio
 	Matrix4& transform = g_MeshTransforms[instanceHandle];
 	transform.r[3] = SSESelect(transform.r[3], _mm_setr_ps(position.x, position.y, position.z, 0), g_XMSelect1110); 
 	// todo maybe we can eliminate this matrix inversion, because we are just changing the position
-	instance.inverseTransform = Matrix4::InverseTransform(transform); 
-
-	shouldUpdateInstances = true;
-	MinUpdatedInstanceIndex = Min(instanceHandle, (uint)MinUpdatedInstanceIndex);
-	MaxUpdatedInstanceIndex = Max(instanceHandle+1, (uint)MaxUpdatedInstanceIndex);
+	instance.SetTransform(transform); 
+	UpdateInstanceBounds(instanceHandle);
+	MarkInstanceDirty(instanceHandle);
 }
 
 void Renderer::SetMeshMatrix(MeshInstanceHandle instanceHandle, const Matrix4& matrix)
@@ -290,105 +1354,787 @@ void Renderer::SetMeshMatrix(MeshInstanceHandle instanceHandle, const Matrix4& m
 	MeshInstance& instance = g_MeshInstances[instanceHandle];
 	Matrix4& transform = g_MeshTransforms[instanceHandle];
 	transform = matrix;
-	instance.inverseTransform = Matrix4::InverseTransform(transform);
+	instance.SetTransform(transform);
+	UpdateInstanceBounds(instanceHandle);
+	MarkInstanceDirty(instanceHandle);
+}
 
-	shouldUpdateInstances = true;
-	MinUpdatedInstanceIndex = Min(instanceHandle, (uint)MinUpdatedInstanceIndex);
-	MaxUpdatedInstanceIndex = Max(instanceHandle+1, (uint)MaxUpdatedInstanceIndex);	
+// ---- GPU PROFILING ----
+// each enqueued command of the frame gets an event, timings are read at the beginning of the next frame.
+// commands of the last frame are already completed because of the clFinish at the end of the Render
+// (headless mode waits for the last frame at the beginning of the Render), so this never stalls
+
+constexpr int MaxProfileEvents = 32;
+static cl_event profileEvents[MaxProfileEvents];
+static ProfilerStats profileEventStats[MaxProfileEvents];
+static int numProfileEvents = 0;
+
+// returns event slot for the command that we want to measure, or nullptr if there is no space left
+static cl_event* ProfileEvent(ProfilerStats stat)
+{
+	if (numProfileEvents == MaxProfileEvents) return nullptr;
+	profileEventStats[numProfileEvents] = stat;
+	return profileEvents + numProfileEvents++;
+}
+
+// returns gpu frame time of the last frame in miliseconds, or zero if there is no measurement
+static float CollectProfileEvents()
+{
+	float statTimes[Num_ProfilerStats] = { 0.0f };
+	bool  statUsed[Num_ProfilerStats] = { false };
+	cl_ulong frameStart = ~0ull, frameEnd = 0ull;
+
+	for (int i = 0; i < numProfileEvents; ++i)
+	{
+		cl_int status; cl_ulong start, end;
+		clGetEventInfo(profileEvents[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+		
+		// some drivers doesn't support profiling gl acquire&release, we are skipping those
+		if (status == CL_COMPLETE &&
+			clGetEventProfilingInfo(profileEvents[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr) == CL_SUCCESS &&
+			clGetEventProfilingInfo(profileEvents[i], CL_PROFILING_COMMAND_END  , sizeof(cl_ulong), &end  , nullptr) == CL_SUCCESS)
+		{
+			statTimes[profileEventStats[i]] += float(end - start) * 1e-6f; // nanosecond to milisecond
+			statUsed[profileEventStats[i]] = true;
+			frameStart = Min(frameStart, start);
+			frameEnd = Max(frameEnd, end);
+		}
+		clReleaseEvent(profileEvents[i]);
+	}
+
+	float gpuFrameTime = 0.0f;
+	if (numProfileEvents > 0 && frameEnd > frameStart) {
+		gpuFrameTime = float(frameEnd - frameStart) * 1e-6f;
+		Engine_UpdateProfilerStats(ProfilerStats_GPUFrame, gpuFrameTime);
+	}
+
+	for (int i = ProfilerStats_GPUFrame + 1; i < Num_ProfilerStats; ++i)
+		if (statUsed[i]) Engine_UpdateProfilerStats((ProfilerStats)i, statTimes[i]);
+
+	numProfileEvents = 0;
+	return gpuFrameTime;
+}
+
+// chooses render scale from recent gpu frame times. 
+// scale goes down when we are over the budget and goes up only when there is clear headroom,
+// the gap between these two thresholds and the cooldown prevents oscillating between resolutions
+static void UpdateRenderScale(float gpuFrameTime)
+{
+	if (!dynamicResolution) { renderScale = 1.0f, autoCheckerboard = false; return; }
+	if (gpuFrameTime <= 0.0f) return;
+
+	smoothedFrameTime = smoothedFrameTime == 0.0f ? gpuFrameTime : Lerp(smoothedFrameTime, gpuFrameTime, 0.15f);
+	
+	if (renderScaleCooldown > 0) { renderScaleCooldown--; return; }
+
+	bool overBudget = smoothedFrameTime > targetFrameTime * 1.05f;
+	
+	// checkerboard is the last step down and the first step up. it roughly halves the trace cost, 
+	// so it is turned off only if doubling the frame time still fits in the budget
+	bool toggleCheckerboard = autoCheckerboard ? smoothedFrameTime < targetFrameTime * 0.45f 
+	                                           : overBudget && renderScale <= MinRenderScale && !deferredShading;
+	if (toggleCheckerboard)
+	{
+		autoCheckerboard = !autoCheckerboard;
+		renderScaleCooldown = 8;
+		smoothedFrameTime = 0.0f;
+		return;
+	}
+	
+	bool hasHeadroom = smoothedFrameTime < targetFrameTime * 0.75f && renderScale < 1.0f && !autoCheckerboard;
+	if (!overBudget && !hasHeadroom) return;
+
+	// trace cost is roughly proportional to pixel count which is scale^2, aim slightly below the target
+	float newScale = renderScale * Sqrt(targetFrameTime * 0.9f / smoothedFrameTime);
+	newScale = Min(newScale, renderScale + 0.1f); // go up slowly, go down as fast as we need
+	newScale = Clamp(newScale, MinRenderScale, 1.0f);
+	if (newScale > 0.97f) newScale = 1.0f;
+
+	if (FAbs(newScale - renderScale) < 0.02f) return; // not worth it
+	
+	renderScale = newScale;
+	renderScaleCooldown = 8;
+	smoothedFrameTime = 0.0f; // measurements of old resolution are not relevant anymore
+}
+
+// devices that traced more rows per milisecond last frame get bigger bands,
+// shares are smoothed because timings of a single frame are noisy
+static void BalanceDevices()
+{
+	float speeds[MaxRenderDevices], totalSpeed = 0.0f;
+	bool hasTimings = true;
+	
+	for (int i = 0; i < numActiveDevices; i++)
+	{
+		RenderDevice& device = devices[i];
+		if (!device.traceEvent) { hasTimings = false; continue; }
+		
+		// deferred shading has two passes, device is busy from start of the trace to the end of the shading
+		cl_event endEvent = device.shadeEvent ? device.shadeEvent : device.traceEvent;
+		cl_ulong start, end;
+		if (clGetEventProfilingInfo(device.traceEvent, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr) == CL_SUCCESS &&
+			clGetEventProfilingInfo(endEvent, CL_PROFILING_COMMAND_END  , sizeof(cl_ulong), &end  , nullptr) == CL_SUCCESS && end > start)
+		{
+			speeds[i] = float(device.bandEnd - device.bandStart) / (float(end - start) * 1e-6f);
+			totalSpeed += speeds[i];
+		}
+		else hasTimings = false;
+		
+		clReleaseEvent(device.traceEvent);
+		device.traceEvent = nullptr;
+		if (device.shadeEvent) clReleaseEvent(device.shadeEvent);
+		device.shadeEvent = nullptr;
+	}
+
+	// bands are kept while samples are accumulated, accumulation of the rows would be lost 
+	// and trace times of the converged bands doesn't show the speed of the device anyway
+	if (!hasTimings || numActiveDevices < 2 || adaptiveSampleIndex > 0) return;
+	
+	for (int i = 0; i < numActiveDevices; i++)
+		devices[i].share = Lerp(devices[i].share, speeds[i] / totalSpeed, 0.25f);
+}
+
+// splits the rows of the frame between devices, returns number of devices that will trace this frame
+static int AssignBands(int height)
+{
+	int numBandDevices = multiDevice ? Min(numDevices, height / MinBandRows) : 1;
+	float totalShare = 0.0f;
+	for (int i = 0; i < numBandDevices; i++) totalShare += devices[i].share;
+	
+	int rowStart = 0;
+	for (int i = 0; i < numBandDevices; i++)
+	{
+		int remainingDevices = numBandDevices - i - 1;
+		int numRows = (int)(devices[i].share / totalShare * height + 0.5f);
+		numRows = remainingDevices == 0 ? height - rowStart 
+		                                : Clamp(numRows, MinBandRows, height - rowStart - remainingDevices * MinBandRows);
+		devices[i].bandStart = rowStart;
+		devices[i].bandEnd = rowStart + numRows;
+		rowStart += numRows;
+	}
+	return numBandDevices;
+}
+
+static void UploadInstanceRange(uint start, uint end)
+{
+#ifndef HEADLESS
+	// non blocking, g_MeshInstances is not touched until clFinish at the end of the Render
+	cl_bool blocking = CL_FALSE;
+#else
+	// headless frames are not finished at the end of the Render, engine may change instances while gpu renders
+	cl_bool blocking = CL_TRUE;
+#endif
+	// each device has its own copy of the instances
+	for (int i = 0; i < numDevices; i++)
+	{
+		clerr = clEnqueueWriteBuffer(devices[i].queue, devices[i].instanceMem, blocking, 
+			start * sizeof(MeshInstance), (end - start) * sizeof(MeshInstance), 
+			g_MeshInstances + start, 0, nullptr, i == 0 ? ProfileEvent(ProfilerStats_Upload) : nullptr); assert(clerr == 0);
+		clerr = clEnqueueWriteBuffer(devices[i].queue, devices[i].instanceBoundsMem, blocking, 
+			start * sizeof(InstanceBounds), (end - start) * sizeof(InstanceBounds), 
+			instanceBounds + start, 0, nullptr, i == 0 ? ProfileEvent(ProfilerStats_Upload) : nullptr); assert(clerr == 0);
+	}
+}
+
+// walks over dirty bits and uploads each run of changed instances with one copy,
+// runs that are closer than MaxInstanceGap are merged because each write command has its own overhead
+static void UploadDirtyInstances()
+{
+	constexpr uint MaxInstanceGap = 4; // 4 * (64 + 32) byte is cheaper than another write command
+	uint rangeStart = ~0u, rangeEnd = 0u;
+
+	for (int i = 0; i < dirtyInstances.size; ++i)
+	{
+		ulong word = dirtyInstances.bits[i];
+		while (word)
+		{
+			uint index = (i << 6) + (uint)TrailingZeroCount(word);
+			word &= word - 1; // clear lowest set bit
+			
+			if (rangeStart != ~0u && index - rangeEnd > MaxInstanceGap) {
+				UploadInstanceRange(rangeStart, rangeEnd);
+				rangeStart = index;
+			}
+			else if (rangeStart == ~0u) rangeStart = index;
+			rangeEnd = index + 1;
+		}
+	}
+	
+	if (rangeStart != ~0u) UploadInstanceRange(rangeStart, rangeEnd);
+	dirtyInstances.Clear();
 }
 
 void Renderer::ClearAllInstances() { g_NumMeshInstances = 0; }
 
 // comes from ResourceManager.cpp
-extern cl_mem g_TextureHandleMem, g_TextureDataMem, g_MeshTriangleMem, g_BvhMem, g_BvhIndicesMem, g_MaterialsMem;
+extern cl_mem g_TextureHandleMem, g_TextureDataMem, g_MeshTriangleMem, g_BvhMem, g_BvhIndicesMem, g_BvhParentsMem, g_MaterialsMem;
+
+// used by Physics.cpp, kernels and instances belong to the renderer. runs on the primary device,
+// queries see the instances that are uploaded with the last rendered frame
+void EnqueueRayCastKernel(cl_mem queries, cl_mem hits, cl_mem queryOrder, uint numQueries)
+{
+	const RenderDevice& device = devices[0];
+	clerr = clSetKernelArg(rayCastKernel, 0, sizeof(cl_mem), &queries);                 assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 1, sizeof(cl_mem), &hits);                    assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 2, sizeof(uint), &numQueries);                assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 3, sizeof(uint), &g_NumMeshInstances);        assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 4, sizeof(cl_mem), &device.instanceMem);      assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 5, sizeof(cl_mem), &device.instanceBoundsMem); assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 6, sizeof(cl_mem), &g_BvhMem);                assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 7, sizeof(cl_mem), &g_BvhParentsMem);         assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 8, sizeof(cl_mem), &g_BvhIndicesMem);         assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 9, sizeof(cl_mem), &g_MeshTriangleMem);       assert(clerr == 0);
+	clerr = clSetKernelArg(rayCastKernel, 10, sizeof(cl_mem), &queryOrder);             assert(clerr == 0);
+
+	const size_t localSize = 64;
+	size_t globalSize = (numQueries + localSize - 1) / localSize * localSize;
+	clerr = clEnqueueNDRangeKernel(device.queue, rayCastKernel, 1, nullptr, &globalSize, &localSize, 0, nullptr, nullptr); assert(clerr == 0);
+}
+
+#ifdef HEADLESS
+const uint* Renderer::ReadbackFrame()
+{
+	if (numReadFrames == numRenderedFrames) return nullptr;
+	int slot = numReadFrames++ & 1;
+	clWaitForEvents(1, &readbackEvents[slot]);
+	clReleaseEvent(readbackEvents[slot]);
+	readbackEvents[slot] = nullptr;
+	return readbackPixels[slot];
+}
+
+// copies screen to host memory without blocking, previous frame's pixels can be read while this one renders
+static void EnqueueReadback(size_t width, size_t height)
+{
+	int slot = numRenderedFrames++ & 1;
+	// frame in this slot is never read, drop it
+	if (readbackEvents[slot]) { 
+		clReleaseEvent(readbackEvents[slot]); 
+		numReadFrames++; 
+	}
+	size_t origin[3] = { 0, 0, 0 }, region[3] = { width, height, 1 };
+	clerr = clEnqueueReadImage(command_queue, clglScreen, CL_FALSE, origin, region, 0, 0, readbackPixels[slot], 0, nullptr, &readbackEvents[slot]); assert(clerr == 0);
+	clFlush(command_queue);
+}
+#endif
+
+// preferred size if the kernel can run with it on the device, otherwise the largest one it can (register and local memory usage)
+// queried at each launch, so it always matches the current program variant on that device
+static size_t KernelGroupSize(cl_kernel kernel, const RenderDevice& device, size_t preferred)
+{
+	size_t maxGroupSize = preferred;
+	clerr = clGetKernelWorkGroupInfo(kernel, device.id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroupSize, nullptr); assert(clerr == 0);
+	return Min(preferred, maxGroupSize);
+}
+
+// deferred shading in material order, pixels of the band are sorted by material with a counting sort:
+// count -> scan -> scatter, then shading kernel is launched in 1d over the sorted pixels.
+// arguments of the shading kernel that are shared with ShadeDeferred are already set
+static void EnqueueMaterialSortedShading(RenderDevice& device, uint width, cl_event* event)
+{
+	uint firstPixel = (uint)device.bandStart * width;
+	uint numPixels  = (uint)(device.bandEnd - device.bandStart) * width;
+	// kernels loop over the bins with the local size, any group size works. local histograms are sized by the bins
+	const size_t countGroupSize   = KernelGroupSize(countMaterialsKernel, device, MaterialSortGroupSize);
+	const size_t scanGroupSize    = KernelGroupSize(scanMaterialsKernel, device, MaterialSortGroupSize); // single work group
+	const size_t scatterGroupSize = KernelGroupSize(scatterMaterialsKernel, device, MaterialSortGroupSize);
+	size_t countGlobalSize   = (numPixels + countGroupSize - 1) / countGroupSize * countGroupSize;
+	size_t scatterGlobalSize = (numPixels + scatterGroupSize - 1) / scatterGroupSize * scatterGroupSize;
+	const size_t shadeGroupSize = KernelGroupSize(shadeSortedKernel, device, ShadeSortedGroupSize); // register heavy
+	size_t shadeGlobalSize   = (numPixels + shadeGroupSize - 1) / shadeGroupSize * shadeGroupSize;
+	const uint zero = 0;
+
+	clerr = clEnqueueFillBuffer(device.queue, device.materialCountMem, &zero, sizeof(uint), 0, sizeof(uint) * MaterialBins, 0, nullptr, nullptr); assert(clerr == 0);
+
+	clerr = clSetKernelArg(countMaterialsKernel, 0, sizeof(cl_mem), &device.visibilityMem);    assert(clerr == 0);
+	clerr = clSetKernelArg(countMaterialsKernel, 1, sizeof(cl_mem), &g_MeshTriangleMem);       assert(clerr == 0);
+	clerr = clSetKernelArg(countMaterialsKernel, 2, sizeof(cl_mem), &device.instanceMem);      assert(clerr == 0);
+	clerr = clSetKernelArg(countMaterialsKernel, 3, sizeof(uint), &firstPixel);                assert(clerr == 0);
+	clerr = clSetKernelArg(countMaterialsKernel, 4, sizeof(uint), &numPixels);                 assert(clerr == 0);
+	clerr = clSetKernelArg(countMaterialsKernel, 5, sizeof(cl_mem), &device.materialKeyMem);   assert(clerr == 0);
+	clerr = clSetKernelArg(countMaterialsKernel, 6, sizeof(cl_mem), &device.materialCountMem); assert(clerr == 0);
+	clerr = clEnqueueNDRangeKernel(device.queue, countMaterialsKernel, 1, nullptr, &countGlobalSize, &countGroupSize, 0, nullptr, nullptr); assert(clerr == 0);
+
+	clerr = clSetKernelArg(scanMaterialsKernel, 0, sizeof(cl_mem), &device.materialCountMem); assert(clerr == 0);
+	clerr = clEnqueueNDRangeKernel(device.queue, scanMaterialsKernel, 1, nullptr, &scanGroupSize, &scanGroupSize, 0, nullptr, nullptr); assert(clerr == 0);
+
+	clerr = clSetKernelArg(scatterMaterialsKernel, 0, sizeof(cl_mem), &device.materialKeyMem);   assert(clerr == 0);
+	clerr = clSetKernelArg(scatterMaterialsKernel, 1, sizeof(uint), &firstPixel);                assert(clerr == 0);
+	clerr = clSetKernelArg(scatterMaterialsKernel, 2, sizeof(uint), &numPixels);                 assert(clerr == 0);
+	clerr = clSetKernelArg(scatterMaterialsKernel, 3, sizeof(cl_mem), &device.materialCountMem); assert(clerr == 0);
+	clerr = clSetKernelArg(scatterMaterialsKernel, 4, sizeof(cl_mem), &device.sortedPixelMem);   assert(clerr == 0);
+	clerr = clEnqueueNDRangeKernel(device.queue, scatterMaterialsKernel, 1, nullptr, &scatterGlobalSize, &scatterGroupSize, 0, nullptr, nullptr); assert(clerr == 0);
+
+	clerr = clSetKernelArg(shadeSortedKernel, 20, sizeof(cl_mem), &device.sortedPixelMem); assert(clerr == 0);
+	clerr = clSetKernelArg(shadeSortedKernel, 21, sizeof(uint), &numPixels);               assert(clerr == 0);
+	clerr = clSetKernelArg(shadeSortedKernel, 22, sizeof(int), &width);                    assert(clerr == 0);
+	clerr = clEnqueueNDRangeKernel(device.queue, shadeSortedKernel, 1, nullptr, &shadeGlobalSize, &shadeGroupSize, 0, nullptr, event); assert(clerr == 0);
+}
+
+// ---- PICKING ----
+
+void Renderer::RequestPick(int x, int y, int width, int height)
+{
+	if (!renderFeatures.idBuffer) { AXWARNING("picking needs the idBuffer render feature!"); return; }
+	pendingPick = { x, y, Max(width, 1), Max(height, 1) };
+	hasPendingPick = true;
+}
+
+// region is converted to the render resolution, each device reads the rows of its band
+static void EnqueuePickReadback(int renderWidth, int renderHeight, int numBandDevices)
+{
+	if (numPickEvents > 0) return; // previous request is not answered yet, this one waits
+	hasPendingPick = false;
+	
+	float scaleX = (float)renderWidth / camera.projWidth, scaleY = (float)renderHeight / camera.projHeight;
+	// window y is top down, id buffer rows are bottom up
+	int bottom = camera.projHeight - (pendingPick.y + pendingPick.height);
+	int x0 = Clamp((int)(pendingPick.x * scaleX), 0, renderWidth - 1);
+	int y0 = Clamp((int)(bottom * scaleY), 0, renderHeight - 1);
+	int x1 = Clamp((int)ceilf((pendingPick.x + pendingPick.width) * scaleX), x0 + 1, renderWidth);
+	int y1 = Clamp((int)ceilf((bottom + pendingPick.height) * scaleY), y0 + 1, renderHeight);
+	
+	if (pickWidth * pickHeight < (x1 - x0) * (y1 - y0)) {
+		delete[] pickResults;
+		pickResults = new Renderer::PickResult[(x1 - x0) * (y1 - y0)];
+	}
+	pickWidth = x1 - x0, pickHeight = y1 - y0;
+	pickResultsReady = false;
+
+	const size_t pixelSize = sizeof(Renderer::PickResult);
+	for (int i = 0; i < numBandDevices; i++)
+	{
+		int rowStart = Max(y0, devices[i].bandStart), rowEnd = Min(y1, devices[i].bandEnd);
+		if (rowStart >= rowEnd) continue;
+		size_t bufferOrigin[3] = { x0 * pixelSize, (size_t)rowStart, 0 };
+		size_t hostOrigin[3]   = { 0, (size_t)(rowStart - y0), 0 };
+		size_t region[3]       = { pickWidth * pixelSize, (size_t)(rowEnd - rowStart), 1 };
+		clerr = clEnqueueReadBufferRect(devices[i].queue, devices[i].idMem, false, bufferOrigin, hostOrigin, region, 
+		                                renderWidth * pixelSize, 0, pickWidth * pixelSize, 0, pickResults, 0, nullptr, &pickEvents[numPickEvents++]); assert(clerr == 0);
+	}
+}
+
+const Renderer::PickResult* Renderer::GetPickResults(int* width, int* height)
+{
+	for (int i = 0; i < numPickEvents; i++)
+	{
+		cl_int status = CL_QUEUED;
+		clGetEventInfo(pickEvents[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+		if (status > CL_COMPLETE) return nullptr;
+	}
+	if (numPickEvents > 0) {
+		for (int i = 0; i < numPickEvents; i++) clReleaseEvent(pickEvents[i]);
+		numPickEvents = 0;
+		pickResultsReady = true;
+	}
+	if (!pickResultsReady) return nullptr;
+	pickResultsReady = false; // each result is returned once
+	*width = pickWidth, *height = pickHeight;
+	return pickResults;
+}
 
 unsigned Renderer::Render(float sunAngle)
 {
+#ifdef HEADLESS
+	// we don't clFinish at the end of the headless frames, wait for previous frame here 
+	// so its timings are ready and its resources can be reused
+	cl_event previousFrame = readbackEvents[(numRenderedFrames - 1) & 1];
+	if (numRenderedFrames > 0 && previousFrame) clWaitForEvents(1, &previousFrame);
+#endif
 	camera.Update();
 	float time = (float)Window::GetTime();
+	SwapReloadedKernels();
+	UpdateRenderScale(CollectProfileEvents());
+	BalanceDevices();
+	UpdateKernelTuning();
 
 	if (Window::IsFocused()) // && camera.wasPressing 
 	{
+		bool instancesChanged = shouldUpdateInstances;
 		if (shouldUpdateInstances)
 		{
-			clEnqueueWriteBuffer(command_queue, instanceMem
-			  , true, MinUpdatedInstanceIndex * sizeof(MeshInstance)
-			  , (MaxUpdatedInstanceIndex - MinUpdatedInstanceIndex) * sizeof(MeshInstance)
-			  , g_MeshInstances + MinUpdatedInstanceIndex, 0, 0, 0);
-			MinUpdatedInstanceIndex = 0xFFFFu; MaxUpdatedInstanceIndex = 0x0u;
+			UploadDirtyInstances();
 			shouldUpdateInstances = false;
 		}
 
 		if (hasRemovedInstances) { /*todo*/ }
+		// features may be turned on or off since last frame
+		UpdateFeatureBuffers();
 
 		size_t globalWorkSize[2] = { (size_t)camera.projWidth, (size_t)camera.projHeight};
+		size_t renderWorkSize[2] = { 
+			(size_t)Max((int)(camera.projWidth  * renderScale), 16),
+			(size_t)Max((int)(camera.projHeight * renderScale), 16)
+		};
+		// checkerboard needs last frame's pixels, post processing would overwrite them in the screen texture
+		bool useCheckerboard = Renderer::IsCheckerboardActive();
+		int tracedParity = checkerboardFrame++ & 1;
+		bool upsample = renderWorkSize[0] != globalWorkSize[0] || renderWorkSize[1] != globalWorkSize[1] || useCheckerboard;
+		// when we are at full resolution, trace directly to the screen texture
+		cl_mem renderTarget = upsample ? scaledScreen : clglScreen;
+
+		// samples are accumulated until the camera, the scene or the resolution changes
+		bool useAdaptiveSampling = adaptiveSampling && !deferredShading && !useCheckerboard;
+		AccumulationState state = { camera.view, camera.projection, sunAngle, { (int)renderWorkSize[0], (int)renderWorkSize[1] } };
+		bool accumulationValid = !instancesChanged && state.sunAngle == accumulationState.sunAngle &&
+		                         memcmp(&state.view, &accumulationState.view, sizeof(Matrix4) * 2) == 0 &&
+		                         state.resolution[0] == accumulationState.resolution[0] && state.resolution[1] == accumulationState.resolution[1];
+		if (!useAdaptiveSampling || !accumulationValid) adaptiveSampleIndex = 0;
+		accumulationState = state;
 
 		struct TraceArgs {
 			Vector3f cameraPosition;
 			float time;
 			uint numMeshes;
 			float sunAngle;
+			float pixelSpreadAngle;
 		} trace_args = { camera.position, time, g_NumMeshInstances, sunAngle };
+		// angle of the ray cone that covers one pixel, used for texture mip selection
+		trace_args.pixelSpreadAngle = ATan(2.0f * Tan(camera.verticalFOV * DegToRad * 0.5f) / (float)renderWorkSize[1]);
 
 		cl_int clerr; 
-		cl_event event, fxaaWait;
-
-		// prepare ray generation kernel
-		clerr = clSetKernelArg(rayGenKernel, 0, sizeof(cl_mem), &rayMem);                    assert(clerr == 0);
-		clerr = clSetKernelArg(rayGenKernel, 1, sizeof(Matrix4), &camera.inverseView);       assert(clerr == 0);
-		clerr = clSetKernelArg(rayGenKernel, 2, sizeof(Matrix4), &camera.inverseProjection); assert(clerr == 0);
-		// execute ray generation
-		clerr = clEnqueueNDRangeKernel(command_queue, rayGenKernel, 2, nullptr, globalWorkSize, 0, 0, 0, &event); assert(clerr == 0);
+		int numBandDevices = AssignBands((int)renderWorkSize[1]);
+
+		// last frame's shading can be reused if it is rendered with reprojection at the same resolution
+		bool useHistory = deferredShading && temporalReprojection && hasHistory &&
+		                  lastFrameCamera.resolution[0] == (int)renderWorkSize[0] && lastFrameCamera.resolution[1] == (int)renderWorkSize[1];
+
+		// origins of the sorted rays are binned in the bounds of the scene
+		InstanceBounds sceneBounds = { _mm_set1_ps(0.0f), _mm_set1_ps(0.0f) };
+		if (deferredShading && raySorting && g_NumMeshInstances > 0)
+		{
+			sceneBounds = instanceBounds[0];
+			for (uint i = 1; i < g_NumMeshInstances; i++)
+				sceneBounds.min = _mm_min_ps(sceneBounds.min, instanceBounds[i].min),
+				sceneBounds.max = _mm_max_ps(sceneBounds.max, instanceBounds[i].max);
+		}
+		
+		// scene data may be written on the primary queue since last frame, secondary devices wait for it
+		cl_event uploadMarker = nullptr;
+		if (numBandDevices > 1) { clerr = clEnqueueMarkerWithWaitList(command_queue, 0, nullptr, &uploadMarker); assert(clerr == 0); }
+#ifndef HEADLESS
 		// prepare Rendering
-		clerr = clEnqueueAcquireGLObjects(command_queue, 1, &clglScreen, 0, 0, 0); assert(clerr == 0);
-
-		clerr = clSetKernelArg(traceKernel, 0, sizeof(cl_mem), &clglScreen);         assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 1, sizeof(cl_mem), &g_TextureHandleMem); assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 2, sizeof(cl_mem), &g_TextureDataMem);   assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 3, sizeof(cl_mem), &g_BvhIndicesMem);    assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 4, sizeof(cl_mem), &g_MeshTriangleMem);  assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 5, sizeof(cl_mem), &rayMem);             assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 6, sizeof(TraceArgs), &trace_args);      assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 7, sizeof(cl_mem), &g_BvhMem);           assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 8, sizeof(cl_mem), &g_MaterialsMem);     assert(clerr == 0);
-		clerr = clSetKernelArg(traceKernel, 9, sizeof(cl_mem), &instanceMem);        assert(clerr == 0);
-
-		// execute rendering
-		clerr = clEnqueueNDRangeKernel(command_queue, traceKernel, 2, nullptr, globalWorkSize, 0, 1, &event, &fxaaWait);  assert(clerr == 0);
+		clerr = clEnqueueAcquireGLObjects(command_queue, 1, &clglScreen, 0, 0, ProfileEvent(ProfilerStats_GLAcquire)); assert(clerr == 0);
+#endif
+		int resolution[2] = { (int)renderWorkSize[0], (int)renderWorkSize[1] };
+		
+		// secondary devices first, so they can start while we are enqueueing the primary device's work
+		for (int i = numBandDevices - 1; i >= 0; i--)
+		{
+			RenderDevice& device = devices[i];
+			size_t bandOffset[2] = { 0, (size_t)device.bandStart };
+			size_t bandSize[2] = { renderWorkSize[0], (size_t)(device.bandEnd - device.bandStart) };
+			cl_mem bandTarget = i == 0 ? renderTarget : device.bandScreen;
+			cl_uint numWaitEvents = i == 0 ? 0 : 1;
+
+			// prepare ray generation kernel
+			clerr = clSetKernelArg(rayGenKernel, 0, sizeof(cl_mem), &device.rayMem);             assert(clerr == 0);
+			clerr = clSetKernelArg(rayGenKernel, 1, sizeof(Matrix4), &camera.inverseView);       assert(clerr == 0);
+			clerr = clSetKernelArg(rayGenKernel, 2, sizeof(Matrix4), &camera.inverseProjection); assert(clerr == 0);
+			clerr = clSetKernelArg(rayGenKernel, 3, sizeof(int) * 2, resolution);                assert(clerr == 0);
+			// execute ray generation
+			clerr = EnqueueTunedKernel(device, TunedKernel_RayGen, rayGenKernel, bandOffset, bandSize, numWaitEvents, i == 0 ? nullptr : &uploadMarker, i == 0 ? ProfileEvent(ProfilerStats_RayGen) : nullptr); assert(clerr == 0);
+
+			if (deferredShading)
+			{
+				clerr = clSetKernelArg(visibilityKernel, 0, sizeof(cl_mem), &device.rayMem);            assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 1, sizeof(TraceArgs), &trace_args);            assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 2, sizeof(cl_mem), &g_BvhIndicesMem);          assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 3, sizeof(cl_mem), &g_MeshTriangleMem);        assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 4, sizeof(cl_mem), &g_BvhMem);                 assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 5, sizeof(cl_mem), &device.instanceMem);       assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 6, sizeof(cl_mem), &device.instanceBoundsMem); assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 7, sizeof(cl_mem), &g_BvhParentsMem);          assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 8, sizeof(cl_mem), &device.visibilityMem);     assert(clerr == 0);
+				clerr = clSetKernelArg(visibilityKernel, 9, sizeof(cl_mem), &device.idMem);             assert(clerr == 0);
+				clerr = EnqueueTunedKernel(device, TunedKernel_Visibility, visibilityKernel, bandOffset, bandSize, 0, nullptr, &device.traceEvent); assert(clerr == 0);
+
+				cl_kernel shade = materialSorting ? shadeSortedKernel : shadeKernel; // both have the same first 13 args
+				clerr = clSetKernelArg(shade, 0, sizeof(cl_mem), &bandTarget);               assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 1, sizeof(cl_mem), &g_TextureHandleMem);       assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 2, sizeof(cl_mem), &g_TextureDataMem);         assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 3, sizeof(cl_mem), &g_BvhIndicesMem);          assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 4, sizeof(cl_mem), &g_MeshTriangleMem);        assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 5, sizeof(cl_mem), &device.rayMem);            assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 6, sizeof(TraceArgs), &trace_args);            assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 7, sizeof(cl_mem), &g_BvhMem);                 assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 8, sizeof(cl_mem), &g_MaterialsMem);           assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 9, sizeof(cl_mem), &device.instanceMem);       assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 10, sizeof(cl_mem), &device.instanceBoundsMem); assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 11, sizeof(cl_mem), &g_BvhParentsMem);         assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 12, sizeof(cl_mem), &device.visibilityMem);    assert(clerr == 0);
+				// paths are saved after the first bounce if the rays are sorted, null buffer otherwise
+				RayBinArgs binArgs = { sceneBounds.min, sceneBounds.max, (uint)device.bandStart * (uint)renderWorkSize[0] };
+				bool sortRays = raySorting && renderFeatures.maxBounces > 1;
+				clerr = clSetKernelArg(shade, 13, sizeof(cl_mem), sortRays ? &device.savedPathMem : nullptr); assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 14, sizeof(cl_mem), &device.rayKeyMem[0]);      assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 15, sizeof(cl_mem), &device.rayValueMem[0]);    assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 16, sizeof(RayBinArgs), &binArgs);              assert(clerr == 0);
+				// history of this device is only valid for the rows it rendered last frame
+				ReprojectionArgs reprojection = lastFrameCamera;
+				reprojection.prevBandStart = device.prevBandStart, reprojection.prevBandEnd = device.prevBandEnd;
+				reprojection.frameIndex = reprojectionFrame;
+				reprojection.enabled = useHistory;
+				cl_mem* newHistory = temporalReprojection ? &device.historyMem[reprojectionFrame & 1] : nullptr;
+				clerr = clSetKernelArg(shade, 17, sizeof(ReprojectionArgs), &reprojection);              assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 18, sizeof(cl_mem), &device.historyMem[~reprojectionFrame & 1]); assert(clerr == 0);
+				clerr = clSetKernelArg(shade, 19, sizeof(cl_mem), newHistory);                           assert(clerr == 0);
+				cl_event* shadeEvent = sortRays ? nullptr : &device.shadeEvent;
+				if (materialSorting) EnqueueMaterialSortedShading(device, (uint)renderWorkSize[0], shadeEvent);
+				else { clerr = EnqueueTunedKernel(device, TunedKernel_Shade, shade, bandOffset, bandSize, 0, nullptr, shadeEvent); assert(clerr == 0); }
+				
+				if (sortRays)
+				{
+					uint numRays = (uint)(bandSize[0] * bandSize[1]);
+					int width = (int)renderWorkSize[0];
+					GPUBVH::SortKeyValues(device.queue, device.rayKeyMem, device.rayValueMem, device.rayHistogramMem, numRays, RayKeyBits);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 0, sizeof(cl_mem), &bandTarget);               assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 1, sizeof(cl_mem), &g_TextureHandleMem);       assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 2, sizeof(cl_mem), &g_TextureDataMem);         assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 3, sizeof(cl_mem), &g_BvhIndicesMem);          assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 4, sizeof(cl_mem), &g_MeshTriangleMem);        assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 5, sizeof(TraceArgs), &trace_args);            assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 6, sizeof(cl_mem), &g_BvhMem);                 assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 7, sizeof(cl_mem), &g_MaterialsMem);           assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 8, sizeof(cl_mem), &device.instanceMem);       assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 9, sizeof(cl_mem), &device.instanceBoundsMem); assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 10, sizeof(cl_mem), &g_BvhParentsMem);         assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 11, sizeof(cl_mem), &device.savedPathMem);     assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 12, sizeof(cl_mem), &device.rayKeyMem[0]);     assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 13, sizeof(cl_mem), &device.rayValueMem[0]);   assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 14, sizeof(uint), &binArgs.firstPixel);        assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 15, sizeof(uint), &numRays);                   assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 16, sizeof(int), &width);                      assert(clerr == 0);
+					clerr = clSetKernelArg(traceSortedPathsKernel, 17, sizeof(cl_mem), newHistory);               assert(clerr == 0);
+					const size_t traceGroupSize = KernelGroupSize(traceSortedPathsKernel, device, ShadeSortedGroupSize);
+					size_t traceGlobalSize = (numRays + traceGroupSize - 1) / traceGroupSize * traceGroupSize;
+					clerr = clEnqueueNDRangeKernel(device.queue, traceSortedPathsKernel, 1, nullptr, &traceGlobalSize, &traceGroupSize, 0, nullptr, &device.shadeEvent); assert(clerr == 0);
+				}
+				if (i > 0) clFlush(device.queue);
+				continue;
+			}
+
+			if (useAdaptiveSampling)
+			{
+				// first frame of the accumulation or band of the device is changed, rows of the band start from zero samples
+				if (adaptiveSampleIndex == 0 || device.accumulationBandStart != device.bandStart || device.accumulationBandEnd != device.bandEnd)
+				{
+					float zero = 0.0f;
+					size_t rowSize = AccumulatedPixelSize * renderWorkSize[0];
+					clerr = clEnqueueFillBuffer(device.queue, device.accumulationMem, &zero, sizeof(float), rowSize * device.bandStart, rowSize * bandSize[1], 0, nullptr, nullptr); assert(clerr == 0);
+					device.accumulationBandStart = device.bandStart, device.accumulationBandEnd = device.bandEnd;
+				}
+				uint zeroCount = 0;
+				clerr = clEnqueueFillBuffer(device.queue, device.sampleTileCountMem, &zeroCount, sizeof(uint), 0, sizeof(uint), 0, nullptr, nullptr); assert(clerr == 0);
+
+				int band[4] = { (int)renderWorkSize[0], (int)renderWorkSize[1], device.bandStart, device.bandEnd };
+				size_t numTiles[2] = { (bandSize[0] + SampleTileSize - 1) / SampleTileSize, (bandSize[1] + SampleTileSize - 1) / SampleTileSize };
+				size_t tileGlobalSize[2] = { numTiles[0] * SampleTileSize, numTiles[1] * SampleTileSize };
+				size_t tileLocalSize[2] = { SampleTileSize, SampleTileSize };
+				clerr = clSetKernelArg(allocateSamplesKernel, 0, sizeof(cl_mem), &device.accumulationMem);    assert(clerr == 0);
+				clerr = clSetKernelArg(allocateSamplesKernel, 1, sizeof(int) * 4, band);                      assert(clerr == 0);
+				clerr = clSetKernelArg(allocateSamplesKernel, 2, sizeof(float), &adaptiveSamplingThreshold); assert(clerr == 0);
+				clerr = clSetKernelArg(allocateSamplesKernel, 3, sizeof(cl_mem), &device.sampleTileMem);      assert(clerr == 0);
+				clerr = clSetKernelArg(allocateSamplesKernel, 4, sizeof(cl_mem), &device.sampleTileCountMem); assert(clerr == 0);
+				clerr = clEnqueueNDRangeKernel(device.queue, allocateSamplesKernel, 2, bandOffset, tileGlobalSize, tileLocalSize, 0, nullptr, nullptr); assert(clerr == 0);
+
+				clerr = clSetKernelArg(traceAdaptiveKernel, 0, sizeof(cl_mem), &g_TextureHandleMem);       assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 1, sizeof(cl_mem), &g_TextureDataMem);         assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 2, sizeof(cl_mem), &g_BvhIndicesMem);          assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 3, sizeof(cl_mem), &g_MeshTriangleMem);        assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 4, sizeof(TraceArgs), &trace_args);            assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 5, sizeof(cl_mem), &g_BvhMem);                 assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 6, sizeof(cl_mem), &g_MaterialsMem);           assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 7, sizeof(cl_mem), &device.instanceMem);       assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 8, sizeof(cl_mem), &device.instanceBoundsMem); assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 9, sizeof(cl_mem), &g_BvhParentsMem);          assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 10, sizeof(cl_mem), &device.idMem);            assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 11, sizeof(cl_mem), &device.accumulationMem);  assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 12, sizeof(cl_mem), &device.sampleTileMem);    assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 13, sizeof(cl_mem), &device.sampleTileCountMem); assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 14, sizeof(Matrix4), &camera.inverseView);       assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 15, sizeof(Matrix4), &camera.inverseProjection); assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 16, sizeof(int) * 4, band);                    assert(clerr == 0);
+				clerr = clSetKernelArg(traceAdaptiveKernel, 17, sizeof(uint), &adaptiveSampleIndex);       assert(clerr == 0);
+				// one group for each tile, groups beyond the number of listed tiles return immediately
+				size_t traceGlobalSize = numTiles[0] * numTiles[1] * SampleTileSize * SampleTileSize, traceLocalSize = SampleTileSize * SampleTileSize;
+				clerr = clEnqueueNDRangeKernel(device.queue, traceAdaptiveKernel, 1, nullptr, &traceGlobalSize, &traceLocalSize, 0, nullptr, &device.traceEvent); assert(clerr == 0);
+
+				// converged pixels are resolved too, render target doesn't keep last frame (post processing writes on it).
+				// resolve is the shading pass of this mode, band copies and balancing wait for it
+				int width = (int)renderWorkSize[0];
+				clerr = clSetKernelArg(resolveAccumulationKernel, 0, sizeof(cl_mem), &bandTarget);             assert(clerr == 0);
+				clerr = clSetKernelArg(resolveAccumulationKernel, 1, sizeof(cl_mem), &device.accumulationMem); assert(clerr == 0);
+				clerr = clSetKernelArg(resolveAccumulationKernel, 2, sizeof(int), &width);                     assert(clerr == 0);
+				clerr = clEnqueueNDRangeKernel(device.queue, resolveAccumulationKernel, 2, bandOffset, bandSize, nullptr, 0, nullptr, &device.shadeEvent); assert(clerr == 0);
+				if (i > 0) clFlush(device.queue);
+				continue;
+			}
+
+			clerr = clSetKernelArg(traceKernel, 0, sizeof(cl_mem), &bandTarget);         assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 1, sizeof(cl_mem), &g_TextureHandleMem); assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 2, sizeof(cl_mem), &g_TextureDataMem);   assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 3, sizeof(cl_mem), &g_BvhIndicesMem);    assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 4, sizeof(cl_mem), &g_MeshTriangleMem);  assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 5, sizeof(cl_mem), &device.rayMem);      assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 6, sizeof(TraceArgs), &trace_args);      assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 7, sizeof(cl_mem), &g_BvhMem);           assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 8, sizeof(cl_mem), &g_MaterialsMem);     assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 9, sizeof(cl_mem), &device.instanceMem); assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 10, sizeof(cl_mem), &device.instanceBoundsMem); assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 11, sizeof(cl_mem), &g_BvhParentsMem);     assert(clerr == 0);
+			clerr = clSetKernelArg(traceKernel, 12, sizeof(cl_mem), &device.idMem);        assert(clerr == 0);
+			int checkerboardArgs[4] = { (int)useCheckerboard, tracedParity, (int)renderWorkSize[0], 0 };
+			clerr = clSetKernelArg(traceKernel, 13, sizeof(int) * 4, checkerboardArgs);    assert(clerr == 0);
+			// checkerboard traces one pixel of each horizontal pair
+			size_t traceSize[2] = { useCheckerboard ? (bandSize[0] + 1) / 2 : bandSize[0], bandSize[1] };
+
+			// execute rendering, command queue is in order so we don't need to wait for ray generation event
+			clerr = EnqueueTunedKernel(device, TunedKernel_Trace, traceKernel, bandOffset, traceSize, 0, nullptr, &device.traceEvent);  assert(clerr == 0);
+			if (i > 0) clFlush(device.queue);
+		}
+		numActiveDevices = numBandDevices;
+		if (uploadMarker) clReleaseEvent(uploadMarker);
+		if (useAdaptiveSampling) adaptiveSampleIndex++;
+
+		// this frame becomes the history of the next one
+		hasHistory = deferredShading && temporalReprojection;
+		if (hasHistory)
+		{
+			lastFrameCamera.prevView = camera.view;
+			lastFrameCamera.prevProjection = camera.projection;
+			lastFrameCamera.prevCameraPos = _mm_setr_ps(camera.position.x, camera.position.y, camera.position.z, 0.0f);
+			lastFrameCamera.resolution[0] = (int)renderWorkSize[0], lastFrameCamera.resolution[1] = (int)renderWorkSize[1];
+			for (int i = 0; i < numDevices; i++)
+			{
+				devices[i].prevBandStart = i < numBandDevices ? devices[i].bandStart : 0;
+				devices[i].prevBandEnd   = i < numBandDevices ? devices[i].bandEnd : 0;
+			}
+			reprojectionFrame++;
+		}
+		if (hasPendingPick) EnqueuePickReadback((int)renderWorkSize[0], (int)renderWorkSize[1], numBandDevices);
+		
+		if (cl_event* traceProfile = ProfileEvent(ProfilerStats_Trace)) {
+			*traceProfile = devices[0].traceEvent;
+			clRetainEvent(*traceProfile);
+		}
+		cl_event* shadeProfile = devices[0].shadeEvent ? ProfileEvent(ProfilerStats_Shade) : nullptr;
+		if (shadeProfile) {
+			*shadeProfile = devices[0].shadeEvent;
+			clRetainEvent(*shadeProfile);
+		}
+
+		// copy bands of the secondary devices to the render target
+		for (int i = 1; i < numBandDevices; i++)
+		{
+			size_t origin[3] = { 0, (size_t)devices[i].bandStart, 0 };
+			size_t region[3] = { renderWorkSize[0], (size_t)(devices[i].bandEnd - devices[i].bandStart), 1 };
+			// band is finished with the shading pass if it has one
+			cl_event* bandEvent = devices[i].shadeEvent ? &devices[i].shadeEvent : &devices[i].traceEvent;
+			if (!useCheckerboard) {
+				clerr = clEnqueueCopyImage(command_queue, devices[i].bandScreen, renderTarget, origin, origin, region, 1, bandEvent, nullptr); assert(clerr == 0);
+				continue;
+			}
+			// untraced half of the band image is older than the reconstructed pixels of the render target (or garbage 
+			// if the band has moved), only traced pixels are copied so reconstruction reads last frame's pixels as history
+			int width = (int)renderWorkSize[0];
+			size_t copySize[2] = { (renderWorkSize[0] + 1) / 2, region[1] };
+			clerr = clSetKernelArg(copyBandKernel, 0, sizeof(cl_mem), &devices[i].bandScreen); assert(clerr == 0);
+			clerr = clSetKernelArg(copyBandKernel, 1, sizeof(cl_mem), &renderTarget);          assert(clerr == 0);
+			clerr = clSetKernelArg(copyBandKernel, 2, sizeof(int), &tracedParity);             assert(clerr == 0);
+			clerr = clSetKernelArg(copyBandKernel, 3, sizeof(int), &width);                    assert(clerr == 0);
+			clerr = clEnqueueNDRangeKernel(command_queue, copyBandKernel, 2, origin, copySize, nullptr, 1, bandEvent, nullptr); assert(clerr == 0);
+		}
+
+		// fill the pixels that are not traced this frame, after the bands so the neighbours at the band edges are there
+		if (useCheckerboard)
+		{
+			int missingParity = tracedParity ^ 1;
+			size_t reconstructSize[2] = { (renderWorkSize[0] + 1) / 2, renderWorkSize[1] };
+			clerr = clSetKernelArg(reconstructKernel, 0, sizeof(cl_mem), &renderTarget);       assert(clerr == 0);
+			clerr = clSetKernelArg(reconstructKernel, 1, sizeof(int), &missingParity);         assert(clerr == 0);
+			clerr = clSetKernelArg(reconstructKernel, 2, sizeof(float), &checkerboardQuality); assert(clerr == 0);
+			clerr = clEnqueueNDRangeKernel(command_queue, reconstructKernel, 2, nullptr, reconstructSize, nullptr, 0, nullptr, ProfileEvent(ProfilerStats_Reconstruct)); assert(clerr == 0);
+		}
+		
+		if (upsample)
+		{
+			int sourceSize[2] = { (int)renderWorkSize[0], (int)renderWorkSize[1] };
+			clerr = clSetKernelArg(upsampleKernel, 0, sizeof(cl_mem), &scaledScreen); assert(clerr == 0);
+			clerr = clSetKernelArg(upsampleKernel, 1, sizeof(cl_mem), &clglScreen);   assert(clerr == 0);
+			clerr = clSetKernelArg(upsampleKernel, 2, sizeof(int) * 2, sourceSize);   assert(clerr == 0);
+			clerr = EnqueueTunedKernel(devices[0], TunedKernel_Upsample, upsampleKernel, nullptr, globalWorkSize, 0, nullptr, ProfileEvent(ProfilerStats_Upsample)); assert(clerr == 0);
+		}
 		
 		//prepare post processing
 		clerr = clSetKernelArg(PostProcessKernel, 0, sizeof(cl_mem), &clglScreen); assert(clerr == 0);
 		clerr = clSetKernelArg(PostProcessKernel, 1, sizeof(float), &trace_args.time); assert(clerr == 0);
 		// execute post processing
-		clerr = clEnqueueNDRangeKernel(command_queue, PostProcessKernel, 2, nullptr, globalWorkSize, 0, 1, &fxaaWait, 0); assert(clerr == 0);
+		clerr = EnqueueTunedKernel(devices[0], TunedKernel_PostProcess, PostProcessKernel, nullptr, globalWorkSize, 0, nullptr, ProfileEvent(ProfilerStats_PostProcess)); assert(clerr == 0);
 
-		clerr = clEnqueueReleaseGLObjects(command_queue, 1, &clglScreen, 0, 0, 0); assert(clerr == 0);
+#ifndef HEADLESS
+		clerr = clEnqueueReleaseGLObjects(command_queue, 1, &clglScreen, 0, 0, ProfileEvent(ProfilerStats_GLRelease)); assert(clerr == 0);
 
 		clFinish(command_queue);
+#else
+		EnqueueReadback(globalWorkSize[0], globalWorkSize[1]);
+#endif
 	}
 	// glDrawArrays(GL_TRIANGLES, 0, 3);
 	double ms = (Window::GetTime() - time) * 1000.0;
-	if (time > 5.0f && ms > 80) { AXERROR("GPU Botleneck! %f ms", ms); exit(0); }
 	Engine_UpdateProfilerStats(ProfilerStats_Render, (float)ms);
 
+#ifndef HEADLESS
 	return screenTexture;
+#else
+	return 0u;
+#endif
 }
 
 void Renderer::Terminate()
 {
+	stopKernelWatcher = true;
+	if (kernelWatcher.joinable()) kernelWatcher.join();
+	if (hasPendingVariant) {
+		ReleaseProgramVariant(pendingVariant);
+		delete[] pendingSource;
+	}
+	if (pendingBuilderProgram) clReleaseProgram(pendingBuilderProgram);
+	if (localSizeCacheDirty) SaveLocalSizeCache(); // keeps the kernels that finished tuning before exit
+
+#ifndef HEADLESS
+	CollectProfileEvents(); // releases remaining events
 	glDeleteVertexArrays(1, &VAO);
 	glDeleteProgram(shaderProgram);
 	glDeleteTextures(1, &screenTexture);
+#else
+	clFinish(command_queue);
+	CollectProfileEvents(); // releases remaining events
+	for (int i = 0; i < 2; i++) {
+		if (readbackEvents[i]) clReleaseEvent(readbackEvents[i]);
+		delete[] readbackPixels[i];
+	}
+#endif
+	for (int i = 0; i < numPickEvents; i++) clWaitForEvents(1, &pickEvents[i]), clReleaseEvent(pickEvents[i]);
+	delete[] pickResults;
+	Physics::Terminate();
+	GPUBVH::Terminate();
 	ResourceManager::Finalize();
 
 	// cleanup - release OpenCL resources
 	clReleaseMemObject(clglScreen);
-	clReleaseMemObject(rayMem);
-	clReleaseMemObject(instanceMem);
-	clReleaseProgram(program);
-	clReleaseCommandQueue(command_queue);
-	clReleaseKernel(rayGenKernel);
-	clReleaseKernel(traceKernel);
-	clReleaseKernel(PostProcessKernel);
+	clReleaseMemObject(scaledScreen);
+	ReleaseDeviceBuffers();
+	for (int i = 0; i < numDevices; i++)
+	{
+		if (devices[i].traceEvent) clReleaseEvent(devices[i].traceEvent);
+		if (devices[i].shadeEvent) clReleaseEvent(devices[i].shadeEvent);
+		for (int k = 0; k < Num_TunedKernels; k++)
+			if (devices[i].tunings[k].event) clReleaseEvent(devices[i].tunings[k].event);
+		clReleaseMemObject(devices[i].instanceMem);
+		clReleaseMemObject(devices[i].instanceBoundsMem);
+		clReleaseCommandQueue(devices[i].queue);
+	}
+	for (int i = 0; i < numProgramVariants; i++) ReleaseProgramVariant(programVariants[i]);
+	delete[] kernelSource;
 	clReleaseContext(context);
 }
\ No newline at end of file
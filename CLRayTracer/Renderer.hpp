@@ -2,12 +2,34 @@
 #include "ResourceManager.hpp"
 #include "Math/Camera.hpp"
 
-// internal struct do not use
-struct MeshInstance { 
-	Matrix4 inverseTransform;
+// internal struct do not use, one cache line.
+// inverse transform is affine so it is stored as 3 columns of the matrix, translation is in w
+AX_ALIGNED(64) struct MeshInstance { 
+	__m128 inverseTransform[3];
 	ushort meshIndex;  
 	ushort materialStart; // each submesh can have material
+	uint mask;            // ray queries test the instance if (mask & query mask) != 0
+	uint padding[2];
+
+	void SetTransform(const Matrix4& transform)
+	{
+		Matrix4 inverse = Matrix4::Transpose(Matrix4::InverseTransform(transform));
+		inverseTransform[0] = inverse.r[0];
+		inverseTransform[1] = inverse.r[1];
+		inverseTransform[2] = inverse.r[2];
+	}
+
+	Matrix4 GetInverseTransform() const
+	{
+		Matrix4 inverse;
+		inverse.r[0] = inverseTransform[0];
+		inverse.r[1] = inverseTransform[1];
+		inverse.r[2] = inverseTransform[2];
+		inverse.r[3] = g_XMIdentityR3;
+		return Matrix4::Transpose(inverse);
+	}
 };
+static_assert(sizeof(MeshInstance) == 64, "gpu reads instances as 64 byte records");
 
 typedef uint MeshInstanceHandle;
 
@@ -35,12 +57,105 @@ namespace Renderer
 	void RemoveMeshInstance(MeshInstanceHandle  handle);
 	void ClearAllInstances();
 
-	// rgb8 only
-	void CreateGLTexture(uint& texture, int width, int height, void* data = nullptr);
+	// data is rgb8 or rgba8 depending on numChannels
+	void CreateGLTexture(uint& texture, int width, int height, void* data = nullptr, int numChannels = 3);
 
 	void SetMeshInstanceMaterial(MeshInstanceHandle meshHandle, MaterialHandle materialHandle);
+	// physics ray queries use this to filter the instances, all bits are set by default
+	void SetMeshInstanceMask(MeshInstanceHandle meshHandle, uint mask);
 	
 	void SetMeshPosition(MeshInstanceHandle handle, float3 position);
 	void SetMeshMatrix(MeshInstanceHandle handle, const Matrix4& matrix);
 	const Camera& GetCamera();
+
+	// dynamic resolution: when gpu frame time exceeds the target, 
+	// renderer traces at lower resolution and upsamples to the screen
+	void  SetTargetFrameTime(float ms);
+	float GetTargetFrameTime();
+	void  SetDynamicResolution(bool enabled);
+	bool  IsDynamicResolutionEnabled();
+	float GetRenderScale(); // 1.0 is full resolution
+
+	// checkerboard rendering: half of the pixels are traced each frame in alternating pattern, other half is reconstructed
+	// from the neighbours and the last frame. quality is the weight of the last frame, 0 uses only the neighbours.
+	// dynamic resolution turns it on automatically when the minimum render scale is still over the budget.
+	// deferred shading doesn't support it
+	void  SetCheckerboard(bool enabled); // forces it on whatever the load is, off leaves only the automatic mode
+	bool  IsCheckerboardEnabled();
+	bool  IsCheckerboardActive();        // forced or automatic
+	void  SetCheckerboardQuality(float quality);
+	float GetCheckerboardQuality();
+
+	// adaptive sampling: while the camera and the scene are still, jittered samples are accumulated over the frames.
+	// noise of each 8x8 tile is estimated from the variance of its samples, only the tiles above the threshold are traced again
+	// so converged sky and flat walls get no more rays. threshold is the standard error of the mean relative to the luma.
+	// deferred shading and checkerboard doesn't support it
+	void  SetAdaptiveSampling(bool enabled);
+	bool  IsAdaptiveSamplingEnabled();
+	void  SetAdaptiveSamplingThreshold(float threshold);
+	float GetAdaptiveSamplingThreshold();
+
+	// split frame rendering: each device traces a horizontal band of the frame,
+	// band sizes are balanced from last frame's trace times of the devices
+	void  SetMultiDevice(bool enabled);
+	bool  IsMultiDeviceEnabled();
+	int   GetNumDevices();
+	float GetDeviceShare(int device); // portion of the frame rows
+
+	// deferred shading: first pass traces only the primary visibility (instance, triangle, barycentrics),
+	// second pass rebuilds the attributes, shades and traces the secondary bounces. 
+	// traversal isn't stalled by divergent shading and both passes have their own local sizes
+	void  SetDeferredShading(bool enabled);
+	bool  IsDeferredShadingEnabled();
+
+	// deferred shading only: hits are sorted by material before the shading pass, 
+	// so work items of a group mostly run the same material and read the same textures
+	void  SetMaterialSorting(bool enabled);
+	bool  IsMaterialSortingEnabled();
+
+	// deferred shading only: paths are saved after the first bounce and reflected rays are sorted by direction and origin cell,
+	// secondary bounces are traced in that order so neighbour work items walk the same parts of the bvh
+	void  SetRaySorting(bool enabled);
+	bool  IsRaySortingEnabled();
+
+	// deferred shading only: hit points are projected to the last frame, shading is reused where the same triangle
+	// was visible at the same distance. disocclusions and a rotating 1/16 of the pixels are shaded each frame
+	void  SetTemporalReprojection(bool enabled);
+	bool  IsTemporalReprojectionEnabled();
+
+	// kernels are compiled with the features as defines, so features that are off cost nothing while tracing.
+	// each feature set is compiled once and kept, first switch to a new set blocks until it compiles
+	struct RenderFeatures
+	{
+		int  maxBounces;    // 1 is primary rays only
+		bool shadows;       // sun shadows of the first hit
+		bool specular;      // specular highlights and reflection bounces
+		bool nearestFilter; // nearest texture sampling instead of bilinear
+		bool idBuffer;      // primary hit ids for picking
+	};
+	void SetFeatures(const RenderFeatures& features);
+	const RenderFeatures& GetFeatures();
+
+	// picking with the id buffer of the primary rays, needs the idBuffer feature
+	struct PickResult 
+	{
+		uint  instance; // NoPickInstance if nothing is hit
+		uint  triangle;
+		float depth;    // distance from the camera
+	};
+	constexpr uint NoPickInstance = ~0u;
+
+	// window coordinates, region is read back after the next frame's trace without blocking
+	void RequestPick(int x, int y, int width = 1, int height = 1);
+	// results of the last answered request, row major at render resolution (rows are bottom up).
+	// nullptr until it is ready, each result is returned once. while checkerboard is active half of the pixels
+	// are not traced each frame and keep their ids, so results can be one frame stale
+	const PickResult* GetPickResults(int* width, int* height);
+
+#ifdef HEADLESS
+	// headless builds render to an offscreen image that is read back without blocking.
+	// returns rgba8 pixels of the oldest frame that is not read yet (waits for it if necessary) or nullptr,
+	// pixels are valid until the next Render call
+	const uint* ReadbackFrame();
+#endif
 }
@@ -18,6 +18,7 @@
 #include <emmintrin.h>
 #include <filesystem>
 #include "CLHelper.hpp"
+#include "GPUBVH.hpp"
 #include "Editor/Editor.hpp"
 
 // we are pre allocating gpu memory at the beginning and we are pushing data from cpu 
@@ -30,31 +31,32 @@
 
 // 50mb for textures
 constexpr size_t MAX_TEXTURE_MEMORY = 1.049e+7 * 10;
+// textures are stored as rgba8, one uint per texel
+constexpr size_t MAX_TEXELS = MAX_TEXTURE_MEMORY * 2 / sizeof(uint);
 // max num of tris for each gpu push
 constexpr size_t MAX_TRIANGLES = 1'200'000;
 constexpr size_t MAX_BVHNODES = MAX_TRIANGLES;
 constexpr size_t MAX_BVHMEMORY = MAX_BVHNODES * sizeof(BVHNode);
 constexpr size_t MAX_MESH_MEMORY = MAX_TRIANGLES * sizeof(Tri);
 constexpr size_t MaxTextures = 32;
-constexpr size_t MaxMaterials = 256;
+constexpr size_t MaxMaterials = 256; // material sort has one bin for each, see MATERIAL_BINS in kernel_main.cl
 constexpr size_t MaxMeshes = 128;
 
 // Todo:
 //      map unmap texture at real time we can create effects with it
-//      add ability to deform meshes with kernels at runtime
 //      add save load, we can use same arena allocators for each scene
-//      add Physics namespace and ray cast on gpu, send ray array and return hit info array execute kernel
 
 // globals
-RGB8* g_TexturePixels = nullptr;
+uint* g_TexturePixels = nullptr; // rgba8
 BVHNode* g_BVHNodes = nullptr;
 Tri* g_Triangles = nullptr;    // for each scene we will use same memory
 
 Material* g_Materials = nullptr;
 Texture* g_Textures = nullptr;
 uint* g_BVHIndices = nullptr;
+uint* g_BVHParents = nullptr;
 
-cl_mem g_MeshTriangleMem, g_BvhMem, g_BvhIndicesMem, g_MaterialsMem;
+cl_mem g_MeshTriangleMem, g_BvhMem, g_BvhIndicesMem, g_BvhParentsMem, g_MaterialsMem;
 cl_mem g_TextureHandleMem, g_TextureDataMem;
 
 namespace // private
@@ -79,7 +81,7 @@ namespace // private
 
 	size_t numTriangles = 0; 
 
-	size_t lastTextureOffset = 0; // GPU offset
+	size_t lastTextureOffset = 0; // GPU offset, in texels
 	size_t lastTriangleCount = 0; // GPU offset
 	size_t lastBVHIndex      = 0; // GPU offset
 
@@ -87,6 +89,14 @@ namespace // private
 	int numMeshes     = 0;
 	int numMaterials  = 0;
 	int lastMeshIndex = 0;
+
+	// gpu meshes use the second half of the triangle and bvh buffers
+	size_t lastGPUTriangle = MAX_TRIANGLES;
+	size_t lastGPUNode     = MAX_BVHNODES;
+	int numGPUMeshes = 0;
+	bool gpuMeshes[MaxMeshes];
+	uint gpuMeshNodeStarts[MaxMeshes];
+	BVHNode gpuMeshRoots[MaxMeshes]; // read back from the gpu
 }
 
 namespace ResourceManager // public functions
@@ -96,9 +106,11 @@ namespace ResourceManager // public functions
 	MaterialInfo GetMaterialInfo(MaterialHandle handle) { return materialInfos[handle]; }
 	Material& EditMaterial(MaterialHandle handle) { return g_Materials[handle]; }
 	ushort GetNumMeshes()                         { return numMeshes; };
+	bool IsGPUMesh(MeshHandle handle)             { return gpuMeshes[handle]; }
+	const BVHNode& GetMeshRootNode(MeshHandle handle) { return gpuMeshes[handle] ? gpuMeshRoots[handle] : g_BVHNodes[g_BVHIndices[handle]]; }
 }
 
-#ifndef IMUI_DISABLE
+#ifndef IMGUI_DISABLE
 static void DrawMaterialsWindow()
 {
 	bool edited = false;
@@ -147,75 +159,174 @@ void ResourceManager::Initialize(cl_context context, cl_command_queue command_qu
 	commandQueue = command_queue;
 	// allocate memorys
 	g_Triangles   = (Tri*)_aligned_malloc(MAX_MESH_MEMORY, 16);
-	iconStaging = (unsigned char*)malloc(64 * 64 * 3 + 1);
+	iconStaging = (unsigned char*)malloc(64 * 64 * 4 + 1);
 	g_BVHNodes    = (BVHNode*)_aligned_malloc(MAX_BVHMEMORY, 16);
-	g_TexturePixels = (RGB8*)malloc(MAX_TEXTURE_MEMORY * 2);
+	g_BVHParents  = (uint*)malloc(MAX_BVHNODES * sizeof(uint));
+	g_TexturePixels = (uint*)_aligned_malloc(MAX_TEXELS * sizeof(uint), 16);
 
 	g_Materials = m_Materials; g_Textures = m_Textures; g_BVHIndices = m_BVHIndices; // initialize global pointers
 
+#ifndef IMGUI_DISABLE
 	Editor::AddOnEditor(DrawMaterialsWindow);
+#endif
 	// total 2mn triangle support for now we can increase it easily because we have a lot more memory in our gpu's 2m triangle has maximum 338 mb memory on gpu
 	g_MeshTriangleMem = clCreateBuffer(context, CL_MEM_READ_WRITE, MAX_TRIANGLES * 2 * sizeof(Tri), nullptr, &clerr); assert(clerr == 0);
-	g_BvhMem        = clCreateBuffer(context, CL_MEM_WRITE_ONLY, MAX_BVHMEMORY * 2, nullptr, &clerr); assert(clerr == 0);
+	g_BvhMem        = clCreateBuffer(context, CL_MEM_READ_WRITE, MAX_BVHMEMORY * 2, nullptr, &clerr); assert(clerr == 0); // gpu builder reads the children when it computes the bounds
 	g_BvhIndicesMem = clCreateBuffer(context, CL_MEM_WRITE_ONLY, MaxMeshes * sizeof(uint), nullptr, &clerr); assert(clerr == 0);
+	g_BvhParentsMem = clCreateBuffer(context, CL_MEM_READ_WRITE, MAX_BVHNODES * 2 * sizeof(uint), nullptr, &clerr); assert(clerr == 0); // builders write it, tracer reads it
 	g_MaterialsMem  = clCreateBuffer(context, CL_MEM_WRITE_ONLY, MaxMaterials * sizeof(Material), nullptr, &clerr); assert(clerr == 0);
 	
-	g_TextureDataMem   = clCreateBuffer(context, CL_MEM_READ_WRITE, MAX_TEXTURE_MEMORY * 2, 0, &clerr); assert(clerr == 0);
+	g_TextureDataMem   = clCreateBuffer(context, CL_MEM_READ_WRITE, MAX_TEXELS * sizeof(uint), 0, &clerr); assert(clerr == 0);
 	g_TextureHandleMem = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Texture) * MaxTextures, nullptr, &clerr); assert(clerr == 0);
 	AssetManager_Initialize();
 
 	// create default textures. white, black
 	g_Textures[0].width = 1;  g_Textures[1].width = 1;
 	g_Textures[0].height = 1;  g_Textures[1].height = 1;
-	g_Textures[0].offset = 0;  g_Textures[1].offset = 3;
-	unsigned char defaultTextureData[6];
-	defaultTextureData[0] = 0xFF; defaultTextureData[1] = 0xFF; defaultTextureData[2] = 0xFF;
-	defaultTextureData[3] = 0;    defaultTextureData[4] = 0;    defaultTextureData[5] = 0;
+	g_Textures[0].offset = 0;  g_Textures[1].offset = 1;
+	g_Textures[0].numMips = 1; g_Textures[1].numMips = 1;
+	g_Textures[0].mipOffsets[0] = 0;  g_Textures[1].mipOffsets[0] = 1;
+	g_TexturePixels[0] = 0xFFFFFFFFu; // white
+	g_TexturePixels[1] = 0xFF000000u; // black
 
-	lastTextureOffset = 6; numTextures = 2;
+	lastTextureOffset = 2; numTextures = 2;
 
-	clerr = clEnqueueWriteBuffer(commandQueue, g_TextureDataMem, false, 0, 6, defaultTextureData, 0, 0, 0); assert(clerr == 0);
+	clerr = clEnqueueWriteBuffer(commandQueue, g_TextureDataMem, false, 0, sizeof(uint) * 2, g_TexturePixels, 0, 0, 0); assert(clerr == 0);
 }
 
-TextureHandle ResourceManager::ImportTexture(const char* path)
+// number of mip levels of the full chain, base level included
+static int CalculateNumMips(int width, int height)
+{
+	int numMips = 1;
+	while ((width > 1 || height > 1) && numMips < MaxMipLevels)
+	{
+		width = Max(width >> 1, 1); height = Max(height >> 1, 1);
+		numMips++;
+	}
+	return numMips;
+}
+
+// each level is downsampled from previous level and stored right after it, returns number of texels
+static size_t GenerateMipChain(uint* texels, int width, int height, int numMips, int* mipOffsets)
+{
+	mipOffsets[0] = 0;
+	for (int i = 1; i < numMips; i++)
+	{
+		int newWidth = Max(width >> 1, 1), newHeight = Max(height >> 1, 1);
+		mipOffsets[i] = mipOffsets[i - 1] + width * height;
+		stbir_resize_uint8((unsigned char*)(texels + mipOffsets[i - 1]), width, height, 0, 
+		                   (unsigned char*)(texels + mipOffsets[i]), newWidth, newHeight, 0, 4);
+		width = newWidth, height = newHeight;
+	}
+	return mipOffsets[numMips - 1] + (size_t)width * height;
+}
+
+#if !defined(GAME_BUILD) && !defined(HEADLESS)
+static void CreateTextureIcon(TextureInfo& textureInfo, const Texture& texture)
+{
+	// first mip level that fits in to the icon
+	int level = 0, width = texture.width, height = texture.height;
+	while ((width > 64 || height > 64) && level < texture.numMips - 1)
+	{
+		width = Max(width >> 1, 1); height = Max(height >> 1, 1);
+		level++;
+	}
+	if (width > 64 || height > 64) return;
+
+	const uint* levelData = g_TexturePixels + texture.mipOffsets[level];
+	uint* icon = (uint*)iconStaging;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			icon[y * width + x] = texture.format == TextureFormat_BC1 ? AssetManager_DecodeBC1Texel(levelData, width, x, y)
+			                                                          : levelData[y * width + x];
+
+	Renderer::CreateGLTexture(textureInfo.glTextureIcon, width, height, iconStaging, 4);
+}
+#endif
+
+TextureHandle ResourceManager::ImportTexture(const char* path, TextureFormat format)
 {
 	Texture& texture = g_Textures[numTextures]; 
 	TextureInfo& textureInfo = textureInfos[numTextures];
-	textureInfo.path = _strdup(path);
-	textureInfo.name = Helper::GetPathName(textureInfo.path);
 	
-	unsigned long numBytes;
-
 	if (!std::filesystem::exists(path))
 		AXERROR("texture importing failed! file is not exist: %s", path), exit(0);
 
-	int channels;
-	unsigned char* ptr = stbi_load(path, &texture.width, &texture.height, &channels, 3);
-	numBytes = texture.height * texture.width * 3; // 3 = rgb8
+	size_t pathLen = strlen(path);
+	char* cachePath = _strdup(path);
+	Helper::ChangeExtension(cachePath, "clt", pathLen);
 
-	if (!ptr) { AXERROR("texture importing failed! keep in mind texture must be .jpeg"); exit(0); }
-
-	if (lastTextureOffset + numBytes >= MAX_TEXTURE_MEMORY) {
-		AXERROR("texture importing failed! MAX_TEXTURE_MEMORY is not enough!"); exit(0);
-	}
+	uint* data = g_TexturePixels + lastTextureOffset;
+	size_t freeSpace = MAX_TEXELS - lastTextureOffset;
+	size_t size = 0;
 	
-	// copy texture to gpu
-	clerr = clEnqueueWriteBuffer(commandQueue, g_TextureDataMem, false, lastTextureOffset, numBytes, ptr, 0, 0, 0);  assert(clerr == 0);
-	// copy texture to cpu
-	memcpy(g_TexturePixels + lastTextureOffset, ptr, numBytes);
-
-#ifndef GAME_BUILD
-	if (texture.width <= 64 || texture.height <= 64)
-		Renderer::CreateGLTexture(textureInfo.glTextureIcon, texture.width, texture.height, ptr);
-	else if (numTextures > 3) // Jump skybox texture
+	// load .clt texture(our custom) if it is already imported with same format and source is not changed
+	bool loaded = std::filesystem::exists(cachePath) 
+	           && std::filesystem::last_write_time(cachePath) >= std::filesystem::last_write_time(path)
+	           && AssetManager_LoadTextureFromDisk(cachePath, &texture, data, freeSpace, &size)
+	           && texture.format == format;
+
+	if (!loaded)
 	{
-		stbir_resize_uint8(ptr, texture.width, texture.height, 0, iconStaging, 64, 64, 0, 3);
-		Renderer::CreateGLTexture(textureInfo.glTextureIcon, 64, 64, iconStaging);
+		int channels;
+		// rgba8 instead of rgb8, each texel is one aligned 32 bit load on gpu
+		unsigned char* ptr = stbi_load(path, &texture.width, &texture.height, &channels, 4);
+		if (!ptr) { AXERROR("texture importing failed! keep in mind texture must be .jpeg"); exit(0); }
+
+		texture.format  = format;
+		texture.numMips = CalculateNumMips(texture.width, texture.height);
+		size = AssetManager_TextureSize(texture.width, texture.height, texture.numMips, format);
+		
+		if (size >= freeSpace) {
+			AXERROR("texture importing failed! MAX_TEXTURE_MEMORY is not enough! %s", path);
+			STBI_FREE(ptr); free(cachePath);
+			return WhiteTexture;
+		}
+		
+		if (format == TextureFormat_RGBA8) 
+		{
+			memcpy(data, ptr, (size_t)texture.width * texture.height * sizeof(uint));
+			GenerateMipChain(data, texture.width, texture.height, texture.numMips, texture.mipOffsets);
+		}
+		else 
+		{
+			// generate rgba8 mip chain in temp memory and compress each level to texture memory
+			size_t numTexels = AssetManager_TextureSize(texture.width, texture.height, texture.numMips, TextureFormat_RGBA8);
+			uint* texels = (uint*)malloc(numTexels * sizeof(uint));
+			memcpy(texels, ptr, (size_t)texture.width * texture.height * sizeof(uint));
+			int texelOffsets[MaxMipLevels];
+			GenerateMipChain(texels, texture.width, texture.height, texture.numMips, texelOffsets);
+			
+			int mipWidth = texture.width, mipHeight = texture.height, blockOffset = 0;
+			for (int i = 0; i < texture.numMips; i++)
+			{
+				texture.mipOffsets[i] = blockOffset;
+				AssetManager_CompressBC1(texels + texelOffsets[i], mipWidth, mipHeight, data + blockOffset);
+				blockOffset += ((mipWidth + 3) >> 2) * ((mipHeight + 3) >> 2) * 2;
+				mipWidth = Max(mipWidth >> 1, 1), mipHeight = Max(mipHeight >> 1, 1);
+			}
+			free(texels);
+		}
+		texture.offset = 0; // mip offsets are relative while saving
+		AssetManager_SaveTextureToDisk(cachePath, &texture, data, size);
+		STBI_FREE(ptr);
 	}
+	free(cachePath);
+
+	texture.offset = (int)lastTextureOffset;
+	for (int i = 0; i < texture.numMips; i++)
+		texture.mipOffsets[i] += texture.offset;
+
+	// copy texture to gpu, cpu copy stays alive so we don't need to block
+	clerr = clEnqueueWriteBuffer(commandQueue, g_TextureDataMem, false, lastTextureOffset * sizeof(uint), size * sizeof(uint), data, 0, 0, 0);  assert(clerr == 0);
+	lastTextureOffset += size;
+
+	textureInfo.path = _strdup(path);
+	textureInfo.name = Helper::GetPathName(textureInfo.path);
+#if !defined(GAME_BUILD) && !defined(HEADLESS)
+	if (numTextures != 2) // Jump skybox texture
+		CreateTextureIcon(textureInfo, texture);
 #endif
-	texture.offset = lastTextureOffset / 3; // 3 = rgb
-	lastTextureOffset += numBytes;
-	STBI_FREE(ptr);
 	AssetManagerResetTempMemory();
 	// no need to free ptr memory its arena allocated
 	return numTextures++;
@@ -276,44 +387,176 @@ MeshHandle ResourceManager::ImportMesh(const char* path)
 }
 
 extern uint BuildBVH(Tri* tris, MeshInfo* meshes, int numMeshes, BVHNode* nodes, uint* bvhIndices);
+extern void BuildBVHParents(const BVHNode* nodes, uint firstNode, uint numNodes, const uint* rootIndices, int numRoots, uint* parents);
+
+// gpu triangles are stored as v0, v1 - v0, v2 - v0. precomputed edges saves two subtractions from each ray triangle test
+static void ConvertTrianglesToEdges(Tri* dst, const Tri* src, uint count)
+{
+	for (uint i = 0; i < count; i++)
+	{
+		dst[i] = src[i];
+		dst[i].v1 = _mm_sub_ps(src[i].v1, src[i].v0);
+		dst[i].v2 = _mm_sub_ps(src[i].v2, src[i].v0);
+	}
+}
 
 void ResourceManager::PushMeshesToGPU()
 {	
+	// cpu builder assumes meshes are contiguous in g_Triangles
+	if (numGPUMeshes) { AXERROR("meshes can't be pushed after creating gpu meshes!"); return; }
+
 	uint numNodesUsed = BuildBVH(g_Triangles, meshInfos, numMeshes, g_BVHNodes + lastBVHIndex, g_BVHIndices + numberOfBVH);
-	size_t addedTriangleSize = size_t(numTriangles - lastTriangleCount) * sizeof(Tri);
+	uint numAddedTriangles = numTriangles - lastTriangleCount;
+	size_t addedTriangleSize = size_t(numAddedTriangles) * sizeof(Tri);
 
-	// add new triangles to gpu buffer
-	clerr = clEnqueueWriteBuffer(commandQueue, g_MeshTriangleMem, false, lastTriangleCount * sizeof(Tri), addedTriangleSize, g_Triangles, 0, 0, 0); assert(clerr == 0);
+	// add new triangles to gpu buffer, converted to the vertex + edges layout that the kernels use
+	Tri* gpuTriangles = (Tri*)clEnqueueMapBuffer(commandQueue, g_MeshTriangleMem, true, CL_MAP_WRITE_INVALIDATE_REGION, lastTriangleCount * sizeof(Tri), addedTriangleSize, 0, 0, 0, &clerr); assert(clerr == 0);
+	ConvertTrianglesToEdges(gpuTriangles, g_Triangles + lastTriangleCount, numAddedTriangles);
+	clerr = clEnqueueUnmapMemObject(commandQueue, g_MeshTriangleMem, gpuTriangles, 0, 0, 0); assert(clerr == 0);
 		
-	size_t bvhIndexStart = numberOfBVH * sizeof(BVHNode);
+	size_t bvhIndexStart = numberOfBVH * sizeof(uint);
 	size_t bvhIndexSize = size_t(numMeshes - numberOfBVH) * sizeof(uint);
 
 	clerr = clEnqueueWriteBuffer(commandQueue, g_BvhIndicesMem, false, bvhIndexStart, bvhIndexSize, g_BVHIndices + numberOfBVH, 0, 0, 0); assert(clerr == 0);
 	
 	clerr = clEnqueueWriteBuffer(commandQueue, g_BvhMem, false, lastBVHIndex * sizeof(BVHNode), sizeof(BVHNode) * numNodesUsed, g_BVHNodes + lastBVHIndex, 0, 0, 0); assert(clerr == 0);
 
+	BuildBVHParents(g_BVHNodes, (uint)lastBVHIndex, numNodesUsed, g_BVHIndices + numberOfBVH, numMeshes - numberOfBVH, g_BVHParents);
+	clerr = clEnqueueWriteBuffer(commandQueue, g_BvhParentsMem, false, lastBVHIndex * sizeof(uint), sizeof(uint) * numNodesUsed, g_BVHParents + lastBVHIndex, 0, 0, 0); assert(clerr == 0);
+
 	clerr = clEnqueueWriteBuffer(commandQueue, g_MaterialsMem, false, 0, sizeof(Material) * numMaterials, g_Materials, 0, 0, 0); assert(clerr == 0);
 	
 	numberOfBVH = numMeshes;
 	lastBVHIndex += numNodesUsed;
-	lastTriangleCount += numTriangles;
+	lastTriangleCount = numTriangles;
+}
+
+MeshHandle ResourceManager::CreateGPUMesh(uint numTriangles, MaterialHandle material)
+{
+	size_t numNodes = size_t(numTriangles) * 2 - 1;
+	if (numTriangles == 0 || numMeshes == MaxMeshes || lastGPUTriangle + numTriangles > MAX_TRIANGLES * 2 || lastGPUNode + numNodes > MAX_BVHNODES * 2)
+		AXERROR("gpu mesh memory is full!"), exit(0);
+
+	MeshInfo& meshInfo = meshInfos[numMeshes];
+	meshInfo.numTriangles  = numTriangles;
+	meshInfo.triangleStart = (uint)lastGPUTriangle;
+	meshInfo.materialStart = material;
+	meshInfo.numMaterials  = 1;
+	meshInfo.path = "GPU Mesh";
+	meshObjs[numMeshes] = nullptr;
+	gpuMeshes[numMeshes] = true;
+	gpuMeshNodeStarts[numMeshes] = (uint)lastGPUNode;
+	gpuMeshRoots[numMeshes] = {};
+
+	lastGPUTriangle += numTriangles;
+	lastGPUNode += numNodes;
+	numGPUMeshes++;
+	return numMeshes++;
+}
+
+void ResourceManager::BuildGPUMeshBVH(MeshHandle handle)
+{
+	if (!gpuMeshes[handle]) { AXERROR("bvh of imported meshes are built with PushMeshesToGPU!"); return; }
+	
+	const MeshInfo& meshInfo = meshInfos[handle];
+	uint rootIndex = gpuMeshNodeStarts[handle];
+	if (!GPUBVH::Build(meshInfo.triangleStart, meshInfo.numTriangles, rootIndex)) return;
+	
+	g_BVHIndices[handle] = rootIndex;
+	clerr = clEnqueueWriteBuffer(commandQueue, g_BvhIndicesMem, false, handle * sizeof(uint), sizeof(uint), g_BVHIndices + handle, 0, 0, 0); assert(clerr == 0);
+	// 32 bytes, instance culling needs the bounds on the cpu
+	clerr = clEnqueueReadBuffer(commandQueue, g_BvhMem, true, rootIndex * sizeof(BVHNode), sizeof(BVHNode), gpuMeshRoots + handle, 0, 0, 0); assert(clerr == 0);
+}
+
+static bool BoundsContain(const BVHNode& outer, const BVHNode& inner, float epsilon)
+{
+	return inner.aabbMin.x >= outer.aabbMin.x - epsilon && inner.aabbMin.y >= outer.aabbMin.y - epsilon && inner.aabbMin.z >= outer.aabbMin.z - epsilon &&
+	       inner.aabbMax.x <= outer.aabbMax.x + epsilon && inner.aabbMax.y <= outer.aabbMax.y + epsilon && inner.aabbMax.z <= outer.aabbMax.z + epsilon;
+}
+
+// walks the gpu built bvh, returns the first problem or null. nodes are read back from nodeStart
+static const char* CheckGPUBVH(const BVHNode* nodes, uint nodeStart, uint numNodes, uint triangleStart, uint numTriangles)
+{
+	const BVHNode& root = nodes[0];
+	if (numTriangles > 1 && (root.triCount != 0 || root.leftFirst != nodeStart + 1)) return "root header is not valid";
+
+	const char* error = nullptr;
+	uint* leafVisits = new uint[numTriangles]();
+	uint* stack = new uint[numNodes];
+	uint stackSize = 0, numVisited = 0;
+	stack[stackSize++] = nodeStart;
+	while (stackSize && !error)
+	{
+		const BVHNode& node = nodes[stack[--stackSize] - nodeStart];
+		if (++numVisited > numNodes) { error = "nodes are visited more than once"; break; }
+		if (node.triCount) 
+		{
+			if (node.triCount != 1 || node.leftFirst < triangleStart || node.leftFirst >= triangleStart + numTriangles) error = "leaf has an invalid triangle";
+			else if (leafVisits[node.leftFirst - triangleStart]++) error = "triangle is in more than one leaf";
+			continue;
+		}
+		if (node.leftFirst < nodeStart + 1 || node.leftFirst + 1 >= nodeStart + numNodes) { error = "child index is out of range"; break; }
+		if (stackSize + 2 > numNodes) { error = "nodes are visited more than once"; break; }
+		for (uint c = 0; c < 2; c++)
+		{
+			// parent bounds are the union of the children, so they contain them exactly
+			if (!BoundsContain(node, nodes[node.leftFirst + c - nodeStart], 0.0f)) error = "child bounds are outside of the parent";
+			stack[stackSize++] = node.leftFirst + c;
+		}
+	}
+	if (!error && numVisited != numNodes) error = "some nodes are not reachable from the root";
+	delete[] leafVisits;
+	delete[] stack;
+	return error;
+}
+
+bool ResourceManager::ValidateGPUBVHBuilder(MeshHandle source)
+{
+	const MeshInfo& meshInfo = meshInfos[source];
+	uint numTriangles = meshInfo.numTriangles, numNodes = numTriangles * 2 - 1;
+	uint triangleStart = (uint)lastGPUTriangle, nodeStart = (uint)lastGPUNode; // free gpu mesh memory, nothing is reserved
+	if (gpuMeshes[source] || lastGPUTriangle + numTriangles > MAX_TRIANGLES * 2 || lastGPUNode + numNodes > MAX_BVHNODES * 2) {
+		AXWARNING("gpu bvh builder can't be validated with %s", meshInfo.path);
+		return false;
+	}
+
+	// triangles of the imported mesh are already in the vertex + edges layout that the builder reads
+	clerr = clEnqueueCopyBuffer(commandQueue, g_MeshTriangleMem, g_MeshTriangleMem, meshInfo.triangleStart * sizeof(Tri), triangleStart * sizeof(Tri), 
+	                            numTriangles * sizeof(Tri), 0, 0, 0); assert(clerr == 0);
+	if (!GPUBVH::Build(triangleStart, numTriangles, nodeStart)) return false; // builder is not available, already logged
+
+	BVHNode* nodes = new BVHNode[numNodes];
+	clerr = clEnqueueReadBuffer(commandQueue, g_BvhMem, true, nodeStart * sizeof(BVHNode), numNodes * sizeof(BVHNode), nodes, 0, 0, 0); assert(clerr == 0);
+	
+	const char* error = CheckGPUBVH(nodes, nodeStart, numNodes, triangleStart, numTriangles);
+	// both roots are the bounds of the same triangles, gpu adds the edges back to the first vertex so there is a rounding difference
+	const BVHNode& cpuRoot = GetMeshRootNode(source);
+	float extent = Max(Max(cpuRoot.aabbMax.x - cpuRoot.aabbMin.x, cpuRoot.aabbMax.y - cpuRoot.aabbMin.y), Max(cpuRoot.aabbMax.z - cpuRoot.aabbMin.z, 1.0f));
+	float epsilon = extent * 1e-4f;
+	if (!error && !(BoundsContain(cpuRoot, nodes[0], epsilon) && BoundsContain(nodes[0], cpuRoot, epsilon))) error = "root bounds are different than the cpu bvh";
+	delete[] nodes;
+
+	if (error) AXERROR("gpu bvh of %s is not valid: %s", meshInfo.path, error);
+	else AXLOG("gpu bvh builder is validated with %s, %u nodes\n", meshInfo.path, numNodes);
+	return !error;
 }
 
 // destroys the scene
 void ResourceManager::Destroy()
 {
-	FOR_EACH(clReleaseMemObject, g_TextureHandleMem, g_TextureDataMem, g_BvhMem, g_MeshTriangleMem, g_BvhIndicesMem);
+	FOR_EACH(clReleaseMemObject, g_TextureHandleMem, g_TextureDataMem, g_BvhMem, g_MeshTriangleMem, g_BvhIndicesMem, g_BvhParentsMem);
 }
 
 // finalizes the resources
 void ResourceManager::Finalize()
 {
 	Destroy();
-	while (numMeshes--) AssetManager_DestroyMesh(meshObjs[numMeshes]);
+	while (numMeshes--) if (meshObjs[numMeshes]) AssetManager_DestroyMesh(meshObjs[numMeshes]);
 	while (numTextures--) free(textureInfos[numTextures].path); // we cant delete texture icon for now, operating system will clean it anyway and it is small data either
 	free(iconStaging);
-	free(g_TexturePixels);
+	_aligned_free(g_TexturePixels);
 	_aligned_free(g_Triangles);
 	_aligned_free(g_BVHNodes);
+	free(g_BVHParents);
 	// AssetManager_Destroy();
 }
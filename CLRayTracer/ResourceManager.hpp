@@ -10,12 +10,6 @@ AX_ALIGNED(16) struct BVHNode
 	union { struct { float3 aabbMax; uint triCount; };  __m128 maxv; };
 };
 
-#pragma pack(push)
-struct RGB8 {
-	unsigned char r, g, b;
-};
-#pragma pack(pop)
-
 struct MeshInfo {
 	uint numTriangles; 
 	uint triangleStart; 
@@ -24,8 +18,18 @@ struct MeshInfo {
 	const char* path;
 };
 
+constexpr int MaxMipLevels = 11;
+
+enum TextureFormat
+{
+	TextureFormat_RGBA8, // one uint per texel
+	TextureFormat_BC1    // 4x4 texel blocks, two uint's per block: rgb565 end points and 2 bit indices
+};
+
 struct Texture {
-	int width, height, offset, padd;
+	int width, height, offset, numMips; // offset is in uint's, for rgba8 each uint is a texel
+	int format;
+	int mipOffsets[MaxMipLevels];       // uint offset of each mip level, mipOffsets[0] == offset
 };
 
 struct TextureInfo {
@@ -80,7 +84,8 @@ typedef ushort MaterialHandle;
 //         flush cpu memory and fill it again
 namespace ResourceManager
 {
-	TextureHandle ImportTexture(const char* path);
+	// imported textures are cached as .clt next to the source file, returns WhiteTexture if texture memory is full
+	TextureHandle ImportTexture(const char* path, TextureFormat format = TextureFormat_BC1);
 	MeshHandle ImportMesh(const char* path);
 
 	constexpr TextureHandle  WhiteTexture = 0;
@@ -98,6 +103,19 @@ namespace ResourceManager
 	void PushMaterialsToGPU();
 	ushort GetNumMeshes();
 
+	// meshes that are generated or deformed by kernels, triangles are in g_MeshTriangleMem starting at GetMeshInfo(handle).triangleStart
+	// triangles in g_MeshTriangleMem are stored as the first vertex and two edges (v1 - v0, v2 - v0), kernels must write them in this layout
+	// they are only on the gpu, create them after PushMeshesToGPU. call BuildGPUMeshBVH after the triangles are written
+	MeshHandle CreateGPUMesh(uint numTriangles, MaterialHandle material = 0);
+	// bvh is built on the gpu, only the root node is read back for the instance bounds.
+	// instances that are registered before the rebuild keep their old bounds until their matrix is set again
+	void BuildGPUMeshBVH(MeshHandle handle);
+	bool IsGPUMesh(MeshHandle handle);
+	// debug check of the gpu builder: builds the bvh of an imported mesh's triangles on the gpu in the free gpu mesh memory,
+	// reads it back and checks the hierarchy and the root bounds against the cpu bvh. returns false and logs the problem if it is not valid
+	bool ValidateGPUBVHBuilder(MeshHandle source);
+	const BVHNode& GetMeshRootNode(MeshHandle handle);
+
 	MeshInfo GetMeshInfo(MeshHandle handle);
 	TextureInfo GetTextureInfo(TextureHandle handle);
 
@@ -1,3 +1,47 @@
+#ifdef HEADLESS
+// no window, no gl. renderer draws to an offscreen image, input functions are always returning false
+#include "Window.hpp"
+
+namespace Window
+{
+	int Width = 1249, Height = 720;
+	// fixed time step, time is counted in frames so same frames are rendered each run.
+	// render time of the profiler is zero because of this, gpu timings come from the profile events
+	constexpr double FixedDeltaTime = 1.0 / 60.0;
+	unsigned long long frameCount = 0;
+
+	int Create() { frameCount = 0; return 1; }
+	void Destroy() {}
+	bool ShouldClose() { return false; }
+	void EndFrame(unsigned screenImageGL) { frameCount++; }
+	void SetSize(int width, int height) { Width = width; Height = height; }
+	unsigned GetWidth()  { return Width;  }
+	unsigned GetHeight() { return Height; }
+	void ChangeName(float ms) {}
+	bool IsFocused() { return true; }
+	
+	double GetTime() { return frameCount * FixedDeltaTime; }
+	double DeltaTime() { return FixedDeltaTime; }
+
+	Vector2i GetWindowScale()  { return Vector2i(Width, Height); }
+	Vector2i GetMonitorScale() { return Vector2i(Width, Height); }
+	Vector2i GetMouseScreenPos() { return Vector2i(0, 0); }
+	Vector2f GetMouseWindowPos() { return Vector2f(0.0f, 0.0f); }
+
+	void SetMouseScreenPos(Vector2i pos) {}
+	void SetMouseWindowPos (Vector2f pos) {}
+
+	bool GetKey(int keyCode)     { return false; }
+	bool GetKeyUp(int keyCode)   { return true;  }
+	bool GetKeyDown(int keyCode) { return false; }
+
+	bool GetMouseButton(int keyCode)     { return false; }
+	bool GetMouseButtonUp(int keyCode)   { return true;  }
+	bool GetMouseButtonDown(int keyCode) { return false; }
+}
+
+#else
+
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include "Window.hpp"
@@ -146,4 +190,6 @@ int Window::Create()
 void Window::Destroy()
 {
 	glfwDestroyWindow(window);
-}
\ No newline at end of file
+}
+
+#endif // HEADLESS
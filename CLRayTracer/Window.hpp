@@ -11,6 +11,10 @@ namespace Window
 	unsigned GetHeight();
 	void ChangeName(float ms);
 	bool IsFocused();
+#ifdef HEADLESS
+	// size of the offscreen image, call before Create
+	void SetSize(int width, int height);
+#endif
 	
 	// TIME
 	double GetTime();
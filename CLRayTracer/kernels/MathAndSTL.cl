@@ -18,6 +18,10 @@ typedef struct _Matrix3 {
 	float3 x, y, z;
 } Matrix3;
 
+typedef struct _Matrix3x4 {
+	float4 x, y, z;
+} Matrix3x4;
+
 Matrix4 MatMatMul(Matrix4 a, Matrix4 b) {
 	Matrix4 result;
 	float4 vx = a.x.xxxx * b.x;
@@ -101,6 +105,16 @@ float4 MatMul(Matrix4 m, float4 v) {
 	return m.x * v.xxxx + m.y * v.yyyy + m.z * v.zzzz + m.w * v.wwww;
 }
 
+// affine matrix stored as 3 columns, translation is in w
+float3 Mat3x4MulPoint(Matrix3x4 m, float3 p) {
+	float4 v = (float4)(p, 1.0f);
+	return (float3)(dot(m.x, v), dot(m.y, v), dot(m.z, v));
+}
+
+float3 Mat3x4MulVector(Matrix3x4 m, float3 v) {
+	return (float3)(dot(m.x.xyz, v), dot(m.y.xyz, v), dot(m.z.xyz, v));
+}
+
 float3 Mat3Mul(Matrix3 m, float3 v) {
 	return m.x * v.xxx + m.y * v.yyy + m.z * v.zzz;
 }
@@ -226,41 +240,91 @@ Ray CreateRay(float3 origin, float3 dir)
 
 // ---- TEXTURE & COLOR ----
 
+#define MAX_MIP_LEVELS 11
+#define TEXTURE_FORMAT_RGBA8 0
+#define TEXTURE_FORMAT_BC1   1
+
 typedef struct _Texture {
-	int width, height, offset, padd;
+	int width, height, offset, numMips;
+	int format;
+	int mipOffsets[MAX_MIP_LEVELS];
 } Texture;
 
-typedef struct __attribute__((packed)) _RGB8 
-{
-	unsigned char r,g,b;
-} RGB8;
-
 float3 UnpackRGB8u(uint u)  
 {
 	return (float3)(u & 255, u >> 8 & 255, u >> 16 & 255) * UcharToFloat01;
 }
 
-float3 MultiplyColorU32(RGB8 b, uint a)
+float3 MultiplyColorU32(float3 b, uint a)
 {
-	b.r = ((a & 0xff) * b.r) >> 8;
-	b.g = (((a >> 8)  & 0xff) * b.g) >> 8;
-	b.b = (((a >> 16) & 0xff) * b.b) >> 8;
-	return (float3)(b.r, b.g, b.b) * UcharToFloat01;
+	return b * UnpackRGB8u(a);
 }
 
-#define UNPACK_RGB8(rgb8) ((float3)(rgb8.r, rgb8.g, rgb8.b) * UcharToFloat01)
+float3 UnpackRGB565(uint u)
+{
+	return (float3)(u >> 11 & 31, u >> 5 & 63, u & 31) * (float3)(1.0f / 31.0f, 1.0f / 63.0f, 1.0f / 31.0f);
+}
 
-int SampleSkyboxPixel(float3 rayDirection, Texture texture)
+// 4x4 texel blocks, each block is two uint's: rgb565 end points and 2 bit indices per texel
+float3 FetchTexelBC1(global const uint* pixels, int offset, int width, int x, int y)
 {
-	int theta = (int)(atan2pi(rayDirection.x, -rayDirection.z) * 0.5f * (float)(texture.width)); 
-	int phi = (int)(acospi(rayDirection.y) * (float)(texture.height)); 
-	return mad24(phi, texture.width, theta + 2);
+	uint2 block = vload2(mad24(y >> 2, (width + 3) >> 2, x >> 2), pixels + offset);
+	uint index = block.y >> (((y & 3) * 4 + (x & 3)) * 2) & 3;
+	uint c0 = block.x & 0xFFFF, c1 = block.x >> 16;
+	float3 color0 = UnpackRGB565(c0), color1 = UnpackRGB565(c1);
+	if (index < 2) return index == 0 ? color0 : color1;
+	// 3 color mode when c0 <= c1, last color is black
+	if (c0 > c1) return index == 2 ? mix(color0, color1, 1.0f / 3.0f) : mix(color0, color1, 2.0f / 3.0f);
+	return index == 2 ? (color0 + color1) * 0.5f : (float3)(0.0f);
 }
 
-int SampleTexture(Texture texture, float2 uv)
+// textures are rgba8 packed in to uint's, one aligned 32 bit load per texel, or bc1 blocks
+float3 FetchTexel(global const uint* pixels, int offset, int width, int format, int x, int y)
+{
+	if (format == TEXTURE_FORMAT_BC1) return FetchTexelBC1(pixels, offset, width, x, y);
+	return UnpackRGB8u(pixels[offset + mad24(y, width, x)]);
+}
+
+float3 SampleLevel(global const uint* pixels, int offset, int width, int height, int format, float2 uv)
 {
 	uv -= floor(uv);
-	int uScaled = (int)(texture.width  * uv.x); // (0, 1) to (0, TextureWidth )
-	int vScaled = (int)(texture.height * uv.y); // (0, 1) to (0, TextureHeight)
-	return vScaled * texture.width + texture.offset + uScaled;
+#ifdef TEXTURE_FILTER_NEAREST
+	int uScaled = (int)(width  * uv.x); // (0, 1) to (0, TextureWidth )
+	int vScaled = (int)(height * uv.y); // (0, 1) to (0, TextureHeight)
+	return FetchTexel(pixels, offset, width, format, min(uScaled, width - 1), min(vScaled, height - 1));
+#else
+	// bilinear filtering with wrapping
+	float2 texCoord = uv * (float2)(width, height) - 0.5f;
+	float2 base = floor(texCoord);
+	float2 f = texCoord - base;
+	int x0 = (int)base.x, y0 = (int)base.y;
+	int x1 = x0 + 1, y1 = y0 + 1;
+	x0 = x0 < 0 ? width  - 1 : x0;  x1 = x1 >= width  ? 0 : x1;
+	y0 = y0 < 0 ? height - 1 : y0;  y1 = y1 >= height ? 0 : y1;
+
+	float3 top    = mix(FetchTexel(pixels, offset, width, format, x0, y0), FetchTexel(pixels, offset, width, format, x1, y0), f.x);
+	float3 bottom = mix(FetchTexel(pixels, offset, width, format, x0, y1), FetchTexel(pixels, offset, width, format, x1, y1), f.x);
+	return mix(top, bottom, f.y);
+#endif
+}
+
+float3 SampleTexture(global const uint* pixels, global const Texture* texture, float2 uv)
+{
+	return SampleLevel(pixels, texture->offset, texture->width, texture->height, texture->format, uv);
+}
+
+// lod is log2 of the texel footprint at the base level, nearest mip level is selected 
+// and filtered bilinearly, smaller levels are also more cache friendly for incoherent rays
+float3 SampleTextureLod(global const uint* pixels, global const Texture* texture, float2 uv, float lod)
+{
+	int level = clamp((int)(lod + 0.5f), 0, texture->numMips - 1);
+	int width  = max(texture->width  >> level, 1);
+	int height = max(texture->height >> level, 1);
+	return SampleLevel(pixels, texture->mipOffsets[level], width, height, texture->format, uv);
+}
+
+float3 SampleSkybox(global const uint* pixels, global const Texture* texture, float3 rayDirection)
+{
+	float2 uv = (float2)(atan2pi(rayDirection.x, -rayDirection.z) * 0.5f, acospi(rayDirection.y));
+	return SampleTexture(pixels, texture, uv);
 }
\ No newline at end of file
@@ -0,0 +1,227 @@
+// software as is bla bla license bla bla gev gev gev
+// Anilcan Gulkaya 10/03/2022
+// linear bvh builder, builds bvh of the triangles that are already on the gpu, nothing goes through the host.
+// based on: Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees (Karras 2012)
+// steps: centroid bounds -> morton codes -> radix sort -> reorder triangles -> emit hierarchy -> bottom up bounds
+// output has the same node format with the cpu builder: {min, leftFirst}, {max, triCount}, children are adjacent
+
+// only positions are used here, rest of the triangle is copied while reordering.
+// triangles are stored as the first vertex and two edges, same as the tracing kernels
+typedef struct _Triangle {
+	float4 vertex0, edge1, edge2;
+	uint rest[8]; // uv's, material index and normals. 80 byte in total same as the Tri in the host
+} Triangle;
+
+typedef struct _BVHNode {
+	float4 min; // w = leftFirst
+	float4 max; // w = triCount
+} BVHNode;
+
+#define RADIX_DIGITS 16 // sort 4 bits in each pass
+#define INVALID_NODE 0xFFFFFFFFu
+
+float3 TriangleCentroid(const global Triangle* tri)
+{
+	return tri->vertex0.xyz + (tri->edge1.xyz + tri->edge2.xyz) * (1.0f / 3.0f);
+}
+
+// launched with one work group, bounds[0] = min, bounds[1] = max
+kernel void ComputeCentroidBounds(const global Triangle* triangles, uint triangleStart, uint numTriangles, global float4* bounds)
+{
+	float3 bmin = (float3)(1e30f), bmax = (float3)(-1e30f);
+	for (uint i = get_local_id(0); i < numTriangles; i += get_local_size(0))
+	{
+		float3 centroid = TriangleCentroid(triangles + triangleStart + i);
+		bmin = fmin(bmin, centroid);
+		bmax = fmax(bmax, centroid);
+	}
+	bmin = (float3)(work_group_reduce_min(bmin.x), work_group_reduce_min(bmin.y), work_group_reduce_min(bmin.z));
+	bmax = (float3)(work_group_reduce_max(bmax.x), work_group_reduce_max(bmax.y), work_group_reduce_max(bmax.z));
+	if (get_local_id(0) == 0) {
+		bounds[0] = (float4)(bmin, 0.0f);
+		bounds[1] = (float4)(bmax, 0.0f);
+	}
+}
+
+// inserts two zeros between each of the 10 bits
+uint ExpandBits(uint v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// 30 bit morton code of the centroids, values are the triangle indices that we will sort with the keys
+kernel void ComputeMortonCodes(const global Triangle* triangles, uint triangleStart, uint numTriangles, const global float4* bounds,
+                               global uint* keys, global uint* values)
+{
+	uint i = get_global_id(0);
+	if (i >= numTriangles) return;
+	float3 extent = fmax(bounds[1].xyz - bounds[0].xyz, (float3)(1e-6f));
+	float3 p = (TriangleCentroid(triangles + triangleStart + i) - bounds[0].xyz) / extent;
+	p = clamp(p * 1024.0f, 0.0f, 1023.0f);
+	keys[i] = (ExpandBits((uint)p.x) << 2) | (ExpandBits((uint)p.y) << 1) | ExpandBits((uint)p.z);
+	values[i] = i;
+}
+
+// ---- RADIX SORT ----
+// each work group handles one tile of local size keys, histogram is digit major: histogram[digit * numGroups + group]
+// so exclusive scan of the whole histogram gives the first output position of each digit of each tile
+
+kernel void RadixHistogram(const global uint* keys, uint numKeys, uint shift, global uint* histogram)
+{
+	uint i = get_global_id(0);
+	uint digit = i < numKeys ? (keys[i] >> shift) & (RADIX_DIGITS - 1) : RADIX_DIGITS;
+	for (uint d = 0; d < RADIX_DIGITS; d++)
+	{
+		uint count = work_group_reduce_add(digit == d ? 1u : 0u);
+		if (get_local_id(0) == 0) histogram[d * get_num_groups(0) + get_group_id(0)] = count;
+	}
+}
+
+// launched with one work group
+kernel void RadixScan(global uint* histogram, uint count)
+{
+	uint carry = 0;
+	for (uint start = 0; start < count; start += get_local_size(0))
+	{
+		uint i = start + get_local_id(0);
+		uint value = i < count ? histogram[i] : 0u;
+		uint scanned = work_group_scan_exclusive_add(value);
+		uint total = work_group_broadcast(scanned + value, get_local_size(0) - 1);
+		if (i < count) histogram[i] = scanned + carry;
+		carry += total;
+	}
+}
+
+// scatter is stable, rank of the key in its tile is found with a scan for each digit
+kernel void RadixScatter(const global uint* keys, const global uint* values, uint numKeys, uint shift, const global uint* histogram,
+                         global uint* sortedKeys, global uint* sortedValues)
+{
+	uint i = get_global_id(0);
+	uint key = i < numKeys ? keys[i] : 0u;
+	uint digit = i < numKeys ? (key >> shift) & (RADIX_DIGITS - 1) : RADIX_DIGITS;
+	uint position = 0;
+	for (uint d = 0; d < RADIX_DIGITS; d++)
+	{
+		uint rank = work_group_scan_exclusive_add(digit == d ? 1u : 0u);
+		if (digit == d) position = histogram[d * get_num_groups(0) + get_group_id(0)] + rank;
+	}
+	if (i >= numKeys) return;
+	sortedKeys[position] = key;
+	sortedValues[position] = values[i];
+}
+
+// triangles are written in morton order to a temporary buffer, host copies them back to the mesh's range
+kernel void ReorderTriangles(const global Triangle* triangles, uint triangleStart, uint numTriangles, const global uint* sortedValues,
+                             global Triangle* sortedTriangles)
+{
+	uint i = get_global_id(0);
+	if (i >= numTriangles) return;
+	sortedTriangles[i] = triangles[triangleStart + sortedValues[i]];
+}
+
+// ---- HIERARCHY ----
+
+// length of the common prefix of the keys, -1 if j is out of range. equal keys are seperated with their indices
+int CommonPrefix(const global uint* keys, int numKeys, int i, int j)
+{
+	if (j < 0 || j >= numKeys) return -1;
+	uint ki = keys[i], kj = keys[j];
+	return ki == kj ? 32 + clz((uint)(i ^ j)) : clz(ki ^ kj);
+}
+
+void WriteLeaf(global BVHNode* node, const global Triangle* tri, uint triangleIndex)
+{
+	float3 v1 = tri->vertex0.xyz + tri->edge1.xyz, v2 = tri->vertex0.xyz + tri->edge2.xyz;
+	float3 bmin = fmin(fmin(tri->vertex0.xyz, v1), v2);
+	float3 bmax = fmax(fmax(tri->vertex0.xyz, v1), v2);
+	node->min = (float4)(bmin, as_float(triangleIndex));
+	node->max = (float4)(bmax, as_float(1u));
+}
+
+// internal node i (karras numbering) stores its two children at nodeStart + 1 + 2 * i, root is at nodeStart.
+// leaves have one triangle each, 2 * numTriangles - 1 nodes in total. bounds of internal nodes are computed later
+kernel void EmitHierarchy(const global uint* keys, uint numKeys, const global Triangle* triangles, uint triangleStart, global BVHNode* nodes, uint nodeStart,
+                          global uint* internalSlots, global uint* internalParents, global uint* leafParents, global uint* parents)
+{
+	int i = get_global_id(0), n = numKeys;
+	if (n == 1) { // single triangle, root is a leaf
+		if (i == 0) WriteLeaf(nodes + nodeStart, triangles + triangleStart, triangleStart), parents[nodeStart] = nodeStart;
+		return;
+	}
+	if (i >= n - 1) return;
+
+	if (i == 0) { // root is internal, its children are right after it. bounds are computed later
+		nodes[nodeStart].min = (float4)(0.0f, 0.0f, 0.0f, as_float(nodeStart + 1));
+		nodes[nodeStart].max = (float4)(0.0f, 0.0f, 0.0f, as_float(0u));
+		internalSlots[0] = nodeStart, internalParents[0] = INVALID_NODE;
+	}
+
+	// direction of the range
+	int d = CommonPrefix(keys, n, i, i + 1) - CommonPrefix(keys, n, i, i - 1) > 0 ? 1 : -1;
+	int minPrefix = CommonPrefix(keys, n, i, i - d);
+
+	// find the other end of the range, upper bound then binary search
+	int maxLength = 2;
+	while (CommonPrefix(keys, n, i, i + maxLength * d) > minPrefix) maxLength <<= 1;
+	int length = 0;
+	for (int t = maxLength >> 1; t >= 1; t >>= 1)
+		if (CommonPrefix(keys, n, i, i + (length + t) * d) > minPrefix) length += t;
+	int j = i + length * d;
+
+	// binary search the split position
+	int nodePrefix = CommonPrefix(keys, n, i, j);
+	int split = 0, t = length;
+	do {
+		t = (t + 1) >> 1;
+		if (CommonPrefix(keys, n, i, i + (split + t) * d) > nodePrefix) split += t;
+	} while (t > 1);
+	int gamma = i + split * d + min(d, 0);
+
+	uint childSlot = nodeStart + 1 + 2 * i;
+	int children[2] = { gamma, gamma + 1 };
+	bool isLeaf[2] = { min(i, j) == gamma, max(i, j) == gamma + 1 };
+
+	for (int c = 0; c < 2; c++)
+	{
+		uint slot = childSlot + c;
+		if (isLeaf[c]) {
+			WriteLeaf(nodes + slot, triangles + triangleStart + children[c], triangleStart + children[c]);
+			leafParents[children[c]] = i;
+		}
+		else {
+			nodes[slot].min = (float4)(0.0f, 0.0f, 0.0f, as_float(nodeStart + 1 + 2 * children[c]));
+			nodes[slot].max = (float4)(0.0f, 0.0f, 0.0f, as_float(0u));
+			internalSlots[children[c]] = slot;
+			internalParents[children[c]] = i;
+		}
+	}
+}
+
+// one work item for each leaf walks up the tree, first child that arrives to the node stops,
+// second one has the bounds of both children. parent links are written for the traversal's short stack fallback
+kernel void ComputeNodeBounds(uint numLeaves, uint nodeStart, global BVHNode* nodes, const global uint* internalSlots, const global uint* internalParents,
+                              const global uint* leafParents, global atomic_int* visits, global uint* parents)
+{
+	uint k = get_global_id(0);
+	if (k >= numLeaves || numLeaves == 1) return;
+
+	uint p = leafParents[k];
+	while (p != INVALID_NODE)
+	{
+		// acquire release, makes the bounds written by the other child visible
+		if (atomic_fetch_add_explicit(visits + p, 1, memory_order_acq_rel, memory_scope_device) == 0) return;
+
+		uint childSlot = nodeStart + 1 + 2 * p, slot = internalSlots[p];
+		BVHNode left = nodes[childSlot], right = nodes[childSlot + 1];
+		nodes[slot].min = (float4)(fmin(left.min.xyz, right.min.xyz), nodes[slot].min.w);
+		nodes[slot].max = (float4)(fmax(left.max.xyz, right.max.xyz), nodes[slot].max.w);
+
+		parents[childSlot] = slot, parents[childSlot + 1] = slot;
+		if (p == 0) parents[slot] = slot; // roots are their own parents
+		p = internalParents[p];
+	}
+}
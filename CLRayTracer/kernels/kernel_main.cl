@@ -4,6 +4,29 @@
 #ifdef AUTOMATICLY_INCLUDED
 #include "MathAndSTL.cl"
 #endif
+// ---- FEATURES ----
+// renderer compiles a variant of the program for each feature set with -D options, 
+// these are the defaults when the source is compiled without them
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES 2
+#endif
+#ifndef SHADOWS
+#define SHADOWS 0
+#endif
+#ifndef SPECULAR
+#define SPECULAR 1
+#endif
+// instance, triangle and depth of the primary hits are written for picking
+#ifndef ID_BUFFER
+#define ID_BUFFER 1
+#endif
+// entries of the bvh traversal stack that is kept in local memory, per work item
+#ifndef SHORT_STACK_SIZE
+#define SHORT_STACK_SIZE 8
+#endif
+// work items of bigger work groups doesn't get stack space, they traverse with parent links only
+#define MAX_STACK_GROUP_SIZE 256
+
 // ---- STRUCTURES ----
 
 typedef struct _TraceArgs{
@@ -11,6 +34,7 @@ typedef struct _TraceArgs{
 	float time;
 	uint numMeshes;
 	float sunAngle;
+	float pixelSpreadAngle; // ray cone spread angle of one pixel
 } TraceArgs;
 
 typedef struct _RayHit {	
@@ -32,7 +56,8 @@ typedef struct _Material {
 } Material;
 
 typedef struct _Triangle {
-	float3 x, y, z; // triangle positions
+	// first vertex and two edges, edges are computed while uploading so intersection doesn't subtract them for each ray
+	float3 vertex0, edge1, edge2;
 	half uv0[2];
 	half uv1[2];
 	half uv2[2];
@@ -47,14 +72,34 @@ typedef struct _Triout {
 } Triout;
 
 typedef struct _MeshInstance { 
-	Matrix4 inverseTransform;
+	Matrix3x4 inverseTransform;
 	ushort meshIndex, materialStart; 
+	uint mask;       // ray queries skip the instance if mask of the query doesn't match
+	uint padding[2]; // 64 byte
 } MeshInstance;
 
 typedef struct _BVHNode {
 	float4 min, max; 
 } BVHNode;
 
+typedef struct _InstanceBounds {
+	float4 min, max; // world space, w is unused
+} InstanceBounds;
+
+// same layout with Physics.hpp
+typedef struct _RayQuery {
+	float origin[3], tmax;
+	float direction[3];
+	uint mask;
+} RayQuery;
+
+typedef struct _RayQueryHit {
+	float distance; // 1e30f if missed
+	uint instance, triangle;
+	float u, v;
+	float normal[3]; // world space geometric normal
+} RayQueryHit;
+
 // ---- CONSTRUCTORS ----
 
 RayHit CreateRayHit() {
@@ -83,13 +128,13 @@ bool IntersectPlane(Ray ray, RayHit* besthit)
 
 bool IntersectTriangle(Ray ray, const global Triangle* tri, Triout* o, int i)
 {
-	const float3 edge1 = tri->y - tri->x;
-	const float3 edge2 = tri->z - tri->x;
+	const float3 edge1 = tri->edge1;
+	const float3 edge2 = tri->edge2;
 	const float3 h = cross(ray.direction, edge2);
 	const float  a = dot(edge1, h);
 	// if (fabs(a) < 0.0001f) return false; // ray parallel to triangle
 	const float  f = 1.0f / a;
-	const float3 s = ray.origin - tri->x.xyz;
+	const float3 s = ray.origin - tri->vertex0;
 	const float  u = f * dot(s, h);
 	
 	const float3 q = cross(s, edge1);
@@ -105,185 +150,1019 @@ bool IntersectTriangle(Ray ray, const global Triangle* tri, Triout* o, int i)
 	return passed;
 }
 
+// returns distance to the box or 1e30f if it is missed or farther than minSoFar, zero if the origin is inside of the box
 float IntersectAABB(float3 origin, float3 invDir, float3 aabbMin, float3 aabbMax, float minSoFar)
 {
 	float3 tmin = (aabbMin - origin) * invDir;
 	float3 tmax = (aabbMax - origin) * invDir;
 	float tnear = Max3(fmin(tmin, tmax));
 	float tfar  = Min3(fmax(tmin, tmax));
-	// return tnear < tfar && tnear > 0.0f && tnear < minSoFar;
-	if (tnear < tfar && tnear > 0.0f && tnear < minSoFar)
-		return tnear; else return 1e30f;
+	if (tnear <= tfar && tfar > 0.0f && tnear < minSoFar)
+		return fmax(tnear, 0.0f); else return 1e30f;
 }
 
-#define SWAPF(x, y) float tf = x; x = y, y = tf;
-#define SWAPUINT(x, y) uint tu = x; x = y, y = tu;
 #define GetLeftFirst(nod) (as_uint((nod)->min.w))
 #define GetTriCount(nod)  (as_uint((nod)->max.w))
 
-int IntersectBVH(Ray ray, const global BVHNode* nodes, uint rootNode, const global Triangle* tris, Triout* out)
+// per work item slice of the traversal stacks in local memory, entries are strided by the group size to avoid bank conflicts
+typedef struct _TraversalStack {
+	local uint* entries;
+	uint stride, capacity;
+} TraversalStack;
+
+typedef struct _ChildOrder {
+	uint nearIndex, farIndex;
+	float nearDistance, farDistance; // 1e30f if missed
+} ChildOrder;
+
+// near child is the one that ray enters first, left one if distances are equal
+ChildOrder OrderChildren(float3 origin, float3 invDir, const global BVHNode* nodes, const global BVHNode* node, float minSoFar)
+{
+	uint leftIndex = GetLeftFirst(node);
+	float dist1 = IntersectAABB(origin, invDir, nodes[leftIndex].min.xyz    , nodes[leftIndex].max.xyz    , minSoFar);
+	float dist2 = IntersectAABB(origin, invDir, nodes[leftIndex + 1].min.xyz, nodes[leftIndex + 1].max.xyz, minSoFar);
+	bool swap = dist1 > dist2;
+	ChildOrder order;
+	order.nearIndex = swap ? leftIndex + 1 : leftIndex;
+	order.farIndex  = swap ? leftIndex : leftIndex + 1;
+	order.nearDistance = fmin(dist1, dist2);
+	order.farDistance  = fmax(dist1, dist2);
+	return order;
+}
+
+// short stack traversal: far children are pushed to a small circular stack in local memory, 
+// when it is full oldest entry is overwritten. after the stack runs empty dropped nodes are found with parent links:
+// we walk up from the last finished node and visit far child of each parent that we entered through its near child.
+// near/far order is recomputed with the closest hit so far which only can cull the farther child, so the order is same as the descent.
+// there is no iteration limit, deep trees are traversed correctly
+int IntersectBVH(Ray ray, const global BVHNode* nodes, const global uint* parents, uint rootNode, 
+                 const global Triangle* tris, Triout* out, TraversalStack stack)
 {
-	int nodesToVisit[32] = { rootNode };
-	int currentNodeIndex = 1;
 	float3 invDir = native_recip(ray.direction);
-	int intersection = 0, protection = 0;
+	int intersection = 0;
+	uint stackTop = 0, stackSize = 0;
+	bool overflowed = stack.capacity == 0;
+	uint nodeIndex = rootNode;
 	
-	while (currentNodeIndex > 0 && protection++ < 250)
+	while (true)
 	{	
-		const global BVHNode* node = nodes + nodesToVisit[--currentNodeIndex];
-		traverse:
+		const global BVHNode* node = nodes + nodeIndex;
+		
 		if (GetTriCount(node) > 0) // is leaf 
 		{
 			for (int i = GetLeftFirst(node), end = i + GetTriCount(node); i < end; ++i)
 				intersection |= IntersectTriangle(ray, tris + i, out, i);
+		}
+		else
+		{
+			ChildOrder order = OrderChildren(ray.origin, invDir, nodes, node, out->t);
+			
+			if (order.nearDistance != 1e30f)
+			{
+				if (order.farDistance != 1e30f && stack.capacity > 0)
+				{
+					overflowed |= stackSize == stack.capacity;
+					stackSize = min(stackSize + 1, stack.capacity);
+					stack.entries[stackTop * stack.stride] = order.farIndex;
+					stackTop = stackTop + 1 == stack.capacity ? 0 : stackTop + 1;
+				}
+				else overflowed |= order.farDistance != 1e30f;
+				nodeIndex = order.nearIndex;
+				continue;
+			}
+		}
+
+		// node is finished, continue with the stack
+		if (stackSize > 0)
+		{
+			stackTop = stackTop == 0 ? stack.capacity - 1 : stackTop - 1;
+			stackSize--;
+			nodeIndex = stack.entries[stackTop * stack.stride];
 			continue;
 		}
-	    
-		uint leftIndex  = GetLeftFirst(node);
-		uint rightIndex = leftIndex + 1;
-		BVHNode leftNode  = nodes[leftIndex];
-		BVHNode rightNode = nodes[rightIndex];
-		
-		float dist1 = IntersectAABB(ray.origin, invDir, leftNode.min.xyz , leftNode.max.xyz , out->t);
-		float dist2 = IntersectAABB(ray.origin, invDir, rightNode.min.xyz, rightNode.max.xyz, out->t);
-	    
-		if (dist1 > dist2) { SWAPF(dist1, dist2); SWAPUINT(leftIndex, rightIndex); }
-		
-		if (dist1 == 1e30f) continue;
-		else {
-			node = nodes + leftIndex;
-			if (dist2 != 1e30f) nodesToVisit[currentNodeIndex++] = rightIndex;
-			goto traverse;
+
+		if (!overflowed) break;
+
+		// stack is empty but some of the far children are dropped, find the next one with parent links
+		uint child = nodeIndex;
+		nodeIndex = ~0u;
+		while (child != rootNode)
+		{
+			uint parent = parents[child];
+			ChildOrder order = OrderChildren(ray.origin, invDir, nodes, nodes + parent, out->t);
+			if (child == order.nearIndex && order.farDistance != 1e30f) { nodeIndex = order.farIndex; break; }
+			child = parent;
 		}
+		if (nodeIndex == ~0u) break;
 	}
 	return intersection;
 }
 
+#if SHADOWS
+// returns true if any instance is hit by the ray, ray is in world space
+bool IsOccluded(Ray ray, uint numMeshes, const global MeshInstance* meshInstances, const global InstanceBounds* instanceBounds,
+                const global BVHNode* nodes, const global uint* bvhParents, const global uint* bvhIndices, const global Triangle* triangles, 
+                TraversalStack stack)
+{
+	float3 invDir = native_recip(ray.direction);
+	for (int i = 0; i < numMeshes; ++i)
+	{
+		if (IntersectAABB(ray.origin, invDir, instanceBounds[i].min.xyz, instanceBounds[i].max.xyz, Infinite) == 1e30f) continue;
+		Triout triout;
+		triout.t = Infinite;
+		triout.triIndex = 0;
+		MeshInstance instance = meshInstances[i];
+		Ray mRay;
+		mRay.origin = Mat3x4MulPoint(instance.inverseTransform, ray.origin);
+		mRay.direction = Mat3x4MulVector(instance.inverseTransform, ray.direction);
+		if (IntersectBVH(mRay, nodes, bvhParents, bvhIndices[instance.meshIndex], triangles, &triout, stack)) return true;
+	}
+	return false;
+}
+#endif
+
+// ---- PATH ----
+
+// state of the path that is carried between the bounces
+typedef struct _PathState {
+	Ray ray;
+	float3 result, energy, atmosphericLight, lightDir;
+	float coneWidth; // ray cone for texture lod
+} PathState;
+
+typedef struct _SurfaceHit {
+	Triout triout; // t, barycentrics and triangle index
+	Ray meshRay;   // ray in the space of the instance
+	int instanceIndex;
+} SurfaceHit;
+
+PathState CreatePathState(Ray ray, float sunAngle)
+{
+	PathState path;
+	path.ray = ray;
+	path.lightDir = (float3)(0.0f, sin(sunAngle), cos(sunAngle)); // sun dir
+	// lightDir *= fmax(dot(lightDir, (float3)(0.0f, -1.0f, 0.0f)), 0.2f);
+	path.result = (float3)(0.0f, 0.0f, 0.0f);
+	path.energy = (float3)(1.0f, 1.0f, 1.0f);
+	path.atmosphericLight = (float3)(0.255f, 0.25f, 0.27f) * 1.0f;
+	// ray cone for texture lod: https://media.contentapi.ea.com/content/dam/ea/seed/presentations/2019-ray-tracing-gems-chapter-20-akenine-moller-et-al.pdf
+	path.coneWidth = 0.0f;
+	return path;
+}
+
+// closest hit of all instances, ray is in world space. returns false if nothing is hit
+bool FindClosestHit(Ray ray, uint numMeshes, const global MeshInstance* meshInstances, const global InstanceBounds* instanceBounds,
+                    const global BVHNode* nodes, const global uint* bvhParents, const global uint* bvhIndices, const global Triangle* triangles,
+                    TraversalStack stack, SurfaceHit* hit)
+{
+	float bestDistance = Infinite;
+	float3 invDir = native_recip(ray.direction);
+	for (int i = 0; i < numMeshes; ++i)
+	{
+		// cheap rejection before fetching and transforming with the instance matrix
+		if (IntersectAABB(ray.origin, invDir, instanceBounds[i].min.xyz, instanceBounds[i].max.xyz, bestDistance) == 1e30f) continue;
+		Triout triout;
+		triout.t = bestDistance;
+		triout.triIndex = 0;
+		MeshInstance instance = meshInstances[i];
+		// change ray position instead of mesh position for capturing in different positions
+		Ray mRay;
+		mRay.origin = Mat3x4MulPoint(instance.inverseTransform, ray.origin);
+		mRay.direction = Mat3x4MulVector(instance.inverseTransform, ray.direction);
+		
+		// instance.meshIndex = bvhIndex
+		if (IntersectBVH(mRay, nodes, bvhParents, bvhIndices[instance.meshIndex], triangles, &triout, stack)) 
+		{
+			hit->instanceIndex = i;
+			hit->triout = triout;
+			hit->meshRay = mRay;
+			bestDistance = triout.t;
+		}
+	}
+	return bestDistance <= InfMinusOne;
+}
+
+void WriteID(global uint* idBuffer, int pixelIndex, bool isHit, const SurfaceHit* hit)
+{
+	uint3 id = (uint3)(~0u, ~0u, as_uint(1e30f));
+	if (isHit) id = (uint3)(hit->instanceIndex, hit->triout.triIndex, as_uint(hit->triout.t));
+	vstore3(id, pixelIndex, idBuffer);
+}
+
+// lights the hit and prepares the next bounce, returns false if the path ends here
+bool ShadeSurface(PathState* path, const SurfaceHit* hit, int numBounces, TraceArgs trace_args,
+                  global const Texture* textures, global const uint* texturePixels, global const uint* bvhIndices, global const Triangle* triangles,
+                  global const BVHNode* nodes, global const Material* materials, global const MeshInstance* meshInstances, 
+                  global const InstanceBounds* instanceBounds, global const uint* bvhParents, TraversalStack stack)
+{
+	HitRecord record = CreateHitRecord();
+	Triout hitOut = hit->triout;
+	Ray ray = path->ray, meshRay = hit->meshRay;
+
+	MeshInstance hitInstance = meshInstances[hit->instanceIndex];
+	Triangle triangle = triangles[hitOut.triIndex];
+	Material material = materials[hitInstance.materialStart + triangle.materialIndex];
+	float3 baryCentrics = (float3)(1.0f - hitOut.u - hitOut.v, hitOut.u, hitOut.v);
+
+	float3 n0 = Mat3x4MulVector(hitInstance.inverseTransform, vload_half3(0, triangle.normal0)); 
+	float3 n1 = Mat3x4MulVector(hitInstance.inverseTransform, vload_half3(0, triangle.normal1));
+	float3 n2 = Mat3x4MulVector(hitInstance.inverseTransform, vload_half3(0, triangle.normal2));
+	
+	record.normal = normalize((n0 * baryCentrics.x) + (n1 * baryCentrics.y) + (n2 * baryCentrics.z));
+	
+	float2 uv0 = vload_half2(0, triangle.uv0), uv1 = vload_half2(0, triangle.uv1), uv2 = vload_half2(0, triangle.uv2);
+	float2 uv = uv0 * baryCentrics.x + uv1 * baryCentrics.y + uv2 * baryCentrics.z;
+	
+	// ray direction is normalized in world space, so t is world space distance.
+	// reflections are treated as planar, cone keeps spreading with the same angle
+	path->coneWidth += trace_args.pixelSpreadAngle * hitOut.t;
+	// everything below is in object space, scale cone width with the instance scale
+	float3 faceCross = cross(triangle.edge1, triangle.edge2);
+	float triangleArea = fmax(length(faceCross), 1e-12f);
+	float2 uvEdge1 = uv1 - uv0, uvEdge2 = uv2 - uv0;
+	float uvArea = fmax(fabs(uvEdge1.x * uvEdge2.y - uvEdge2.x * uvEdge1.y), 1e-12f);
+	float rayScale = length(meshRay.direction);
+	float cosTheta = fmax(fabs(dot(faceCross / triangleArea, meshRay.direction / rayScale)), 1e-3f);
+	float lod = 0.5f * log2(uvArea / triangleArea) + log2(path->coneWidth * rayScale / cosTheta);
+
+	global const Texture* albedoTexture = textures + material.albedoTextureIndex;
+	// texel footprint depends on texture resolution
+	float albedoLod = lod + 0.5f * log2((float)(albedoTexture->width * albedoTexture->height));
+	float3 pixel = SampleTextureLod(texturePixels, albedoTexture, uv, albedoLod);
+	// float3 specularPixel = SampleTexture(texturePixels, textures + material.specularTextureIndex, uv);
+
+	record.color = MultiplyColorU32(pixel, material.color);
+	// instance transform is affine so t is same in world space
+	record.point = ray.origin + hitOut.t * ray.direction;
+
+	float3 lightDir = path->lightDir;
+	float ndl = dot(record.normal, -lightDir);
+	float3 ambient = fmax(0.0f - ndl, 0.1f) * path->atmosphericLight * record.color;
+	ndl = fmax(ndl, 0.0f);
+	
+	float shadow = 1.0f;
+#if SHADOWS
+	// only the first hit is lit by the sun, later bounces use the incoming direction as light
+	if (numBounces == 0 && ndl > 0.0f) {
+		Ray shadowRay = CreateRay(record.point + record.normal * 0.01f, -lightDir);
+		shadow = IsOccluded(shadowRay, trace_args.numMeshes, meshInstances, instanceBounds, nodes, bvhParents, bvhIndices, triangles, stack) ? 0.0f : 1.0f;
+	}
+#endif
+	path->result += path->energy * (record.color * ndl * shadow) + ambient;
+
+#if SPECULAR
+	float3 specularColor = (float3)(0.2f, 0.2f, 0.2f);//MultiplyColorU32(specularPixel, material.specularColor);
+	float roughness = 0.5f;//convert_float(material.roughness);
+	float shininess = 1.0f;// convert_float(material.shininess);
+	
+	float3 specular = (float3)((1.0f - roughness) * ndl * shadow) * specularColor * ndl; 
+	float3 specularLighting = ndl * shadow * pow(fmax(dot(reflect(-lightDir, record.normal), ray.direction), 0.0f), shininess) * 0.2f; // ray direction = wi
+	path->result += specularLighting;
+	path->energy *= specular;
+	path->atmosphericLight *= 0.4f;
+
+	path->ray.origin = record.point + record.normal * 0.01f;
+	path->ray.direction = reflect(ray.direction, record.normal); // wo = ray.direction now = outgoing ray direction
+	path->lightDir = path->ray.direction;
+	return true;
+#else
+	return false; // nothing is reflected, other bounces wouldn't add anything
+#endif
+}
+
 // ---- KERNELS ----
 
+// all bounces of a camera ray, ids of the primary hit are written if the id buffer is not null
+float3 TracePath(Ray ray, int rayIndex, global uint* idBuffer, TraceArgs trace_args, 
+                 global const Texture* textures, global const uint* texturePixels, global const uint* bvhIndices, global const Triangle* triangles,
+                 global const BVHNode* nodes, global const Material* materials, global const MeshInstance* meshInstances, 
+                 global const InstanceBounds* instanceBounds, global const uint* bvhParents, TraversalStack stack)
+{
+	PathState path = CreatePathState(ray, trace_args.sunAngle);
+	
+	for (int numBounces = 0; numBounces < MAX_BOUNCES; ++numBounces)
+	{
+		SurfaceHit hit;
+		bool isHit = FindClosestHit(path.ray, trace_args.numMeshes, meshInstances, instanceBounds, nodes, bvhParents, bvhIndices, triangles, stack, &hit);
+#if ID_BUFFER
+		if (numBounces == 0 && idBuffer) WriteID(idBuffer, rayIndex, isHit, &hit);
+#endif
+		if (!isHit) {
+			path.result += SampleSkybox(texturePixels, textures + 2, path.ray.direction) * path.energy;
+			break;
+		}
+		if (!ShadeSurface(&path, &hit, numBounces, trace_args, textures, texturePixels, bvhIndices, triangles, 
+		                  nodes, materials, meshInstances, instanceBounds, bvhParents, stack)) break;
+	}
+	return path.result;
+}
+
 kernel void Trace(
 	write_only image2d_t screen,
 	global const Texture* textures,
-	global const RGB8* texturePixels,
+	global const uint* texturePixels,
 	global const uint* bvhIndices,
 	global const Triangle* triangles,
 	global const float* rays, 
 	TraceArgs trace_args,
 	global const BVHNode* nodes,
 	global const Material* materials,
-	global const MeshInstance* meshInstances
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global uint* idBuffer, // 3 uint per pixel: instance, triangle, depth. instance and triangle are ~0u if missed
+	int4 checkerboard      // x: 1 if only half of the pixels are traced, y: parity of the traced pixels, z: render width
 ) 
 {
-	const int pixelX = get_global_id(0), pixelY = get_global_id(1);
-	int rayIndex = pixelY * get_global_size(0) + pixelX;
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0) * get_local_size(1);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_linear_id();
+
+	// in checkerboard mode work items are launched for the half width, each one traces one pixel of the pair
+	const int pixelY = get_global_id(1);
+	const int pixelX = checkerboard.x ? get_global_id(0) * 2 + ((pixelY + checkerboard.y) & 1) : get_global_id(0);
+	if (pixelX >= checkerboard.z) return;
+	int rayIndex = pixelY * checkerboard.z + pixelX;
+	Ray ray = CreateRay(vload3(0, trace_args.cameraPos), vload3(rayIndex, rays));
+	float3 result = TracePath(ray, rayIndex, idBuffer, trace_args, textures, texturePixels, bvhIndices, triangles, 
+	                          nodes, materials, meshInstances, instanceBounds, bvhParents, stack);
+	write_imagef(screen, (int2)(pixelX, pixelY), (float4)(result, 1.0f));
+}
+
+// deferred mode, first pass. only the primary visibility is traced: instance, triangle and barycentrics,
+// there is no texture fetch or shading so neighbour work items stay coherent
+kernel void TraceVisibility(
+	global const float* rays, 
+	TraceArgs trace_args,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	global const BVHNode* nodes,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global uint4* visibility, // instance, triangle, u, v. instance is ~0u if missed
+	global uint* idBuffer
+)
+{
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0) * get_local_size(1);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_linear_id();
+
+	int rayIndex = get_global_id(1) * get_global_size(0) + get_global_id(0);
 	Ray ray = CreateRay(vload3(0, trace_args.cameraPos), vload3(rayIndex, rays));
+	SurfaceHit hit;
+	bool isHit = FindClosestHit(ray, trace_args.numMeshes, meshInstances, instanceBounds, nodes, bvhParents, bvhIndices, triangles, stack, &hit);
+#if ID_BUFFER
+	WriteID(idBuffer, rayIndex, isHit, &hit);
+#endif
+	visibility[rayIndex] = isHit ? (uint4)(hit.instanceIndex, hit.triout.triIndex, as_uint(hit.triout.u), as_uint(hit.triout.v)) 
+	                             : (uint4)(~0u, 0u, 0u, 0u);
+}
+
+// ---- RAY SORT ----
+// optional in deferred mode: after the first bounce paths are saved and reflected rays are sorted by direction octant and origin cell,
+// TraceSortedPaths continues them in sorted order so neighbour work items traverse the same parts of the bvh.
+// key: 3 bit octant, 18 bit morton code of the origin cell (64 cells per axis). finished paths go to the end
+#define RAY_KEY_BITS 24
+#define FINISHED_RAY_KEY 0xFFFFFFu
+
+// path after the first bounce, light direction is the reflected ray direction after a bounce so it isn't saved
+typedef struct _SavedPath {
+	float4 origin;    // w = cone width
+	float4 direction; // w = atmospheric light x
+	float4 result;    // w = atmospheric light y
+	float4 energy;    // w = atmospheric light z
+} SavedPath;
+
+typedef struct _RayBinArgs {
+	float4 boundsMin, boundsMax; // origin cells are in these bounds
+	uint firstPixel;             // keys and saved paths are relative to the band
+} RayBinArgs;
+
+// inserts two zeros between each of the 10 bits
+uint ExpandBits(uint v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+uint RayBinKey(Ray ray, RayBinArgs binArgs)
+{
+	float3 extent = fmax(binArgs.boundsMax.xyz - binArgs.boundsMin.xyz, (float3)(1e-6f));
+	float3 cell = clamp((ray.origin - binArgs.boundsMin.xyz) / extent * 64.0f, 0.0f, 63.0f);
+	uint morton = (ExpandBits((uint)cell.x) << 2) | (ExpandBits((uint)cell.y) << 1) | ExpandBits((uint)cell.z);
+	uint octant = (ray.direction.x < 0.0f ? 1u : 0u) | (ray.direction.y < 0.0f ? 2u : 0u) | (ray.direction.z < 0.0f ? 4u : 0u);
+	return (octant << 18) | morton;
+}
+
+SavedPath SavePath(const PathState* path)
+{
+	SavedPath saved;
+	saved.origin    = (float4)(path->ray.origin, path->coneWidth);
+	saved.direction = (float4)(path->ray.direction, path->atmosphericLight.x);
+	saved.result    = (float4)(path->result, path->atmosphericLight.y);
+	saved.energy    = (float4)(path->energy, path->atmosphericLight.z);
+	return saved;
+}
+
+PathState LoadPath(SavedPath saved)
+{
+	PathState path;
+	path.ray = CreateRay(saved.origin.xyz, saved.direction.xyz);
+	path.coneWidth = saved.origin.w;
+	path.result = saved.result.xyz;
+	path.energy = saved.energy.xyz;
+	path.atmosphericLight = (float3)(saved.direction.w, saved.result.w, saved.energy.w);
+	path.lightDir = saved.direction.xyz;
+	return path;
+}
+
+// ---- TEMPORAL REPROJECTION ----
+// optional in deferred mode: hit point of the pixel is projected to the last frame, if the same triangle was visible there
+// at the same distance last frame's color is reused and the pixel isn't shaded. disocclusions are shaded,
+// also a rotating 1/16 of the pixels are always shaded so lighting changes and animations are picked up
+typedef struct _HistoryPixel {
+	uint instance, triangle; // instance is ~0u for sky, sky is never reused
+	float depth;
+	uint color; // rgba8, same precision with the screen
+} HistoryPixel;
+
+typedef struct _ReprojectionArgs {
+	Matrix4 prevView, prevProjection;
+	float4 prevCameraPos;
+	int2 resolution;                // history is dropped if the render resolution changes
+	int prevBandStart, prevBandEnd; // rows this device rendered last frame, other rows aren't in its history
+	uint frameIndex;                // selects the rotating subset
+	uint enabled;                   // 0 if there is no valid history
+} ReprojectionArgs;
+
+uint PackColor(float3 color)
+{
+	uint3 c = convert_uint3_sat_rte(color * 255.0f);
+	return c.x | (c.y << 8) | (c.z << 16) | 0xFF000000u;
+}
+
+float3 UnpackColor(uint color)
+{
+	return convert_float3((uint3)(color, color >> 8, color >> 16) & 0xFFu) * (1.0f / 255.0f);
+}
+
+void WriteShadedPixel(write_only image2d_t screen, int2 pixel, float3 color, global HistoryPixel* newHistory, int rayIndex)
+{
+	write_imagef(screen, pixel, (float4)(color, 1.0f));
+	if (newHistory) newHistory[rayIndex].color = PackColor(color);
+}
+
+// returns true and last frame's color if the hit point was visible in the last frame
+bool ReprojectHistory(ReprojectionArgs args, const global HistoryPixel* history, int2 pixel, float3 point, uint4 visible, float3* color)
+{
+	if (!args.enabled || (uint)((pixel.x & 3) | ((pixel.y & 3) << 2)) == (args.frameIndex & 15)) return false;
 	
-	float3 lightDir = (float3)(0.0f, sin(trace_args.sunAngle), cos(trace_args.sunAngle)); // sun dir
-	// lightDir *= fmax(dot(lightDir, (float3)(0.0f, -1.0f, 0.0f)), 0.2f);
-	float3 result = (float3)(0.0f, 0.0f, 0.0f);
-	float3 energy = (float3)(1.0f, 1.0f, 1.0f);
-	float3 atmosphericLight = (float3)(0.255f, 0.25f, 0.27f) * 1.0f;
+	// ray generation points the rays to the far plane points of the pixels, 
+	// so we find the point in the direction of the hit that is on the far plane of the last frame
+	float3 toPoint = point - args.prevCameraPos.xyz;
+	float4 a = MatMul(args.prevProjection, MatMul(args.prevView, (float4)(toPoint, 0.0f)));
+	float4 b = MatMul(args.prevProjection, MatMul(args.prevView, (float4)(0.0f, 0.0f, 0.0f, 1.0f)));
+	float s = (b.w - b.z) / (a.z - a.w);
+	float4 clip = a * s + b;
+	if (!(s > 0.0f) || clip.w == 0.0f) return false;
+	
+	float2 coord = clip.xy / clip.w * 0.5f + 0.5f;
+	int2 prevPixel = convert_int2_rte(coord * convert_float2(args.resolution));
+	if (prevPixel.x < 0 || prevPixel.x >= args.resolution.x || prevPixel.y < args.prevBandStart || prevPixel.y >= args.prevBandEnd) return false;
+
+	HistoryPixel old = history[prevPixel.y * args.resolution.x + prevPixel.x];
+	float distance = length(toPoint);
+	if (old.instance != visible.x || old.triangle != visible.y || fabs(old.depth - distance) > distance * 0.01f) return false;
+	*color = UnpackColor(old.color);
+	return true;
+}
+
+// attributes of the primary hit are rebuilt from the visibility buffer and shaded, secondary bounces are traced from here.
+// if savedPaths is not null, paths that continue are saved for the ray sort instead
+void ShadeVisiblePixel(
+	int2 pixel, int rayIndex,
+	write_only image2d_t screen,
+	global const Texture* textures,
+	global const uint* texturePixels,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	global const float* rays, 
+	TraceArgs trace_args,
+	global const BVHNode* nodes,
+	global const Material* materials,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global const uint4* visibility,
+	global SavedPath* savedPaths,
+	global uint* rayKeys,
+	global uint* rayValues,
+	RayBinArgs binArgs,
+	ReprojectionArgs reprojection,
+	global const HistoryPixel* history,
+	global HistoryPixel* newHistory, // null if reprojection is disabled
+	TraversalStack stack
+)
+{
+	PathState path = CreatePathState(CreateRay(vload3(0, trace_args.cameraPos), vload3(rayIndex, rays)), trace_args.sunAngle);
+	uint4 visible = visibility[rayIndex];
+	uint binIndex = rayIndex - binArgs.firstPixel;
+	if (savedPaths) rayKeys[binIndex] = FINISHED_RAY_KEY, rayValues[binIndex] = binIndex;
+
+	if (newHistory) newHistory[rayIndex].instance = visible.x, newHistory[rayIndex].triangle = visible.y;
+
+	if (visible.x == ~0u) {
+		path.result = SampleSkybox(texturePixels, textures + 2, path.ray.direction);
+		write_imagef(screen, pixel, (float4)(path.result, 1.0f));
+		return;
+	}
+
+	// t is found by projecting the hit point on to the ray
+	SurfaceHit hit;
+	MeshInstance instance = meshInstances[visible.x];
+	hit.instanceIndex = visible.x;
+	hit.meshRay.origin = Mat3x4MulPoint(instance.inverseTransform, path.ray.origin);
+	hit.meshRay.direction = Mat3x4MulVector(instance.inverseTransform, path.ray.direction);
+	hit.triout.triIndex = visible.y;
+	hit.triout.u = as_float(visible.z);
+	hit.triout.v = as_float(visible.w);
+	const global Triangle* triangle = triangles + visible.y;
+	float3 point = triangle->vertex0 + triangle->edge1 * hit.triout.u + triangle->edge2 * hit.triout.v;
+	hit.triout.t = dot(point - hit.meshRay.origin, hit.meshRay.direction) / dot(hit.meshRay.direction, hit.meshRay.direction);
 	
-	for (int numBounces = 0; numBounces < 2; ++numBounces)
+	if (newHistory) {
+		// world space ray direction is normalized so t is the distance
+		float3 worldPoint = path.ray.origin + path.ray.direction * hit.triout.t;
+		newHistory[rayIndex].depth = hit.triout.t;
+		if (ReprojectHistory(reprojection, history, pixel, worldPoint, visible, &path.result)) {
+			WriteShadedPixel(screen, pixel, path.result, newHistory, rayIndex);
+			return;
+		}
+	}
+
+	for (int numBounces = 0; numBounces < MAX_BOUNCES; ++numBounces)
 	{
-		RayHit besthit = CreateRayHit();
-		HitRecord record = CreateHitRecord();
-		float roughness = 0.75f; // plane roughness
-		float shininess = 20.0f;
-		float3 specularColor = (float3)(0.8f, 0.7f, 0.6f);
-
-		Triout hitOut;
-		Ray meshRay;
-		int hitInstanceIndex = 0;
-		for (int i = 0; i < trace_args.numMeshes; ++i)
-		{
-			Triout triout;
-			triout.t = besthit.distance;
-			triout.triIndex = 0;
-			MeshInstance instance = meshInstances[i];
-			// change ray position instead of mesh position for capturing in different positions
-			Ray mRay;
-			mRay.origin = MatMul(instance.inverseTransform, (float4)(ray.origin, 1.0f)).xyz;
-			mRay.direction = MatMul(instance.inverseTransform, (float4)(ray.direction, 0.0f)).xyz;
-			
-			// instance.meshIndex = bvhIndex
-			if (IntersectBVH(mRay, nodes, bvhIndices[instance.meshIndex], triangles, &triout)) 
-			{
-				hitInstanceIndex = i;
-				hitOut = triout;
-				besthit.distance = triout.t;
-				meshRay = mRay;
-			}
-		}	
-		
-		if (besthit.distance > InfMinusOne) {
-			RGB8 pixel = texturePixels[SampleSkyboxPixel(ray.direction, textures[2])];
-			float3 skybox_sample = UNPACK_RGB8(pixel);			
-			result += skybox_sample * energy;
+		if (numBounces > 0 && !FindClosestHit(path.ray, trace_args.numMeshes, meshInstances, instanceBounds, nodes, bvhParents, bvhIndices, triangles, stack, &hit)) {
+			path.result += SampleSkybox(texturePixels, textures + 2, path.ray.direction) * path.energy;
 			break;
 		}
+		if (!ShadeSurface(&path, &hit, numBounces, trace_args, textures, texturePixels, bvhIndices, triangles, 
+		                  nodes, materials, meshInstances, instanceBounds, bvhParents, stack)) break;
+		
+		if (savedPaths && numBounces + 1 < MAX_BOUNCES) { // rest of the path is traced after the sort
+			savedPaths[binIndex] = SavePath(&path);
+			rayKeys[binIndex] = RayBinKey(path.ray, binArgs);
+			return;
+		}
+	}
 	
-		MeshInstance hitInstance = meshInstances[hitInstanceIndex];
-		Matrix3 inverseMat3 = ConvertToMatrix3(hitInstance.inverseTransform);
-		Triangle triangle = triangles[hitOut.triIndex];
-		Material material = materials[hitInstance.materialStart + triangle.materialIndex];
-		float3 baryCentrics = (float3)(1.0f - hitOut.u - hitOut.v, hitOut.u, hitOut.v);
+	WriteShadedPixel(screen, pixel, path.result, newHistory, rayIndex);
+}
 
-		float3 n0 = Mat3Mul(inverseMat3, vload_half3(0, triangle.normal0)); 
-		float3 n1 = Mat3Mul(inverseMat3, vload_half3(0, triangle.normal1));
-		float3 n2 = Mat3Mul(inverseMat3, vload_half3(0, triangle.normal2));
-		
-		record.normal = normalize((n0 * baryCentrics.x) + (n1 * baryCentrics.y) + (n2 * baryCentrics.z));
-		
-		float2 uv = vload_half2(0, triangle.uv0) * baryCentrics.x 
-				  + vload_half2(0, triangle.uv1) * baryCentrics.y
-				  + vload_half2(0, triangle.uv2) * baryCentrics.z;
-				
-		RGB8 pixel = texturePixels[SampleTexture(textures[material.albedoTextureIndex], uv)];
-		RGB8 specularPixel = texturePixels[SampleTexture(textures[material.specularTextureIndex], uv)];
-
-		record.color = MultiplyColorU32(pixel, material.color);
-		record.point = meshRay.origin + hitOut.t * meshRay.direction;
-		
-		specularColor = (float3)(0.2f, 0.2f, 0.2f);//MultiplyColorU32(specularPixel, material.specularColor);
-		roughness = 0.5f;//convert_float(material.roughness);
-		shininess = 1.0f;// convert_float(material.shininess);
+// deferred mode, second pass in the screen order
+kernel void ShadeDeferred(
+	write_only image2d_t screen,
+	global const Texture* textures,
+	global const uint* texturePixels,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	global const float* rays, 
+	TraceArgs trace_args,
+	global const BVHNode* nodes,
+	global const Material* materials,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global const uint4* visibility,
+	global SavedPath* savedPaths, // null if rays are not sorted
+	global uint* rayKeys,
+	global uint* rayValues,
+	RayBinArgs binArgs,
+	ReprojectionArgs reprojection,
+	global const HistoryPixel* history,
+	global HistoryPixel* newHistory // null if reprojection is disabled
+)
+{
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0) * get_local_size(1);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_linear_id();
+
+	const int pixelX = get_global_id(0), pixelY = get_global_id(1);
+	int rayIndex = pixelY * get_global_size(0) + pixelX;
+	ShadeVisiblePixel((int2)(pixelX, pixelY), rayIndex, screen, textures, texturePixels, bvhIndices, triangles, rays, trace_args,
+	                  nodes, materials, meshInstances, instanceBounds, bvhParents, visibility, 
+	                  savedPaths, rayKeys, rayValues, binArgs, reprojection, history, newHistory, stack);
+}
+
+// ---- MATERIAL SORT ----
+// deferred shading can shade the hits in material order, so a work group mostly touches the textures of one material.
+// counting sort of the pixels of the band: count -> scan -> scatter -> ShadeSorted
+#define MATERIAL_BINS 257 // MaxMaterials of the ResourceManager + one bin for the sky
 
-		ray.origin = record.point;
-		ray.origin += record.normal * 0.01f;
-		ray.direction = reflect(ray.direction, record.normal); // wo = ray.direction now = outgoing ray direction
+// histogram has a fixed 256 bin cap, ResourceManager never gives ids above MaxMaterials - 1 so clamp doesn't merge real materials.
+// if MaxMaterials grows, MATERIAL_BINS here and MaterialBins in the Renderer has to grow with it (keys are ushort)
+uint MaterialKey(uint4 visible, const global Triangle* triangles, const global MeshInstance* meshInstances)
+{
+	if (visible.x == ~0u) return MATERIAL_BINS - 1;
+	return min((uint)meshInstances[visible.x].materialStart + triangles[visible.y].materialIndex, (uint)(MATERIAL_BINS - 2));
+}
+
+kernel void CountMaterials(global const uint4* visibility, global const Triangle* triangles, global const MeshInstance* meshInstances,
+                           uint firstPixel, uint numPixels, global ushort* materialKeys, global uint* counts)
+{
+	local uint localCounts[MATERIAL_BINS];
+	for (uint b = get_local_id(0); b < MATERIAL_BINS; b += get_local_size(0)) localCounts[b] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint i = get_global_id(0);
+	if (i < numPixels) {
+		uint key = MaterialKey(visibility[firstPixel + i], triangles, meshInstances);
+		materialKeys[firstPixel + i] = key;
+		atomic_inc(localCounts + key);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 	
-		// check Shadow
-		// Ray shadowRay = CreateRay(ray.origin, -lightDir);
-		float shadow = 1.0f; // todo shadow for only directional light
+	// one global atomic for each material of the group
+	for (uint b = get_local_id(0); b < MATERIAL_BINS; b += get_local_size(0))
+		if (localCounts[b]) atomic_add(counts + b, localCounts[b]);
+}
+
+// in place exclusive scan, launched with one work group
+kernel void ScanMaterialCounts(global uint* counts)
+{
+	uint carry = 0;
+	for (uint start = 0; start < MATERIAL_BINS; start += get_local_size(0))
+	{
+		uint i = start + get_local_id(0);
+		uint value = i < MATERIAL_BINS ? counts[i] : 0u;
+		uint scanned = work_group_scan_exclusive_add(value);
+		uint total = work_group_broadcast(scanned + value, get_local_size(0) - 1);
+		if (i < MATERIAL_BINS) counts[i] = scanned + carry;
+		carry += total;
+	}
+}
+
+// each work group reserves one range for each of its materials, so neighbour pixels stay together in a material
+kernel void ScatterByMaterial(global const ushort* materialKeys, uint firstPixel, uint numPixels, global uint* offsets, global uint* sortedPixels)
+{
+	local uint localCounts[MATERIAL_BINS];
+	local uint localBases[MATERIAL_BINS];
+	for (uint b = get_local_id(0); b < MATERIAL_BINS; b += get_local_size(0)) localCounts[b] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint i = get_global_id(0), key = 0, rank = 0;
+	if (i < numPixels) {
+		key = materialKeys[firstPixel + i];
+		rank = atomic_inc(localCounts + key);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint b = get_local_id(0); b < MATERIAL_BINS; b += get_local_size(0))
+		if (localCounts[b]) localBases[b] = atomic_add(offsets + b, localCounts[b]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (i < numPixels) sortedPixels[localBases[key] + rank] = firstPixel + i;
+}
+
+// deferred mode, second pass in the material order. 1d launch over the sorted pixels of the band
+kernel void ShadeSorted(
+	write_only image2d_t screen,
+	global const Texture* textures,
+	global const uint* texturePixels,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	global const float* rays, 
+	TraceArgs trace_args,
+	global const BVHNode* nodes,
+	global const Material* materials,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global const uint4* visibility,
+	global SavedPath* savedPaths, // null if rays are not sorted
+	global uint* rayKeys,
+	global uint* rayValues,
+	RayBinArgs binArgs,
+	ReprojectionArgs reprojection,
+	global const HistoryPixel* history,
+	global HistoryPixel* newHistory, // null if reprojection is disabled
+	global const uint* sortedPixels,
+	uint numPixels,
+	int width
+)
+{
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_id(0);
+
+	if (get_global_id(0) >= numPixels) return;
+	int rayIndex = sortedPixels[get_global_id(0)];
+	ShadeVisiblePixel((int2)(rayIndex % width, rayIndex / width), rayIndex, screen, textures, texturePixels, bvhIndices, triangles, rays, trace_args,
+	                  nodes, materials, meshInstances, instanceBounds, bvhParents, visibility, 
+	                  savedPaths, rayKeys, rayValues, binArgs, reprojection, history, newHistory, stack);
+}
+
+// continues the saved paths in the sorted order, launched in 1d over the rays of the band
+kernel void TraceSortedPaths(
+	write_only image2d_t screen,
+	global const Texture* textures,
+	global const uint* texturePixels,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	TraceArgs trace_args,
+	global const BVHNode* nodes,
+	global const Material* materials,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global const SavedPath* savedPaths,
+	global const uint* sortedKeys,
+	global const uint* sortedValues,
+	uint firstPixel,
+	uint numRays,
+	int width,
+	global HistoryPixel* newHistory // null if reprojection is disabled
+)
+{
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_id(0);
+
+	uint i = get_global_id(0);
+	if (i >= numRays || sortedKeys[i] == FINISHED_RAY_KEY) return; // finished paths are already written
 	
-		// Shade
-		float ndl = dot(record.normal, -lightDir);
-		float3 ambient = fmax(0.0f - ndl, 0.1f) * atmosphericLight * record.color;
-		ndl = fmax(ndl, 0.0f);
-		float3 specular = (float3)((1.0f - roughness) * ndl * shadow) * specularColor * ndl; 
-		float3 specularLighting = ndl * pow(fmax(dot(reflect(-lightDir, record.normal), meshRay.direction), 0.0f), shininess) * 0.2f; // meshray direction = wi
-
-		result += energy * (record.color * ndl) + ambient + specularLighting;
-		energy *= specular;
-		atmosphericLight *= 0.4f;
-		
-		lightDir = ray.direction;
+	uint binIndex = sortedValues[i], rayIndex = firstPixel + binIndex;
+	PathState path = LoadPath(savedPaths[binIndex]);
+
+	for (int numBounces = 1; numBounces < MAX_BOUNCES; ++numBounces)
+	{
+		SurfaceHit hit;
+		if (!FindClosestHit(path.ray, trace_args.numMeshes, meshInstances, instanceBounds, nodes, bvhParents, bvhIndices, triangles, stack, &hit)) {
+			path.result += SampleSkybox(texturePixels, textures + 2, path.ray.direction) * path.energy;
+			break;
+		}
+		if (!ShadeSurface(&path, &hit, numBounces, trace_args, textures, texturePixels, bvhIndices, triangles, 
+		                  nodes, materials, meshInstances, instanceBounds, bvhParents, stack)) break;
+	}
+
+	WriteShadedPixel(screen, (int2)(rayIndex % width, rayIndex / width), path.result, newHistory, rayIndex);
+}
+
+// gameplay and physics ray casts, one work item for each ray
+kernel void RayCast(
+	global const RayQuery* queries,
+	global RayQueryHit* hits,
+	uint numQueries,
+	uint numMeshes,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const BVHNode* nodes,
+	global const uint* bvhParents,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	global const uint* queryOrder // queries are binned by the host, hit of the query i is written to hits[queryOrder[i]]
+)
+{
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_id(0);
+
+	uint queryIndex = get_global_id(0);
+	if (queryIndex >= numQueries) return;
+
+	RayQuery query = queries[queryIndex];
+	Ray ray = CreateRay(vload3(0, query.origin), vload3(0, query.direction));
+	float3 invDir = native_recip(ray.direction);
+
+	Triout hitOut;
+	hitOut.t = query.tmax;
+	hitOut.triIndex = 0;
+	int hitInstanceIndex = -1;
+	for (int i = 0; i < numMeshes; ++i)
+	{
+		if ((meshInstances[i].mask & query.mask) == 0) continue;
+		if (IntersectAABB(ray.origin, invDir, instanceBounds[i].min.xyz, instanceBounds[i].max.xyz, hitOut.t) == 1e30f) continue;
+		MeshInstance instance = meshInstances[i];
+		Ray mRay;
+		mRay.origin = Mat3x4MulPoint(instance.inverseTransform, ray.origin);
+		mRay.direction = Mat3x4MulVector(instance.inverseTransform, ray.direction);
+		if (IntersectBVH(mRay, nodes, bvhParents, bvhIndices[instance.meshIndex], triangles, &hitOut, stack)) 
+			hitInstanceIndex = i;
 	}
+
+	RayQueryHit hit;
+	hit.distance = 1e30f;
+	hit.instance = hit.triangle = ~0u;
+	hit.u = hit.v = 0.0f;
+	hit.normal[0] = hit.normal[1] = hit.normal[2] = 0.0f;
 	
-	write_imagef(screen, (int2)(pixelX, pixelY), (float4)(result, 1.0f));
+	if (hitInstanceIndex != -1)
+	{
+		Matrix3x4 m = meshInstances[hitInstanceIndex].inverseTransform;
+		Triangle triangle = triangles[hitOut.triIndex];
+		float3 n = cross(triangle.edge1, triangle.edge2);
+		// transpose of the inverse transforms the normal to world space
+		n = normalize(m.x.xyz * n.x + m.y.xyz * n.y + m.z.xyz * n.z);
+		hit.distance = hitOut.t;
+		hit.instance = hitInstanceIndex;
+		hit.triangle = hitOut.triIndex;
+		hit.u = hitOut.u, hit.v = hitOut.v;
+		vstore3(n, 0, hit.normal);
+	}
+	hits[queryOrder[queryIndex]] = hit;
 }
 
-kernel void RayGen(global float* rays, Matrix4 inverseView, Matrix4 inverseProjection)
+// world space direction of the camera ray that goes through the screen position, coord is in [0, 1]
+float3 CameraRayDirection(Matrix4 inverseView, Matrix4 inverseProjection, float2 coord)
 {
-	const int i = get_global_id(0), j = get_global_id(1);
-	int width = get_global_size(0);
-	float2 coord = (float2)((float)i / (float)width, (float)j / (float)get_global_size(1));
 	coord = coord * 2.0f - 1.0f;
 	float4 target = MatMul(inverseProjection, (float4)(coord, 1.0f, 1.0f));
 	target /= target.w;
-	float3 rayDir = normalize(MatMul(inverseView, target).xyz);
-	vstore3(rayDir, i + j * width, rays);
+	return normalize(MatMul(inverseView, target).xyz);
+}
+
+// work can be a band of the frame (multi device rendering), so resolution is explicit
+kernel void RayGen(global float* rays, Matrix4 inverseView, Matrix4 inverseProjection, int2 resolution)
+{
+	const int i = get_global_id(0), j = get_global_id(1);
+	int width = resolution.x;
+	float2 coord = (float2)((float)i / (float)width, (float)j / (float)resolution.y);
+	vstore3(CameraRayDirection(inverseView, inverseProjection, coord), i + j * width, rays);
+}
+
+// bilinear upsampling of the dynamic resolution render target to the screen
+kernel void Upsample(read_only image2d_t source, write_only image2d_t screen, int2 sourceSize)
+{
+	int2 p = (int2)(get_global_id(0), get_global_id(1));
+	float2 sourceSizef = convert_float2(sourceSize);
+	float2 scale = sourceSizef / (float2)(get_global_size(0), get_global_size(1));
+	// only top left sourceSize part of the source is traced, clamp for not reading stale pixels
+	float2 coord = clamp(((float2)(p.x, p.y) + 0.5f) * scale, (float2)(0.5f), sourceSizef - 0.5f);
+
+	const sampler_t sampler = 
+		CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_LINEAR | CLK_ADDRESS_CLAMP_TO_EDGE;
+
+	write_imagef(screen, p, read_imagef(source, sampler, coord));
+}
+
+float Luma(float3 rgb)
+{
+	return dot(rgb, (float3)(0.299f, 0.587f, 0.114f));
+}
+
+// checkerboard mode, fills the pixels that are not traced this frame. launched for the half width like the Trace.
+// all 4 neighbours are traced this frame, pixel itself has the sample that is traced last frame.
+// neighbours are interpolated along the edge with the luma differences, last frame's sample is clamped to the neighbours 
+// and blended in by quality: 0 uses only the neighbours, 1 keeps the history as long as it fits in the neighbourhood.
+// ids are not reconstructed, they are in the bands of the devices, missing pixels keep last frame's ids for picking
+kernel void ReconstructCheckerboard(__read_write image2d_t screen, int missingParity, float quality)
+{
+	const int2 size = get_image_dim(screen);
+	const int y = get_global_id(1);
+	const int2 p = (int2)(get_global_id(0) * 2 + ((y + missingParity) & 1), y);
+	if (p.x >= size.x) return;
+	
+	float3 left  = read_imagef(screen, clamp(p + (int2)(-1,  0), (int2)(0), size - 1)).xyz;
+	float3 right = read_imagef(screen, clamp(p + (int2)( 1,  0), (int2)(0), size - 1)).xyz;
+	float3 up    = read_imagef(screen, clamp(p + (int2)( 0, -1), (int2)(0), size - 1)).xyz;
+	float3 down  = read_imagef(screen, clamp(p + (int2)( 0,  1), (int2)(0), size - 1)).xyz;
+	
+	float lumaL = Luma(left), lumaR = Luma(right), lumaU = Luma(up), lumaD = Luma(down);
+	float gradientX = fabs(lumaL - lumaR), gradientY = fabs(lumaU - lumaD);
+	// interpolate along the edge, not across it
+	float3 spatial = (left + right + up + down) * 0.25f;
+	if (gradientX < gradientY * 0.5f) spatial = (left + right) * 0.5f;
+	if (gradientY < gradientX * 0.5f) spatial = (up + down) * 0.5f;
+	
+	float3 history = read_imagef(screen, p).xyz;
+	float3 clamped = clamp(history, fmin(fmin(left, right), fmin(up, down)), fmax(fmax(left, right), fmax(up, down)));
+	// history that is far from the neighbourhood is disoccluded or moved, trust it less
+	float historyWeight = quality * (1.0f - clamp(fabs(Luma(history) - Luma(clamped)) * 8.0f, 0.0f, 1.0f));
+	write_imagef(screen, p, (float4)(mix(spatial, clamped, historyWeight), 1.0f));
+}
+
+// multi device checkerboard, copies the traced pixels of a secondary device's band to the screen. launched for the half width
+// with the band's first row as offset. other half of the band image is from older frames than the reconstructed screen pixels
+kernel void CopyCheckerboardBand(read_only image2d_t band, write_only image2d_t screen, int tracedParity, int width)
+{
+	const int y = get_global_id(1);
+	const int2 p = (int2)(get_global_id(0) * 2 + ((y + tracedParity) & 1), y);
+	if (p.x >= width) return;
+	write_imagef(screen, p, read_imagef(band, p));
+}
+
+// ---- ADAPTIVE SAMPLING ----
+// forward rendering only. while the camera and the scene are still, jittered samples of the pixels are accumulated over the frames.
+// AllocateSamples estimates the noise of each tile from the variance of the samples and appends the noisy tiles to a list,
+// TraceAdaptive traces one more sample only for the pixels of the listed tiles. sky and flat walls converge after the first 
+// few samples and cost nothing after that, edges and reflections keep getting samples until they are smooth
+#define SAMPLE_TILE_SIZE 8
+#define MIN_TILE_SAMPLES 4   // variance is not reliable with less samples
+#define MAX_TILE_SAMPLES 256
+
+// 32 byte with the padding, same as the host
+typedef struct _AccumulatedPixel {
+	float4 sum;  // rgb: sum of the samples, w: number of samples
+	float2 luma; // x: sum of the luma of the samples, y: sum of the squared luma
+} AccumulatedPixel;
+
+// launched with SAMPLE_TILE_SIZE x SAMPLE_TILE_SIZE work groups over the band, band: width, height, first row, end row.
+// error of the tile is the worst standard error of the mean luma relative to the luma, 
+// so dark pixels are allowed less absolute noise than bright ones
+kernel void AllocateSamples(const global AccumulatedPixel* accumulation, int4 band, float threshold, global uint* tileList, global uint* tileCount)
+{
+	const int2 p = (int2)(get_global_id(0), get_global_id(1));
+	float error = 0.0f, numSamples = MAX_TILE_SAMPLES;
+	if (p.x < band.x && p.y < band.w)
+	{
+		AccumulatedPixel pixel = accumulation[p.y * band.x + p.x];
+		numSamples = pixel.sum.w;
+		float n = fmax(numSamples, 1.0f);
+		float mean = pixel.luma.x / n;
+		float variance = fmax(pixel.luma.y / n - mean * mean, 0.0f) * n / fmax(n - 1.0f, 1.0f); // unbiased
+		error = sqrt(variance / n) / (mean + 0.05f);
+	}
+	// all work items has to reach the reductions
+	float tileError = work_group_reduce_max(error);
+	float tileSamples = work_group_reduce_min(numSamples);
+	if (get_local_linear_id() != 0 || tileSamples >= MAX_TILE_SAMPLES) return;
+	if (tileSamples >= MIN_TILE_SAMPLES && tileError < threshold) return; // converged
+	tileList[atomic_inc(tileCount)] = get_group_id(0) | (get_group_id(1) << 16);
+}
+
+// launched with one work group of SAMPLE_TILE_SIZE^2 items for each tile of the band, groups that are not in the list return.
+// pixels are sampled at a random position in the pixel, first sample of the pixel writes the ids
+kernel void TraceAdaptive(
+	global const Texture* textures,
+	global const uint* texturePixels,
+	global const uint* bvhIndices,
+	global const Triangle* triangles,
+	TraceArgs trace_args,
+	global const BVHNode* nodes,
+	global const Material* materials,
+	global const MeshInstance* meshInstances,
+	global const InstanceBounds* instanceBounds,
+	global const uint* bvhParents,
+	global uint* idBuffer,
+	global AccumulatedPixel* accumulation,
+	const global uint* tileList,
+	const global uint* tileCount,
+	Matrix4 inverseView,
+	Matrix4 inverseProjection,
+	int4 band,       // width, height, first row, end row
+	uint sampleIndex // samples since the accumulation is reset
+)
+{
+	if (get_group_id(0) >= *tileCount) return;
+
+	local uint traversalStacks[SHORT_STACK_SIZE * MAX_STACK_GROUP_SIZE];
+	TraversalStack stack;
+	stack.stride   = get_local_size(0);
+	stack.capacity = stack.stride <= MAX_STACK_GROUP_SIZE ? SHORT_STACK_SIZE : 0;
+	stack.entries  = traversalStacks + get_local_id(0);
+
+	uint tile = tileList[get_group_id(0)];
+	const int pixelX = (tile & 0xFFFFu) * SAMPLE_TILE_SIZE + get_local_id(0) % SAMPLE_TILE_SIZE;
+	const int pixelY = band.z + (tile >> 16) * SAMPLE_TILE_SIZE + get_local_id(0) / SAMPLE_TILE_SIZE;
+	if (pixelX >= band.x || pixelY >= band.w) return;
+	int rayIndex = pixelY * band.x + pixelX;
+
+	uint random = WangHash(rayIndex ^ WangHash(sampleIndex + 1u)) | 1u; // xorshift state can't be zero
+	float2 jitter = (float2)(NextFloat01(&random), NextFloat01(&random));
+	float2 coord = ((float2)(pixelX, pixelY) + jitter) / convert_float2(band.xy);
+	Ray ray = CreateRay(vload3(0, trace_args.cameraPos), CameraRayDirection(inverseView, inverseProjection, coord));
+
+	AccumulatedPixel pixel = accumulation[rayIndex];
+	float3 result = TracePath(ray, rayIndex, pixel.sum.w == 0.0f ? idBuffer : 0, trace_args, textures, texturePixels, bvhIndices, triangles, 
+	                          nodes, materials, meshInstances, instanceBounds, bvhParents, stack);
+	float luma = Luma(result);
+	pixel.sum  += (float4)(result, 1.0f);
+	pixel.luma += (float2)(luma, luma * luma);
+	accumulation[rayIndex] = pixel;
+}
+
+// mean of the accumulated samples, launched over the band
+kernel void ResolveAccumulation(write_only image2d_t screen, const global AccumulatedPixel* accumulation, int width)
+{
+	int2 p = (int2)(get_global_id(0), get_global_id(1));
+	float4 sum = accumulation[p.y * width + p.x].sum;
+	write_imagef(screen, p, (float4)(sum.xyz / fmax(sum.w, 1.0f), 1.0f));
 }
 
 // https://www.shadertoy.com/view/4tf3D8
@@ -304,13 +1183,11 @@ float3 FXAA(__read_write image2d_t screen, float3 rgb, float2 uv, int2 p, float2
 	float3 rgbSW = read_imagef(screen, p + (int2)(-1,  1)).xyz;
 	float3 rgbSE = read_imagef(screen, p + (int2)( 1,  1)).xyz;
 	
-	float3 luma = (float3)(0.299f, 0.587f, 0.114f);
-	
-	float lumaNW = dot(rgbNW, luma);
-	float lumaNE = dot(rgbNE, luma);
-	float lumaSW = dot(rgbSW, luma);
-	float lumaSE = dot(rgbSE, luma);
-	float lumaM  = dot(rgb,  luma);
+	float lumaNW = Luma(rgbNW);
+	float lumaNE = Luma(rgbNE);
+	float lumaSW = Luma(rgbSW);
+	float lumaSE = Luma(rgbSE);
+	float lumaM  = Luma(rgb);
 	
 	float2 dir;
 	dir.x = -((lumaNW + lumaNE) - (lumaSW + lumaSE));
@@ -330,7 +1207,7 @@ float3 FXAA(__read_write image2d_t screen, float3 rgb, float2 uv, int2 p, float2
 		read_imagef(screen, sampler, uv + dir * -0.5f) +
 		read_imagef(screen, sampler, uv + dir *  0.5f)).xyz;
    
-	float lumaB = dot(rgbB, luma);
+	float lumaB = Luma(rgbB);
    
 	float lumaMin = fmin(lumaM, fmin(fmin(lumaNW, lumaNE), fmin(lumaSW, lumaSE)));
 	float lumaMax = fmax(lumaM, fmax(fmax(lumaNW, lumaNE), fmax(lumaSW, lumaSE)));